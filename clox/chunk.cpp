@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "chunk.h"
 #include "memory.h"
 #include "vm.h"
@@ -8,24 +10,184 @@ void initChunk(Chunk* chunk)
     chunk->capacity = 0;
     chunk->code = NULL;
     initValueArray(&chunk->constants);
+    chunk->locations = NULL;
     chunk->lines = NULL;
+    chunk->lineSize = 0;
+    chunk->tables = NULL;
+    chunk->tableCount = 0;
+    chunk->calls = NULL;
+    chunk->callCount = 0;
+    chunk->callCapacity = 0;
 }
 
-void writeChunk(Chunk* chunk,  uint8_t byte, int line)
+void writeChunk(Chunk* chunk,  uint8_t byte, int line, int column)
 {
     if (chunk->capacity < chunk->count + 1)
     {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = (uint8_t*)arenaGrow(&vm.codeArena, chunk->code,
+                                          oldCapacity, chunk->capacity);
+        chunk->locations = (Location*)arenaGrow(
+            &vm.codeArena, chunk->locations,
+            sizeof(Location) * oldCapacity, sizeof(Location) * chunk->capacity);
     }
     
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
+    chunk->locations[chunk->count].line = line;
+    chunk->locations[chunk->count].column = column;
     chunk->count++;
 }
 
+void packChunk(Chunk* chunk)
+{
+    int count = chunk->count;
+    int lineSize = encodeLines(chunk->locations, count, NULL);
+    uint8_t* code = NULL;
+    if (count > 0)
+    {
+        code = (uint8_t*)allocateCode(&vm.codeSpace, count + lineSize);
+        memcpy(code, chunk->code, count);
+        encodeLines(chunk->locations, count, code + count);
+        sealCode(code, count + lineSize);
+    }
+    chunk->code = code;
+    chunk->capacity = count;
+    chunk->locations = NULL;
+    chunk->lines = code != NULL ? code + count : NULL;
+    chunk->lineSize = lineSize;
+    
+    ValueArray* constants = &chunk->constants;
+    constants->values = GROW_ARRAY(Value, constants->values,
+                                   constants->capacity, constants->count);
+    constants->capacity = constants->count;
+    chunk->calls = GROW_ARRAY(CallCache, chunk->calls,
+                              chunk->callCapacity, chunk->callCount);
+    chunk->callCapacity = chunk->callCount;
+}
+
+Location chunkLocation(Chunk* chunk, int offset)
+{
+    if (chunk->locations != NULL) return chunk->locations[offset];
+    return decodeLine(chunk->lines, chunk->lineSize, offset);
+}
+
+void chunkLocations(Chunk* chunk, Location* locations)
+{
+    if (chunk->locations != NULL)
+    {
+        memcpy(locations, chunk->locations, sizeof(Location) * chunk->count);
+        return;
+    }
+    decodeLines(chunk->lines, chunk->lineSize, locations, chunk->count);
+}
+
+static int writeVarint(uint8_t* out, int size, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        if (out != NULL) out[size] = (uint8_t)(value | 0x80);
+        size++;
+        value >>= 7;
+    }
+    if (out != NULL) out[size] = (uint8_t)value;
+    return size + 1;
+}
+
+static uint32_t readVarint(uint8_t** bytes)
+{
+    uint32_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do
+    {
+        byte = *(*bytes)++;
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+// Line deltas can be negative, so they are zigzag encoded: 0, -1, 1, -2
+// and so on become 0, 1, 2, 3.
+static uint32_t zigzag(int delta)
+{
+    return ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+}
+
+static int unzigzag(uint32_t value)
+{
+    return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+int encodeLines(Location* locations, int count, uint8_t* out)
+{
+    int size = 0;
+    int offset = 0;
+    Location last = {0, 0};
+    for (int i = 0; i < count; i++)
+    {
+        Location location = locations[i];
+        if (i > 0 && location.line == last.line &&
+            location.column == last.column)
+        {
+            continue;
+        }
+        size = writeVarint(out, size, i - offset);
+        size = writeVarint(out, size, zigzag(location.line - last.line));
+        size = writeVarint(out, size, (uint32_t)location.column);
+        offset = i;
+        last = location;
+    }
+    return size;
+}
+
+// Reads the entry at *bytes into the run's offset and location.
+static void readEntry(uint8_t** bytes, int* offset, Location* location)
+{
+    *offset += readVarint(bytes);
+    location->line += unzigzag(readVarint(bytes));
+    location->column = (int)readVarint(bytes);
+}
+
+Location decodeLine(uint8_t* lines, int size, int offset)
+{
+    uint8_t* bytes = lines;
+    uint8_t* end = lines + size;
+    int start = 0;
+    Location location = {0, 0};
+    while (bytes < end)
+    {
+        int next = start;
+        Location nextLocation = location;
+        readEntry(&bytes, &next, &nextLocation);
+        if (next > offset) break;
+        start = next;
+        location = nextLocation;
+    }
+    return location;
+}
+
+void decodeLines(uint8_t* lines, int size, Location* locations, int count)
+{
+    uint8_t* bytes = lines;
+    uint8_t* end = lines + size;
+    int start = 0;
+    Location location = {0, 0};
+    if (bytes < end) readEntry(&bytes, &start, &location);
+    
+    while (bytes < end)
+    {
+        int next = start;
+        Location nextLocation = location;
+        readEntry(&bytes, &next, &nextLocation);
+        for (int i = start; i < next; i++) locations[i] = location;
+        start = next;
+        location = nextLocation;
+    }
+    for (int i = start; i < count; i++) locations[i] = location;
+}
+
 int addConstant(Chunk* chunk, Value value)
 {
     push(value);
@@ -34,10 +196,308 @@ int addConstant(Chunk* chunk, Value value)
     return chunk->constants.count - 1;
 }
 
+int addTable(Chunk* chunk)
+{
+    chunk->tables = GROW_ARRAY(Table, chunk->tables,
+                               chunk->tableCount, chunk->tableCount + 1);
+    initTable(&chunk->tables[chunk->tableCount]);
+    return chunk->tableCount++;
+}
+
+int addCallSite(Chunk* chunk)
+{
+    if (chunk->callCapacity < chunk->callCount + 1)
+    {
+        int oldCapacity = chunk->callCapacity;
+        chunk->callCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->calls = GROW_ARRAY(CallCache, chunk->calls,
+                                  oldCapacity, chunk->callCapacity);
+    }
+    CallCache* cache = &chunk->calls[chunk->callCount];
+    cache->type = 0;
+    cache->target = NULL;
+    return chunk->callCount++;
+}
+
+// Length of the instruction at offset when it follows OP_WIDE.
+static int wideInstructionLength(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+            return 5;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_CLOSURE:
+        case OP_CALL_NATIVE:
+        case OP_CALL_CLASS:
+        case OP_CALL_BOUND_METHOD:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_SUPER_INVOKE:
+            return 4;
+        case OP_CLOSURE:
+        {
+            uint8_t* code = &chunk->code[offset];
+            Value constant = chunk->constants.values[(code[1] << 8) | code[2]];
+            return 3 + 3 * AS_FUNCTION(constant)->upvalueCount;
+        }
+        default:
+            return 3;
+    }
+}
+
+int instructionLength(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_ENCLOSING:
+        case OP_SET_ENCLOSING:
+        case OP_CLASS:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+        case OP_INLINE_RETURN:
+            return 2;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_ADD_LOCAL:
+        case OP_ADD_PROPERTY:
+        case OP_INTRINSIC:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_CLOSURE:
+        case OP_CALL_NATIVE:
+        case OP_CALL_CLASS:
+        case OP_CALL_BOUND_METHOD:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_SUPER_INVOKE:
+            return 3;
+        case OP_CLOSURE:
+        {
+            Value constant = chunk->constants.values[chunk->code[offset + 1]];
+            return 2 + 2 * AS_FUNCTION(constant)->upvalueCount;
+        }
+        case OP_LOCAL_CLOSURE:
+        {
+            Value constant = chunk->constants.values[chunk->code[offset + 1]];
+            return 2 + 2 * AS_CLOSURE(constant)->upvalueCount;
+        }
+        case OP_FOR_LOOP:
+        case OP_FOR_LOOP_CONSTANT:
+            return 4;
+        case OP_JUMP_TABLE:
+        case OP_JUMP_TABLE_STRING:
+            return 5;
+        case OP_REUSE_PROPERTY:
+            return 4;
+        case OP_INLINE_CALL:
+            return 6;
+        case OP_INLINE_INVOKE:
+            return 8;
+        case OP_WIDE:
+            return 1 + wideInstructionLength(chunk, offset + 1);
+        default:
+            return 1;
+    }
+}
+
+// The instructions stackHeight() has yet to follow.
+typedef struct
+{
+    // Height of the stack reaching each offset, or -1.
+    int* heights;
+    bool* queued;
+    int* pending;
+    int pendingCount;
+} HeightWalk;
+
+// Queues the instruction at offset to be followed with height values on
+// the stack, unless it was reached with as many already.
+static void reach(HeightWalk* walk, int offset, int height)
+{
+    if (walk->heights[offset] >= height) return;
+    walk->heights[offset] = height;
+    if (walk->queued[offset]) return;
+    walk->queued[offset] = true;
+    walk->pending[walk->pendingCount++] = offset;
+}
+
+int stackHeight(Chunk* chunk, int base, int* heights)
+{
+    HeightWalk walk;
+    walk.heights = heights != NULL ? heights : ALLOCATE(int, chunk->count);
+    walk.queued = ALLOCATE(bool, chunk->count);
+    walk.pending = ALLOCATE(int, chunk->count);
+    walk.pendingCount = 0;
+    for (int i = 0; i < chunk->count; i++)
+    {
+        walk.heights[i] = -1;
+        walk.queued[i] = false;
+    }
+    int max = base;
+    if (chunk->count > 0) reach(&walk, 0, base);
+    
+    while (walk.pendingCount > 0)
+    {
+        int offset = walk.pending[--walk.pendingCount];
+        walk.queued[offset] = false;
+        int height = walk.heights[offset];
+        bool wide = chunk->code[offset] == OP_WIDE;
+        uint8_t* bytes = &chunk->code[wide ? offset + 1 : offset];
+        int width = wide ? 2 : 1;
+        int next = offset + instructionLength(chunk, offset);
+        int after = height;
+        // How high the stack gets while the instruction runs.
+        int peak = height;
+        
+        switch (bytes[0])
+        {
+            case OP_CONSTANT:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_DUP:
+            case OP_GET_GLOBAL:
+            case OP_GET_LOCAL:
+            case OP_ADD_LOCAL:
+            case OP_CLOSURE:
+            case OP_LOCAL_CLOSURE:
+            case OP_GET_UPVALUE:
+            case OP_GET_ENCLOSING:
+            case OP_CLASS:
+                after = height + 1;
+                break;
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_ADD_NUMBER:
+            case OP_SUBTRACT_NUMBER:
+            case OP_MULTIPLY_NUMBER:
+            case OP_DIVIDE_NUMBER:
+            case OP_GREATER_NUMBER:
+            case OP_LESS_NUMBER:
+            case OP_PRINT:
+            case OP_POP:
+            case OP_DEFINE_GLOBAL:
+            case OP_CLOSE_UPVALUE:
+            case OP_SET_PROPERTY:
+            case OP_METHOD:
+            case OP_INHERIT:
+            case OP_GET_SUPER:
+                after = height - 1;
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL:
+            case OP_CALL_CLOSURE:
+            case OP_CALL_NATIVE:
+            case OP_CALL_CLASS:
+            case OP_CALL_BOUND_METHOD:
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE:
+                after = height - bytes[1 + width];
+                break;
+            case OP_SUPER_INVOKE:
+                // The superclass is popped as well.
+                after = height - bytes[1 + width] - 1;
+                break;
+            case OP_INTRINSIC:
+                // A rebound intrinsic puts the callee under the arguments.
+                after = height - bytes[2] + 1;
+                peak = height + 1;
+                break;
+            case OP_JUMP:
+            case OP_LOOP:
+            case OP_JUMP_IF_FALSE:
+            {
+                int jump = (bytes[1] << 8) | bytes[2];
+                if (wide)
+                {
+                    jump = (bytes[1] << 24) | (bytes[2] << 16) |
+                           (bytes[3] << 8) | bytes[4];
+                }
+                int target = bytes[0] == OP_LOOP ? next - jump : next + jump;
+                reach(&walk, target, height);
+                if (bytes[0] != OP_JUMP_IF_FALSE) next = -1;
+                break;
+            }
+            case OP_FOR_LOOP:
+            case OP_FOR_LOOP_CONSTANT:
+            {
+                // Leaving the loop pushes false and skips the OP_LOOP.
+                int skip = next + instructionLength(chunk, next);
+                if (skip < chunk->count)
+                {
+                    reach(&walk, skip, height + 1);
+                }
+                peak = height + 1;
+                break;
+            }
+            case OP_JUMP_TABLE:
+            case OP_JUMP_TABLE_STRING:
+            {
+                // Each of the count + 1 wide entries is taken with the
+                // value popped.
+                int count = (bytes[3] << 8) | bytes[4];
+                for (int i = 0; i <= count; i++)
+                {
+                    reach(&walk, next + 6 * i, height - 1);
+                }
+                next = -1;
+                break;
+            }
+            case OP_RETURN:
+                next = -1;
+                break;
+            default:
+                break;
+        }
+        
+        if (after > peak) peak = after;
+        if (peak > max) max = peak;
+        if (next != -1 && next < chunk->count)
+        {
+            reach(&walk, next, after);
+        }
+    }
+    
+    if (heights == NULL) FREE_ARRAY(int, walk.heights, chunk->count);
+    FREE_ARRAY(bool, walk.queued, chunk->count);
+    FREE_ARRAY(int, walk.pending, chunk->count);
+    return max;
+}
+
 void freeChunk(Chunk* chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    // The line table shares the code's block.
+    if (chunk->code != NULL)
+    {
+        freeCode(&vm.codeSpace, chunk->code,
+                 chunk->capacity + chunk->lineSize);
+    }
     freeValueArray(&chunk->constants);
+    for (int i = 0; i < chunk->tableCount; i++)
+    {
+        freeTable(&chunk->tables[i]);
+    }
+    FREE_ARRAY(Table, chunk->tables, chunk->tableCount);
+    FREE_ARRAY(CallCache, chunk->calls, chunk->callCapacity);
     initChunk(chunk);
 }
@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "value.h"
+#include "table.h"
 
 typedef enum
 {
@@ -18,42 +19,163 @@ typedef enum
     OP_DIVIDE,
     OP_NOT,
     OP_NEGATE,
+    // Arithmetic on operands known to be numbers, emitted by the
+    // optimizing tier. They skip the type checks.
+    OP_ADD_NUMBER,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+    OP_NEGATE_NUMBER,
+    OP_GREATER_NUMBER,
+    OP_LESS_NUMBER,
     OP_PRINT,
     OP_POP,
+    OP_DUP,
+    // Swaps the two values on top of the stack.
+    OP_SWAP,
     OP_DEFINE_GLOBAL,
     OP_GET_GLOBAL,
     OP_SET_GLOBAL,
     OP_GET_LOCAL,
     OP_SET_LOCAL,
+    // slot, step: adds the number constant step to the local in place
+    // and pushes the sum.
+    OP_ADD_LOCAL,
     OP_JUMP_IF_FALSE,
     OP_JUMP,
     OP_LOOP,
+    // slot, step, limit: adds the constant step to the local and, unless
+    // it is still below the limit, pushes false and skips the OP_LOOP
+    // that follows. The limit is a local, or a constant for the second.
+    OP_FOR_LOOP,
+    OP_FOR_LOOP_CONSTANT,
+    // Pop a value and go on through its entry among the count + 1 wide
+    // OP_JUMP or OP_LOOP instructions that follow. The last entry is for
+    // values no other one is. OP_JUMP_TABLE takes a constant, the integer
+    // of the first entry, and the count; OP_JUMP_TABLE_STRING takes one
+    // of the chunk's tables, mapping strings to entries, and the count.
+    OP_JUMP_TABLE,
+    OP_JUMP_TABLE_STRING,
+    // call site, argument count: the call site indexes the chunk's call
+    // caches.
     OP_CALL,
+    OP_TAIL_CALL,
+    // The same for a call the optimizing tier found calling one kind of
+    // callee. They check the callee is of that kind, which skips the
+    // switch over kinds, and make other calls as OP_CALL.
+    OP_CALL_CLOSURE,
+    OP_CALL_NATIVE,
+    OP_CALL_CLASS,
+    OP_CALL_BOUND_METHOD,
+    // intrinsic, argument count: runs the math native the compiler found
+    // by name, or calls the global if it was assigned since.
+    OP_INTRINSIC,
     OP_CLOSURE,
+    // A local function's closure, shared by every call of the enclosing
+    // function. It reads the variables it captures from the frame below
+    // with OP_GET_ENCLOSING and OP_SET_ENCLOSING.
+    OP_LOCAL_CLOSURE,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
+    OP_GET_ENCLOSING,
+    OP_SET_ENCLOSING,
     OP_CLOSE_UPVALUE,
     OP_CLASS,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
+    // name, step: the same for a field of the instance on the stack,
+    // found with one lookup.
+    OP_ADD_PROPERTY,
     OP_METHOD,
     OP_INVOKE,
+    OP_TAIL_INVOKE,
     OP_INHERIT,
     OP_GET_SUPER,
     OP_SUPER_INVOKE,
-    OP_RETURN
+    // A callee's body copied into optimized code, entered when the
+    // callee is the one it was copied from. Otherwise the call is made
+    // and the body jumped over.
+    OP_INLINE_CALL,
+    OP_INLINE_INVOKE,
+    OP_INLINE_RETURN,
+    // slot, name: a property of the instance on the stack that was read
+    // before, with nothing stored or called since, and kept in the slot.
+    // A bound method is read again, since reading a method binds a new
+    // one each time.
+    OP_REUSE_PROPERTY,
+    OP_RETURN,
+    // Prefix for an instruction whose 1-byte operand doesn't fit: the
+    // operand that follows is 2 bytes, or 4 for a jump offset.
+    OP_WIDE
 } OpCode;
 
+// Where a byte of code came from in the source.
+typedef struct
+{
+    int line;
+    int column;
+} Location;
+
+// What a call site called last. Calling the same object again skips
+// looking up what kind it is and checking its arity, which the call that
+// filled the cache did.
+typedef struct
+{
+    // The ObjType of target, which is NULL until a call from the site
+    // succeeds.
+    uint8_t type;
+    OBJ_REF(Obj) target;
+} CallCache;
+
 typedef struct
 {
     int count;
     int capacity;
     uint8_t* code;
     ValueArray constants;
-    int* lines;
+    // The location of each byte, while the chunk is compiled.
+    Location* locations;
+    // Once it is packed, the line table that replaces them, after the
+    // code in the same block.
+    uint8_t* lines;
+    int lineSize;
+    // Tables of OP_JUMP_TABLE_STRING instructions.
+    Table* tables;
+    int tableCount;
+    // Caches of OP_CALL and OP_TAIL_CALL instructions.
+    CallCache* calls;
+    int callCount;
+    int callCapacity;
 } Chunk;
 
 void initChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk,  uint8_t byte, int line);
+// Code and locations grow in vm.codeArena while the chunk is compiled.
+void writeChunk(Chunk* chunk,  uint8_t byte, int line, int column);
+// Moves the chunk's code out of the arena into one read-only block of
+// vm.codeSpace, of its exact size, followed by the line table, and trims
+// the constants to theirs.
+void packChunk(Chunk* chunk);
+Location chunkLocation(Chunk* chunk, int offset);
+// Fills in the location of each of the chunk's bytes.
+void chunkLocations(Chunk* chunk, Location* locations);
+// A line table has an entry for each run of bytes from the same place:
+// the run's offset, line and column as varints, the first two relative
+// to the run before, which takes a few bytes where an int per byte took
+// four. Writes the table of count bytes to out, unless it is NULL, and
+// returns its size.
+int encodeLines(Location* locations, int count, uint8_t* out);
+// Location of the byte at offset, read from the start of the table.
+Location decodeLine(uint8_t* lines, int size, int offset);
+void decodeLines(uint8_t* lines, int size, Location* locations, int count);
 int addConstant(Chunk* chunk, Value value);
+// Adds an empty table and returns its index.
+int addTable(Chunk* chunk);
+// Adds an empty call cache and returns its index.
+int addCallSite(Chunk* chunk);
+int instructionLength(Chunk* chunk, int offset);
+// The most values the chunk's code has on the stack at once, following
+// every path from its start with base values there. If heights isn't
+// NULL, it gets the height at each instruction's offset, or -1 where no
+// instruction is reached.
+int stackHeight(Chunk* chunk, int base, int* heights);
 void freeChunk(Chunk* chunk);
@@ -6,6 +6,11 @@
 
 //#define DEBUG_TRACE_EXECUTION
 //#define DEBUG_PRINT_CODE
+//#define DEBUG_PRINT_UNOPTIMIZED_CODE
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
+//#define DEBUG_VERIFY_TYPES
+//#define DEBUG_VERIFY_ENCLOSING
+//#define POINTER_COMPRESSION
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
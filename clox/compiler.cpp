@@ -7,8 +7,11 @@
 #include "scanner.h"
 #include "object.h"
 #include "memory.h"
+#include "vm.h"
+#include "optimizer.h"
+#include "tier.h"
 
-#ifdef DEBUG_PRINT_CODE
+#if defined(DEBUG_PRINT_CODE) || defined(DEBUG_PRINT_UNOPTIMIZED_CODE)
 #include "debug.h"
 #endif
 
@@ -49,7 +52,13 @@ typedef struct
 {
     Token name;
     int depth;
-    bool isCaptured;
+    // Closures that capture the local. Local functions read it in place
+    // and stop counting once they are known to be one.
+    int captures;
+    // Offset of the OP_CLOSURE that made a local function, or -1.
+    int closure;
+    // Set when the local is used other than by calling it.
+    bool escapes;
 } Local;
 
 typedef enum
@@ -62,7 +71,7 @@ typedef enum
 
 typedef struct
 {
-    uint8_t index;
+    int index;
     bool isLocal;
 } Upvalue;
 
@@ -71,10 +80,28 @@ struct Compiler
     Compiler* enclosing;
     ObjFunction* function;
     FunctionType type;
-    Local locals[UINT8_COUNT];
-    Upvalue upvalues[UINT8_COUNT];
+    Local* locals;
+    int localCapacity;
+    Upvalue* upvalues;
+    int upvalueCapacity;
     int localCount;
     int scopeDepth;
+    // Offset of the most recent OP_CALL or OP_INVOKE, including any
+    // OP_WIDE prefix, or -1.
+    int lastCall;
+    // Local that was just loaded to be called, or -1.
+    int calleeLocal;
+    // Hash index of the chunk's constants, so each value is added once.
+    // A slot holds 1 + the constant's index, or 0 when empty.
+    int* constantSlots;
+    int constantCapacity;
+    // Where the arena stood before this function's code was built.
+    ArenaMark arenaMark;
+    // Local functions declared in this one, left in the arena until its
+    // end, when localizeClosure() has patched them if it is going to.
+    ObjFunction** unpacked;
+    int unpackedCount;
+    int unpackedCapacity;
 };
 
 typedef struct ClassCompiler
@@ -84,23 +111,66 @@ typedef struct ClassCompiler
     bool hasSuperclass;
 } ClassCompiler;
 
+// The parameter list and body of a function compiled on its first call,
+// copied out of the script, which is gone by then.
+struct LazyFunction
+{
+    char* source;
+    int length;
+    int line;
+    int column;
+    FunctionType type;
+    // The class the function is a method of, if any.
+    bool inClass;
+    bool hasSuperclass;
+    // The names the function's upvalues were resolved from, pointing into
+    // source.
+    Token* upvalues;
+    int upvalueCount;
+};
+
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
-
-static void initCompiler(Compiler* compiler, FunctionType type)
+// Where the left operand of the infix expression being compiled starts.
+int operandStart = 0;
+// How many expressions the one being compiled is nested in, and that
+// depth for an expression statement, whose value is popped unused.
+int expressionDepth = 0;
+int unusedDepth = -1;
+// A prefix `++` or `--` waiting for the variable or field it updates, and
+// the depth of its operand, or -1.
+Token prefixOperator;
+int prefixDepth = -1;
+
+static void initCompiler(Compiler* compiler, FunctionType type,
+                         ObjFunction* function)
 {
     compiler->enclosing = current;
     compiler->type = type;
+    compiler->locals = NULL;
+    compiler->localCapacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalueCapacity = 0;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
+    compiler->lastCall = -1;
+    compiler->calleeLocal = -1;
+    compiler->constantSlots = NULL;
+    compiler->constantCapacity = 0;
+    compiler->arenaMark = arenaMark(&vm.codeArena);
+    compiler->unpacked = NULL;
+    compiler->unpackedCount = 0;
+    compiler->unpackedCapacity = 0;
+    compiler->function = function;
     current = compiler;
     
-    if (type != TYPE_SCRIPT)
+    if (type != TYPE_SCRIPT && function->name == NULL)
     {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
     }
     
+    current->localCapacity = GROW_CAPACITY(0);
+    current->locals = GROW_ARRAY(Local, NULL, 0, current->localCapacity);
     Local* local = &current->locals[current->localCount++];
     local->depth = 0;
     if (type != TYPE_FUNCTION)
@@ -113,7 +183,9 @@ static void initCompiler(Compiler* compiler, FunctionType type)
         local->name.start = "";
         local->name.length = 0;
     }
-    local->isCaptured = false;
+    local->captures = 0;
+    local->closure = -1;
+    local->escapes = false;
 }
 
 static Chunk* currentChunk()
@@ -183,7 +255,15 @@ static void consume(TokenType type, const char* message)
 
 static void emitByte(uint8_t byte)
 {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeChunk(currentChunk(), byte, parser.previous.line,
+               parser.previous.column);
+}
+
+// Emits the byte at the token's location instead, for an operator whose
+// instruction follows its operands.
+static void emitByteAt(uint8_t byte, Token* token)
+{
+    writeChunk(currentChunk(), byte, token->line, token->column);
 }
 
 static void emitBytes(uint8_t byte1, uint8_t byte2)
@@ -192,6 +272,21 @@ static void emitBytes(uint8_t byte1, uint8_t byte2)
     emitByte(byte2);
 }
 
+// Emits an instruction with a constant, slot or upvalue operand, behind
+// an OP_WIDE prefix if the operand needs two bytes.
+static void emitOperand(uint8_t instruction, int operand)
+{
+    if (operand > UINT8_MAX)
+    {
+        emitBytes(OP_WIDE, instruction);
+        emitBytes((operand >> 8) & 0xff, operand & 0xff);
+    }
+    else
+    {
+        emitBytes(instruction, (uint8_t)operand);
+    }
+}
+
 static void emitReturn()
 {
     if (current->type == TYPE_INITIALIZER)
@@ -205,30 +300,350 @@ static void emitReturn()
     emitByte(OP_RETURN);
 }
 
+// Whether the function's upvalues are all read by its own upvalue
+// instructions, which can be pointed at the enclosing frame instead.
+static bool capturesInPlace(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+    {
+        bool wide = chunk->code[offset] == OP_WIDE;
+        uint8_t* code = &chunk->code[wide ? offset + 1 : offset];
+        switch (code[0])
+        {
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE:
+                if (wide) return false;
+                break;
+            case OP_CLOSURE:
+            {
+                // Closures inside it may only capture its own locals.
+                int width = wide ? 2 : 1;
+                int constant = wide ? (code[1] << 8) | code[2] : code[1];
+                ObjFunction* inner =
+                    AS_FUNCTION(chunk->constants.values[constant]);
+                uint8_t* upvalue = code + 1 + width;
+                for (int i = 0; i < inner->upvalueCount; i++)
+                {
+                    if (!upvalue[0]) return false;
+                    upvalue += 1 + width;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+// A local function that is only ever called where it is declared can't
+// outlive the frame it captures from. It reads and writes the captured
+// variables there, and gets one shared closure, so neither the closure
+// nor its upvalues are allocated.
+static void localizeClosure(Local* local)
+{
+    if (local->closure == -1 || local->escapes || parser.hadError) return;
+    
+    Chunk* chunk = currentChunk();
+    uint8_t* code = &chunk->code[local->closure];
+    Value* constant = &chunk->constants.values[code[1]];
+    ObjFunction* function = AS_FUNCTION(*constant);
+    uint8_t* upvalues = code + 2;
+    for (int i = 0; i < function->upvalueCount; i++)
+    {
+        // Upvalues of the enclosing function stay on the heap.
+        if (!upvalues[2 * i]) return;
+    }
+    if (!capturesInPlace(function)) return;
+    
+    Chunk* body = &function->chunk;
+    for (int offset = 0; offset < body->count;
+         offset += instructionLength(body, offset))
+    {
+        uint8_t* instruction = &body->code[offset];
+        if (instruction[0] != OP_GET_UPVALUE &&
+            instruction[0] != OP_SET_UPVALUE)
+        {
+            continue;
+        }
+        instruction[0] = instruction[0] == OP_GET_UPVALUE ? OP_GET_ENCLOSING
+                                                          : OP_SET_ENCLOSING;
+        instruction[1] = upvalues[2 * instruction[1] + 1];
+    }
+    for (int i = 0; i < function->upvalueCount; i++)
+    {
+        current->locals[upvalues[2 * i + 1]].captures--;
+    }
+    
+    push(OBJ_VAL(function));
+    ObjClosure* closure = newClosure(function);
+    pop();
+    *constant = OBJ_VAL(closure);
+    code[0] = OP_LOCAL_CLOSURE;
+    local->closure = -1;
+}
+
 static ObjFunction* endCompiler()
 {
+    // Locals of the outermost scope are never popped by endScope().
+    for (int i = current->localCount - 1; i > 0; i--)
+    {
+        localizeClosure(&current->locals[i]);
+    }
     emitReturn();
     ObjFunction* function = current->function;
+    
+    if (!parser.hadError)
+    {
+#ifdef DEBUG_PRINT_UNOPTIMIZED_CODE
+        printf("(before optimization) ");
+        disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+#endif
+        optimizeChunk(currentChunk());
+        // The frame also has room for the one value the VM or the
+        // compiler pushes of its own at a time, to keep a new object
+        // from the collector.
+        function->maxSlots = stackHeight(currentChunk(),
+                                         function->arity + 1, NULL) + 1;
+        inferTypes(function);
+    }
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError)
     {
         disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
     }
 #endif
+    for (int i = 0; i < current->unpackedCount; i++)
+    {
+        packChunk(&current->unpacked[i]->chunk);
+    }
+    current->unpackedCount = 0;
+    
+    // A local function with upvalues may still be localized, so it is
+    // packed with the function it is declared in. Its code stays in the
+    // arena until then, and packed code is never written.
+    Compiler* enclosing = current->enclosing;
+    if (enclosing != NULL && current->type == TYPE_FUNCTION &&
+        enclosing->scopeDepth > 0 && function->upvalueCount > 0 &&
+        !parser.hadError)
+    {
+        if (enclosing->unpackedCapacity < enclosing->unpackedCount + 1)
+        {
+            int oldCapacity = enclosing->unpackedCapacity;
+            enclosing->unpackedCapacity = GROW_CAPACITY(oldCapacity);
+            enclosing->unpacked = GROW_ARRAY(ObjFunction*,
+                                             enclosing->unpacked, oldCapacity,
+                                             enclosing->unpackedCapacity);
+        }
+        enclosing->unpacked[enclosing->unpackedCount++] = function;
+        current = enclosing;
+        return function;
+    }
+    
+    packChunk(currentChunk());
+    // The enclosing compiler emits nothing while this one runs, so all
+    // the arena holds since the mark was this function's, or a local
+    // function's it has packed.
+    releaseArena(&vm.codeArena, current->arenaMark);
     current = current->enclosing;
     return function;
 }
 
-static uint8_t makeConstant(Value value)
+static void freeCompiler(Compiler* compiler)
+{
+    FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+    FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+    FREE_ARRAY(int, compiler->constantSlots, compiler->constantCapacity);
+    FREE_ARRAY(ObjFunction*, compiler->unpacked, compiler->unpackedCapacity);
+}
+
+static uint32_t hashConstant(Value value)
+{
+    uint64_t bits = 0;
+    switch (value.type)
+    {
+        case VAL_BOOL:   bits = AS_BOOL(value); break;
+        case VAL_NIL:    break;
+        case VAL_NUMBER: memcpy(&bits, &value.as.number, sizeof(double)); break;
+        case VAL_INT:    bits = (uint64_t)AS_INT(value); break;
+        case VAL_OBJ:    bits = (uint64_t)(uintptr_t)AS_OBJ(value); break;
+    }
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits ^ value.type;
+}
+
+// The slot of the constant index that holds value, or the empty one it
+// goes in.
+static int* constantSlot(Value value)
+{
+    ValueArray* constants = &currentChunk()->constants;
+    uint32_t mask = current->constantCapacity - 1;
+    uint32_t index = hashConstant(value) & mask;
+    for (;;)
+    {
+        int* slot = &current->constantSlots[index];
+        if (*slot == 0 ||
+            valuesIdentical(constants->values[*slot - 1], value))
+        {
+            return slot;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+static void growConstantSlots()
+{
+    FREE_ARRAY(int, current->constantSlots, current->constantCapacity);
+    current->constantCapacity = GROW_CAPACITY(current->constantCapacity);
+    current->constantSlots = ALLOCATE(int, current->constantCapacity);
+    memset(current->constantSlots, 0, sizeof(int) * current->constantCapacity);
+    
+    ValueArray* constants = &currentChunk()->constants;
+    for (int i = 0; i < constants->count; i++)
+    {
+        int* slot = constantSlot(constants->values[i]);
+        if (*slot == 0) *slot = i + 1;
+    }
+}
+
+// Index of the value among the chunk's constants, adding it if it isn't
+// one yet.
+static int makeConstant(Value value)
 {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX)
+    Chunk* chunk = currentChunk();
+    if ((chunk->constants.count + 1) * 4 > current->constantCapacity * 3)
+    {
+        // The value may not be reachable yet, so keep it from the collector.
+        push(value);
+        growConstantSlots();
+        pop();
+    }
+    int* slot = constantSlot(value);
+    if (*slot != 0) return *slot - 1;
+    
+    int constant = addConstant(chunk, value);
+    if (constant > UINT16_MAX)
     {
         error("Too many constants in one chunk.");
         return 0;
     }
+    *slot = constant + 1;
+    return constant;
+}
+
+static void emitConstant(Value value)
+{
+    emitOperand(OP_CONSTANT, makeConstant(value));
+}
+
+// Drops the code emitted from offset onwards.
+static void truncateCode(int offset)
+{
+    currentChunk()->count = offset;
+    if (current->lastCall >= offset) current->lastCall = -1;
+}
+
+// If the code from start to end is a single instruction that loads a
+// constant, stores the constant in value.
+static bool constantAt(int start, int end, Value* value)
+{
+    uint8_t* code = currentChunk()->code;
+    if (end - start == 1)
+    {
+        switch (code[start])
+        {
+            case OP_NIL:   *value = NIL_VAL; return true;
+            case OP_TRUE:  *value = BOOL_VAL(true); return true;
+            case OP_FALSE: *value = BOOL_VAL(false); return true;
+            default:       return false;
+        }
+    }
+    if (end - start == 2 && code[start] == OP_CONSTANT)
+    {
+        *value = currentChunk()->constants.values[code[start + 1]];
+        return true;
+    }
+    if (end - start == 4 && code[start] == OP_WIDE &&
+        code[start + 1] == OP_CONSTANT)
+    {
+        *value = currentChunk()->constants.values[(code[start + 2] << 8) |
+                                                  code[start + 3]];
+        return true;
+    }
+    return false;
+}
+
+// Replaces the code from start onwards with a load of value.
+static void emitFolded(int start, Value value)
+{
+    truncateCode(start);
+    if (IS_NIL(value))
+    {
+        emitByte(OP_NIL);
+    }
+    else if (IS_BOOL(value))
+    {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    }
+    else
+    {
+        emitConstant(value);
+    }
+}
 
-    return (uint8_t)constant;
+// Evaluates a binary operator on two constants. Returns false for
+// operand types the operator would reject at runtime, leaving the error
+// to the VM.
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result)
+{
+    if (operatorType == TOKEN_EQUAL_EQUAL)
+    {
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    }
+    if (operatorType == TOKEN_BANG_EQUAL)
+    {
+        *result = BOOL_VAL(!valuesEqual(a, b));
+        return true;
+    }
+    
+    if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b))
+    {
+        // Both strings are already in the constant table, so they stay
+        // alive while the result is interned.
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        int length = left->length + right->length;
+        char* chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        ObjString* string = copyString(chars, length);
+        FREE_ARRAY(char, chars, length + 1);
+        *result = OBJ_VAL(string);
+        return true;
+    }
+    
+    if (!(IS_NUMBER(a) && IS_NUMBER(b))) return false;
+    
+    switch (operatorType)
+    {
+        case TOKEN_PLUS:          *result = addNumbers(a, b); break;
+        case TOKEN_MINUS:         *result = subtractNumbers(a, b); break;
+        case TOKEN_STAR:          *result = multiplyNumbers(a, b); break;
+        case TOKEN_SLASH:         *result = divideNumbers(a, b); break;
+        case TOKEN_GREATER:       *result = greaterNumbers(a, b); break;
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!AS_BOOL(lessNumbers(a, b))); break;
+        case TOKEN_LESS:          *result = lessNumbers(a, b); break;
+        case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!AS_BOOL(greaterNumbers(a, b))); break;
+        default:
+            return false;
+    }
+    return true;
 }
 
 static bool check(TokenType type)
@@ -243,7 +658,34 @@ static bool match(TokenType type)
     return true;
 }
 
+// Matches a compound assignment operator or `++` or `--`, which assign
+// the variable or field before them like `x = x + 1` does.
+static bool matchCompound()
+{
+    switch (parser.current.type)
+    {
+        case TOKEN_PLUS_EQUAL:
+        case TOKEN_MINUS_EQUAL:
+        case TOKEN_STAR_EQUAL:
+        case TOKEN_SLASH_EQUAL:
+        case TOKEN_PLUS_PLUS:
+        case TOKEN_MINUS_MINUS:
+            advance();
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Matches a postfix `++` or `--`, which, unlike an assignment, can follow
+// an operand anywhere.
+static bool matchIncrement()
+{
+    return match(TOKEN_PLUS_PLUS) || match(TOKEN_MINUS_MINUS);
+}
+
 static void binary(bool canAssign);
+static void increment(bool canAssign);
 static void and_(bool canAssign);
 static void or_(bool canAssign);
 static void call(bool canAssign);
@@ -261,6 +703,9 @@ static void declaration();
 static void statement();
 static void varDeclaration();
 static void namedVariable(Token name, bool canAssign);
+static void addLocal(Token name);
+static void markInitialized();
+static Token syntheticToken(const char* text);
 static uint8_t argumentList();
 
 ParseRule rules[] = {
@@ -268,6 +713,7 @@ ParseRule rules[] = {
     [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
     [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE},
     [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_COLON]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
     [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -283,11 +729,20 @@ ParseRule rules[] = {
     [TOKEN_GREATER_EQUAL] = {NULL,     binary, PREC_COMPARISON},
     [TOKEN_LESS]          = {NULL,     binary, PREC_COMPARISON},
     [TOKEN_LESS_EQUAL]    = {NULL,     binary, PREC_COMPARISON},
+    [TOKEN_MINUS_EQUAL]   = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_MINUS_MINUS]   = {increment, NULL,  PREC_NONE},
+    [TOKEN_PLUS_EQUAL]    = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_PLUS_PLUS]     = {increment, NULL,  PREC_NONE},
+    [TOKEN_SLASH_EQUAL]   = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_STAR_EQUAL]    = {NULL,     NULL,   PREC_NONE},
     [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE},
     [TOKEN_STRING]        = {string,   NULL,   PREC_NONE},
     [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
     [TOKEN_AND]           = {NULL,     and_,   PREC_NONE},
+    [TOKEN_CASE]          = {NULL,     NULL,   PREC_NONE},
     [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_CONST]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_DEFAULT]       = {NULL,     NULL,   PREC_NONE},
     [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
     [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE},
     [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
@@ -298,6 +753,7 @@ ParseRule rules[] = {
     [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
     [TOKEN_SUPER]         = {super_,   NULL,   PREC_NONE},
+    [TOKEN_SWITCH]        = {NULL,     NULL,   PREC_NONE},
     [TOKEN_THIS]          = {this_,    NULL,   PREC_NONE},
     [TOKEN_TRUE]          = {literal,  NULL,   PREC_NONE},
     [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
@@ -322,15 +778,17 @@ static void parsePrecedence(Precedence precedence)
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+    int start = currentChunk()->count;
     prefixRule(canAssign);
     while (precedence <= getRule(parser.current.type)->precedence)
     {
         advance();
         ParseInfixFn infixRule = getRule(parser.previous.type)->infix;
+        operandStart = start;
         infixRule(canAssign);
     }
     
-    if (canAssign && match(TOKEN_EQUAL))
+    if (canAssign && (match(TOKEN_EQUAL) || matchCompound()))
     {
         error("Invalid assignment target.");
     }
@@ -338,7 +796,81 @@ static void parsePrecedence(Precedence precedence)
 
 static void expression()
 {
+    expressionDepth++;
     parsePrecedence(PREC_ASSIGNMENT);
+    expressionDepth--;
+}
+
+// Compiles an expression whose value is popped right after.
+static void unusedExpression()
+{
+    unusedDepth = expressionDepth + 1;
+    expression();
+    unusedDepth = -1;
+}
+
+// Whether a postfix `++` or `--` just matched ends an expression whose
+// value is popped unused. It can then leave the new value, like `+= 1`.
+static bool resultUnused()
+{
+    return expressionDepth == unusedDepth &&
+           (check(TOKEN_SEMICOLON) || check(TOKEN_RIGHT_PAREN));
+}
+
+static bool isIncrement(TokenType type)
+{
+    return type == TOKEN_PLUS_PLUS || type == TOKEN_MINUS_MINUS;
+}
+
+// Takes the prefix `++` or `--` waiting for the operand being compiled
+// when the name just consumed ends it, and sets operatorType to it.
+static bool matchPrefix(Token* operatorToken)
+{
+    if (prefixDepth != expressionDepth ||
+        check(TOKEN_DOT) || check(TOKEN_LEFT_PAREN))
+    {
+        return false;
+    }
+    *operatorToken = prefixOperator;
+    prefixDepth = -1;
+    return true;
+}
+
+// Compiles the right operand of a compound assignment with the operator
+// and sets op to the arithmetic it does. Returns the constant to add in
+// place when that is adding or subtracting a number constant, or -1.
+static int compoundOperand(TokenType operatorType, uint8_t* op)
+{
+    int start = currentChunk()->count;
+    switch (operatorType)
+    {
+        case TOKEN_PLUS_PLUS:
+        case TOKEN_MINUS_MINUS:
+            emitConstant(INT_VAL(1));
+            break;
+        default:
+            expression();
+            break;
+    }
+    
+    switch (operatorType)
+    {
+        case TOKEN_PLUS_EQUAL:
+        case TOKEN_PLUS_PLUS:   *op = OP_ADD; break;
+        case TOKEN_MINUS_EQUAL:
+        case TOKEN_MINUS_MINUS: *op = OP_SUBTRACT; break;
+        case TOKEN_STAR_EQUAL:  *op = OP_MULTIPLY; break;
+        default:                *op = OP_DIVIDE; break;
+    }
+    
+    Value step;
+    if ((*op == OP_ADD || *op == OP_SUBTRACT) &&
+        constantAt(start, currentChunk()->count, &step) && IS_NUMBER(step))
+    {
+        if (*op == OP_SUBTRACT) step = negateNumber(step);
+        return makeConstant(step);
+    }
+    return -1;
 }
 
 static void printStatement()
@@ -350,7 +882,7 @@ static void printStatement()
 
 static void expressionStatement()
 {
-    expression();
+    unusedExpression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
     emitByte(OP_POP);
 }
@@ -377,7 +909,9 @@ static void endScope()
     while (current->localCount > 0 &&
            current->locals[current->localCount - 1].depth > current->scopeDepth)
     {
-        if (current->locals[current->localCount - 1].isCaptured)
+        Local* local = &current->locals[current->localCount - 1];
+        localizeClosure(local);
+        if (local->captures > 0)
         {
             emitByte(OP_CLOSE_UPVALUE);
         }
@@ -389,33 +923,52 @@ static void endScope()
     }
 }
 
+// Forward jumps are emitted wide, since their distance isn't known yet.
+// The optimizer lays them out again with the narrow form where it fits.
 static int emitJump(uint8_t instruction)
 {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+    emitBytes(OP_WIDE, instruction);
+    emitBytes(0xff, 0xff);
+    emitBytes(0xff, 0xff);
+    return currentChunk()->count - 4;
 }
 
 static void patchJump(int offset)
 {
-    // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = currentChunk()->count - offset - 2;
-
-    if (jump > UINT16_MAX)
-    {
-        error("Too much code to jump over.");
-    }
+    // -4 to adjust for the bytecode for the jump offset itself.
+    int jump = currentChunk()->count - offset - 4;
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    uint8_t* code = &currentChunk()->code[offset];
+    code[0] = (jump >> 24) & 0xff;
+    code[1] = (jump >> 16) & 0xff;
+    code[2] = (jump >> 8) & 0xff;
+    code[3] = jump & 0xff;
 }
 
 static void ifStatement()
 {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    int conditionStart = currentChunk()->count;
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    
+    // With a constant condition only the branch that runs is kept. The
+    // other is still compiled, to report its errors, and then dropped.
+    Value condition;
+    if (constantAt(conditionStart, currentChunk()->count, &condition))
+    {
+        truncateCode(conditionStart);
+        bool taken = !isFalsey(condition);
+        statement();
+        if (!taken) truncateCode(conditionStart);
+        if (match(TOKEN_ELSE))
+        {
+            int elseStart = currentChunk()->count;
+            statement();
+            if (taken) truncateCode(elseStart);
+        }
+        return;
+    }
 
     int thenJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
@@ -430,13 +983,18 @@ static void ifStatement()
 
 static void emitLoop(int loopStart)
 {
-    emitByte(OP_LOOP);
-
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset <= UINT16_MAX)
+    {
+        emitByte(OP_LOOP);
+        emitBytes((offset >> 8) & 0xff, offset & 0xff);
+        return;
+    }
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    offset += 3;
+    emitBytes(OP_WIDE, OP_LOOP);
+    emitBytes((offset >> 24) & 0xff, (offset >> 16) & 0xff);
+    emitBytes((offset >> 8) & 0xff, offset & 0xff);
 }
 
 static void whileStatement()
@@ -446,6 +1004,24 @@ static void whileStatement()
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    
+    // A constant false condition drops the loop and a constant true one
+    // drops the test.
+    Value condition;
+    if (constantAt(loopStart, currentChunk()->count, &condition))
+    {
+        truncateCode(loopStart);
+        statement();
+        if (isFalsey(condition))
+        {
+            truncateCode(loopStart);
+        }
+        else
+        {
+            emitLoop(loopStart);
+        }
+        return;
+    }
 
     int exitJump = emitJump(OP_JUMP_IF_FALSE);
 
@@ -458,11 +1034,62 @@ static void whileStatement()
     emitByte(OP_POP);
 }
 
+// Matches the condition and increment of a counted loop over the local
+// in slot: `slot < limit` and `slot = slot + step` or `slot += step`,
+// with step a number
+// constant and limit a constant or another local. Sets limitOp to the
+// instruction that loads the limit.
+static bool countedLoop(int slot, int conditionStart, int conditionEnd,
+                        int incrementStart, int incrementEnd,
+                        uint8_t* limitOp, int* limit, int* step)
+{
+    uint8_t* code = currentChunk()->code;
+    ValueArray* constants = &currentChunk()->constants;
+    if (slot > UINT8_MAX) return false;
+    
+    uint8_t* condition = &code[conditionStart];
+    if (conditionEnd - conditionStart != 5 ||
+        condition[0] != OP_GET_LOCAL || condition[1] != slot ||
+        (condition[2] != OP_GET_LOCAL && condition[2] != OP_CONSTANT) ||
+        (condition[2] == OP_GET_LOCAL && condition[3] == slot) ||
+        condition[4] != OP_LESS)
+    {
+        return false;
+    }
+    
+    uint8_t* increment = &code[incrementStart];
+    int length = incrementEnd - incrementStart;
+    if (length == 4 && increment[0] == OP_ADD_LOCAL &&
+        increment[1] == slot && increment[3] == OP_POP)
+    {
+        *step = increment[2];
+    }
+    else if (length == 8 &&
+             increment[0] == OP_GET_LOCAL && increment[1] == slot &&
+             increment[2] == OP_CONSTANT &&
+             IS_NUMBER(constants->values[increment[3]]) &&
+             increment[4] == OP_ADD &&
+             increment[5] == OP_SET_LOCAL && increment[6] == slot &&
+             increment[7] == OP_POP)
+    {
+        *step = increment[3];
+    }
+    else
+    {
+        return false;
+    }
+    
+    *limitOp = condition[2] == OP_GET_LOCAL ? OP_FOR_LOOP : OP_FOR_LOOP_CONSTANT;
+    *limit = condition[3];
+    return true;
+}
+
 static void forStatement()
 {
     beginScope();
     
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    int loopVariable = -1;
     if (match(TOKEN_SEMICOLON))
     {
         // No initializer.
@@ -470,6 +1097,7 @@ static void forStatement()
     else if (match(TOKEN_VAR))
     {
         varDeclaration();
+        loopVariable = current->localCount - 1;
     }
     else
     {
@@ -477,34 +1105,70 @@ static void forStatement()
     }
 
     int loopStart = currentChunk()->count;
+    int conditionEnd = loopStart;
     
     int exitJump = -1;
     if (!match(TOKEN_SEMICOLON))
     {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        conditionEnd = currentChunk()->count;
 
         // Jump out of the loop if the condition is false.
         exitJump = emitJump(OP_JUMP_IF_FALSE);
         emitByte(OP_POP); // Condition.
     }
     
+    // A counted loop tests the condition once on the way in. After that,
+    // OP_FOR_LOOP increments the variable and tests it in one go, falling
+    // into the OP_LOOP back to the body while the loop goes on.
+    bool counted = false;
+    uint8_t forOp = OP_FOR_LOOP;
+    int limit = 0;
+    int step = 0;
+    
     if (!match(TOKEN_RIGHT_PAREN))
     {
         int bodyJump = emitJump(OP_JUMP);
 
         int incrementStart = currentChunk()->count;
-        expression();
+        unusedExpression();
         emitByte(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-
-        emitLoop(loopStart);
-        loopStart = incrementStart;
-        patchJump(bodyJump);
+        
+        counted = loopVariable != -1 && exitJump != -1 &&
+                  countedLoop(loopVariable, loopStart, conditionEnd,
+                              incrementStart, currentChunk()->count,
+                              &forOp, &limit, &step);
+        if (counted)
+        {
+            // Drop the jump over the increment and the increment itself.
+            truncateCode(bodyJump - 2);
+            loopStart = currentChunk()->count;
+        }
+        else
+        {
+            emitLoop(loopStart);
+            loopStart = incrementStart;
+            patchJump(bodyJump);
+        }
     }
 
     statement();
 
+    if (counted)
+    {
+        // The test's errors are about the condition's comparison, the
+        // last instruction of the condition.
+        Chunk* chunk = currentChunk();
+        Location test = chunk->locations[conditionEnd - 1];
+        int line = test.line;
+        int column = test.column;
+        writeChunk(chunk, forOp, line, column);
+        writeChunk(chunk, (uint8_t)loopVariable, line, column);
+        writeChunk(chunk, (uint8_t)step, line, column);
+        writeChunk(chunk, (uint8_t)limit, line, column);
+    }
     emitLoop(loopStart);
     
     if (exitJump != -1)
@@ -516,41 +1180,293 @@ static void forStatement()
     endScope();
 }
 
-static void returnStatement()
+typedef struct
 {
-    if (current->type == TYPE_SCRIPT)
-    {
-        error("Can't return from top-level code.");
-    }
-    
-    if (match(TOKEN_SEMICOLON))
-    {
-        emitReturn();
-    }
-    else
+    // Offset of the case's statements.
+    int body;
+    // The value the case matches, when it is a constant.
+    Value label;
+    bool constant;
+} SwitchCase;
+
+// Emits an entry of a jump table that goes back to target. Entries are
+// always wide, so the VM can find one by its number.
+static void emitEntry(int target)
+{
+    int offset = currentChunk()->count + 6 - target;
+    emitBytes(OP_WIDE, OP_LOOP);
+    emitBytes((offset >> 24) & 0xff, (offset >> 16) & 0xff);
+    emitBytes((offset >> 8) & 0xff, offset & 0xff);
+}
+
+// The lowest label, if every label is an integer and they are dense
+// enough for a table where at most half the entries go to the default.
+static bool integerLabels(SwitchCase* cases, int count, int* low, int* size)
+{
+    if (count == 0) return false;
+    double lowest = 0;
+    double highest = 0;
+    for (int i = 0; i < count; i++)
     {
-        if (current->type == TYPE_INITIALIZER)
+        if (!cases[i].constant || !IS_NUMBER(cases[i].label)) return false;
+        double label = AS_NUMBER(cases[i].label);
+        if (label < INT32_MIN || label > INT32_MAX || label != (int32_t)label)
         {
-            error("Can't return a value from an initializer.");
+            return false;
         }
-        
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emitByte(OP_RETURN);
+        if (i == 0 || label < lowest) lowest = label;
+        if (i == 0 || label > highest) highest = label;
     }
+    double range = highest - lowest + 1;
+    if (range > 2 * count || range >= UINT16_MAX) return false;
+    *low = (int)lowest;
+    *size = (int)range;
+    return true;
 }
 
-static void statement()
+static bool stringLabels(SwitchCase* cases, int count)
 {
-    if (match(TOKEN_PRINT))
+    if (count == 0 || count >= UINT16_MAX) return false;
+    for (int i = 0; i < count; i++)
     {
-        printStatement();
+        if (!cases[i].constant || !IS_STRING(cases[i].label)) return false;
     }
-    else if (match(TOKEN_LEFT_BRACE))
-    {
-        beginScope();
-        block();
-        endScope();
+    return true;
+}
+
+// Emits a jump table that dispatches on the subject in slot, if the
+// labels allow one. Values without a case go to otherwise.
+static bool emitJumpTable(int slot, SwitchCase* cases, int count, int otherwise)
+{
+    int low = 0;
+    int size = 0;
+    bool integers = integerLabels(cases, count, &low, &size);
+    if (!integers && !stringLabels(cases, count)) return false;
+    
+    Chunk* chunk = currentChunk();
+    emitOperand(OP_GET_LOCAL, slot);
+    int* targets;
+    if (integers)
+    {
+        int constant = makeConstant(INT_VAL(low));
+        emitByte(OP_JUMP_TABLE);
+        emitBytes((constant >> 8) & 0xff, constant & 0xff);
+        
+        targets = ALLOCATE(int, size);
+        for (int i = 0; i < size; i++) targets[i] = otherwise;
+        // The first case with a label wins, as it would comparing them
+        // in order.
+        for (int i = count - 1; i >= 0; i--)
+        {
+            targets[(int)AS_NUMBER(cases[i].label) - low] = cases[i].body;
+        }
+    }
+    else
+    {
+        int table = addTable(chunk);
+        emitByte(OP_JUMP_TABLE_STRING);
+        emitBytes((table >> 8) & 0xff, table & 0xff);
+        
+        targets = ALLOCATE(int, count);
+        for (int i = 0; i < count; i++)
+        {
+            Value entry;
+            ObjString* label = AS_STRING(cases[i].label);
+            if (tableGet(&chunk->tables[table], label, &entry)) continue;
+            tableSet(&chunk->tables[table], label, INT_VAL(size));
+            targets[size++] = cases[i].body;
+        }
+    }
+    emitBytes((size >> 8) & 0xff, size & 0xff);
+    
+    for (int i = 0; i < size; i++) emitEntry(targets[i]);
+    emitEntry(otherwise);
+    FREE_ARRAY(int, targets, integers ? size : count);
+    return true;
+}
+
+// A switch compares the subject with each label in order and runs the
+// statements of the first case that matches, or of the default. There is
+// no fallthrough. When the labels are constants that fit a jump table,
+// the code jumps over the comparisons to a table that dispatches on the
+// subject instead, and the optimizer drops the comparisons as dead code.
+static void switchStatement()
+{
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after value.");
+    
+    // The subject is kept in a local no identifier can name.
+    beginScope();
+    addLocal(syntheticToken(" switch"));
+    markInitialized();
+    int slot = current->localCount - 1;
+    
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
+    int dispatchJump = emitJump(OP_JUMP);
+    
+    SwitchCase* cases = NULL;
+    int caseCount = 0;
+    int caseCapacity = 0;
+    int* endJumps = NULL;
+    int endCount = 0;
+    int endCapacity = 0;
+    
+    // 0 before any case, 1 in a case and 2 in the default.
+    int state = 0;
+    int nextCase = -1;
+    int defaultBody = -1;
+    
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    {
+        if (match(TOKEN_CASE) || match(TOKEN_DEFAULT))
+        {
+            TokenType caseType = parser.previous.type;
+            if (state == 2)
+            {
+                error("Can't have another case or default after the default case.");
+            }
+            
+            if (state == 1)
+            {
+                // The end of the previous case jumps over the rest.
+                endScope();
+                if (endCapacity < endCount + 1)
+                {
+                    int oldCapacity = endCapacity;
+                    endCapacity = GROW_CAPACITY(oldCapacity);
+                    endJumps = GROW_ARRAY(int, endJumps, oldCapacity, endCapacity);
+                }
+                endJumps[endCount++] = emitJump(OP_JUMP);
+                
+                patchJump(nextCase);
+                emitByte(OP_POP);
+            }
+            
+            if (caseType == TOKEN_CASE)
+            {
+                state = 1;
+                emitOperand(OP_GET_LOCAL, slot);
+                int labelStart = currentChunk()->count;
+                expression();
+                
+                if (caseCapacity < caseCount + 1)
+                {
+                    int oldCapacity = caseCapacity;
+                    caseCapacity = GROW_CAPACITY(oldCapacity);
+                    cases = GROW_ARRAY(SwitchCase, cases, oldCapacity, caseCapacity);
+                }
+                SwitchCase* switchCase = &cases[caseCount++];
+                switchCase->constant = constantAt(labelStart, currentChunk()->count,
+                                                  &switchCase->label);
+                
+                emitByte(OP_EQUAL);
+                nextCase = emitJump(OP_JUMP_IF_FALSE);
+                emitByte(OP_POP);
+                consume(TOKEN_COLON, "Expect ':' after case value.");
+                switchCase->body = currentChunk()->count;
+            }
+            else
+            {
+                state = 2;
+                consume(TOKEN_COLON, "Expect ':' after default.");
+                defaultBody = currentChunk()->count;
+            }
+            beginScope();
+        }
+        else
+        {
+            if (state == 0)
+            {
+                errorAtCurrent("Can't have statements before any case.");
+            }
+            declaration();
+        }
+    }
+    
+    if (state != 0) endScope();
+    if (state == 1)
+    {
+        int endJump = emitJump(OP_JUMP);
+        patchJump(nextCase);
+        emitByte(OP_POP);
+        patchJump(endJump);
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after switch cases.");
+    
+    // Falling out of the comparisons, or out of the default, goes past
+    // the table. That jump is also where the table sends values with no
+    // case, when there is no default.
+    int otherwise = currentChunk()->count;
+    int exitJump = emitJump(OP_JUMP);
+    patchJump(dispatchJump);
+    if (emitJumpTable(slot, cases, caseCount,
+                      defaultBody != -1 ? defaultBody : otherwise))
+    {
+        patchJump(exitJump);
+    }
+    else
+    {
+        // Without a table, the comparisons run. The jump over them goes
+        // to the next instruction instead and the optimizer removes it.
+        truncateCode(exitJump - 2);
+        memset(&currentChunk()->code[dispatchJump], 0, 4);
+    }
+    
+    for (int i = 0; i < endCount; i++) patchJump(endJumps[i]);
+    FREE_ARRAY(SwitchCase, cases, caseCapacity);
+    FREE_ARRAY(int, endJumps, endCapacity);
+    endScope();
+}
+
+static void returnStatement()
+{
+    if (current->type == TYPE_SCRIPT)
+    {
+        error("Can't return from top-level code.");
+    }
+    
+    if (match(TOKEN_SEMICOLON))
+    {
+        emitReturn();
+    }
+    else
+    {
+        if (current->type == TYPE_INITIALIZER)
+        {
+            error("Can't return a value from an initializer.");
+        }
+        
+        int start = currentChunk()->count;
+        expression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        
+        // If the value is produced by a call that ends the expression, the
+        // call is in tail position. The OP_RETURN stays after it for
+        // callees the VM can't call in place.
+        int call = current->lastCall;
+        if (call >= start &&
+            call + instructionLength(currentChunk(), call) == currentChunk()->count)
+        {
+            uint8_t* code = &currentChunk()->code[call];
+            if (*code == OP_WIDE) code++;
+            *code = *code == OP_CALL ? OP_TAIL_CALL : OP_TAIL_INVOKE;
+        }
+        emitByte(OP_RETURN);
+    }
+}
+
+static void statement()
+{
+    if (match(TOKEN_PRINT))
+    {
+        printStatement();
+    }
+    else if (match(TOKEN_LEFT_BRACE))
+    {
+        beginScope();
+        block();
+        endScope();
     }
     else if (match(TOKEN_IF))
     {
@@ -564,6 +1480,10 @@ static void statement()
     {
         forStatement();
     }
+    else if (match(TOKEN_SWITCH))
+    {
+        switchStatement();
+    }
     else if (match(TOKEN_RETURN))
     {
         returnStatement();
@@ -585,11 +1505,13 @@ static void synchronize()
         switch (parser.current.type)
         {
             case TOKEN_CLASS:
+            case TOKEN_CONST:
             case TOKEN_FUN:
             case TOKEN_VAR:
             case TOKEN_FOR:
             case TOKEN_IF:
             case TOKEN_WHILE:
+            case TOKEN_SWITCH:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
                 return;
@@ -603,149 +1525,894 @@ static void synchronize()
     }
 }
 
-static uint8_t identifierConstant(Token* name)
+static int identifierConstant(Token* name)
 {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
-static void addLocal(Token name)
+static void addLocal(Token name)
+{
+    if (current->localCount == UINT16_COUNT)
+    {
+        error("Too many local variables in function.");
+        return;
+    }
+    
+    if (current->localCount == current->localCapacity)
+    {
+        int oldCapacity = current->localCapacity;
+        current->localCapacity = GROW_CAPACITY(oldCapacity);
+        current->locals = GROW_ARRAY(Local, current->locals,
+                                     oldCapacity, current->localCapacity);
+    }
+    
+    Local* local = &current->locals[current->localCount++];
+    local->name = name;
+    local->depth = -1;
+    local->captures = 0;
+    local->closure = -1;
+    local->escapes = false;
+}
+
+static bool identifiersEqual(Token* a, Token* b)
+{
+    if (a->length != b->length) return false;
+    return memcmp(a->start, b->start, a->length) == 0;
+}
+
+// The value of the top-level constant named name, if there is one.
+static bool findConstant(Token* name, Value* value)
+{
+    if (vm.constants.count == 0) return false;
+    ObjString* string = copyString(name->start, name->length);
+    return tableGet(&vm.constants, string, value);
+}
+
+// Notes that the code uses the name as a global.
+static void useGlobal(Token* name)
+{
+    ObjString* string = copyString(name->start, name->length);
+    push(OBJ_VAL(string));
+    tableSet(&vm.globalNames, string, NIL_VAL);
+    pop();
+}
+
+static void declareVariable()
+{
+    Token* name = &parser.previous;
+    Value constant;
+    if (current->scopeDepth == 0)
+    {
+        if (findConstant(name, &constant))
+        {
+            error("Already a constant with this name.");
+        }
+        useGlobal(name);
+        return;
+    }
+    
+    for (int i = current->localCount - 1; i >= 0; i--)
+    {
+        Local* local = &current->locals[i];
+        if (local->depth != -1 && local->depth < current->scopeDepth)
+        {
+            break;
+        }
+
+        if (identifiersEqual(name, &local->name))
+        {
+            error("Already variable with this name in this scope.");
+        }
+    }
+    
+    addLocal(*name);
+}
+
+static int parseVariable(const char* errorMessage)
+{
+    consume(TOKEN_IDENTIFIER, errorMessage);
+    
+    declareVariable();
+    if (current->scopeDepth > 0) return 0;
+    
+    return identifierConstant(&parser.previous);
+}
+
+static void markInitialized()
+{
+    if (current->scopeDepth == 0) return;
+    current->locals[current->localCount - 1].depth = current->scopeDepth;
+}
+
+static void defineVariable(int global)
+{
+    if (current->scopeDepth > 0)
+    {
+        markInitialized();
+        return;
+    }
+    
+    emitOperand(OP_DEFINE_GLOBAL, global);
+}
+
+static void varDeclaration()
+{
+    int global = parseVariable("Expect variable name.");
+
+    if (match(TOKEN_EQUAL))
+    {
+        expression();
+    }
+    else
+    {
+        emitByte(OP_NIL);
+    }
+    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    defineVariable(global);
+}
+
+static void parameters()
+{
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(TOKEN_RIGHT_PAREN))
+    {
+        do
+        {
+            current->function->arity++;
+            if (current->function->arity > 255)
+            {
+                errorAtCurrent("Can't have more than 255 parameters.");
+            }
+
+            int paramConstant = parseVariable("Expect parameter name.");
+            defineVariable(paramConstant);
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+}
+
+static int resolveLocal(Compiler* compiler, Token* name);
+static int resolveUpvalue(Compiler* compiler, Token* name);
+
+// A function body that is compiled on its first call is first parsed
+// without emitting code, so its errors are reported with the rest of the
+// script's. The parse keeps the variables the body declares, to resolve
+// names and check them like the compiler does, and the names it finds of
+// variables in enclosing functions, which become upvalues.
+typedef struct
+{
+    // The variables the body declares, innermost last, in the scopes and
+    // functions it is parsing.
+    Local* locals;
+    int localCount;
+    int localCapacity;
+    int scopeDepth;
+    // Where the locals of the innermost function start, and its type.
+    int functionStart;
+    FunctionType type;
+    // The name each upvalue of the function was resolved from.
+    Token* names;
+    int nameCapacity;
+} Preparser;
+
+Preparser* preparser = NULL;
+
+static void preparseDeclaration();
+static void preparseStatement();
+static void preparseExpression();
+static void preparsePrecedence(Precedence precedence);
+
+static void preparseAddLocal(Token name)
+{
+    int count = preparser->localCount - preparser->functionStart;
+    if (preparser->functionStart == 0) count += current->localCount;
+    if (count == UINT16_COUNT)
+    {
+        error("Too many local variables in function.");
+        return;
+    }
+    
+    if (preparser->localCount == preparser->localCapacity)
+    {
+        int oldCapacity = preparser->localCapacity;
+        preparser->localCapacity = GROW_CAPACITY(oldCapacity);
+        preparser->locals = GROW_ARRAY(Local, preparser->locals,
+                                       oldCapacity, preparser->localCapacity);
+    }
+    
+    Local* local = &preparser->locals[preparser->localCount++];
+    local->name = name;
+    local->depth = -1;
+}
+
+// Whether name is declared in the innermost scope of locals, walking down
+// from index top. Sets *below when the walk reached the bottom.
+static bool declaredInScope(Local* locals, int top, int bottom, Token* name,
+                            int depth, bool* below)
+{
+    for (int i = top; i >= bottom; i--)
+    {
+        if (locals[i].depth != -1 && locals[i].depth < depth) return false;
+        if (identifiersEqual(name, &locals[i].name)) return true;
+    }
+    *below = true;
+    return false;
+}
+
+static void preparseDeclare()
+{
+    Token* name = &parser.previous;
+    int depth = preparser->scopeDepth;
+    bool below = false;
+    bool declared = declaredInScope(preparser->locals,
+                                    preparser->localCount - 1,
+                                    preparser->functionStart, name,
+                                    depth, &below);
+    // The body's outermost scope is the one its parameters are in.
+    if (!declared && below && preparser->functionStart == 0)
+    {
+        declared = declaredInScope(current->locals, current->localCount - 1,
+                                   0, name, depth, &below);
+    }
+    if (declared) error("Already variable with this name in this scope.");
+    preparseAddLocal(*name);
+}
+
+static void preparseMarkInitialized()
+{
+    preparser->locals[preparser->localCount - 1].depth = preparser->scopeDepth;
+}
+
+static void preparseBeginScope()
+{
+    preparser->scopeDepth++;
+}
+
+static void preparseEndScope()
+{
+    preparser->scopeDepth--;
+    while (preparser->localCount > 0 &&
+           preparser->locals[preparser->localCount - 1].depth > preparser->scopeDepth)
+    {
+        preparser->localCount--;
+    }
+}
+
+// Resolves a name the body uses. A variable of an enclosing function is
+// captured now, so that function knows to close over it. Returns false
+// for a global.
+static bool preparseName(Token* name)
+{
+    for (int i = preparser->localCount - 1; i >= 0; i--)
+    {
+        Local* local = &preparser->locals[i];
+        if (identifiersEqual(name, &local->name))
+        {
+            if (local->depth == -1)
+            {
+                error("Can't read local variable in its own initializer.");
+            }
+            return true;
+        }
+    }
+    if (resolveLocal(current, name) != -1) return true;
+    
+    int count = current->function->upvalueCount;
+    int upvalue = resolveUpvalue(current, name);
+    if (current->function->upvalueCount > count)
+    {
+        if (count == preparser->nameCapacity)
+        {
+            int oldCapacity = preparser->nameCapacity;
+            preparser->nameCapacity = GROW_CAPACITY(oldCapacity);
+            preparser->names = GROW_ARRAY(Token, preparser->names, oldCapacity,
+                                          preparser->nameCapacity);
+        }
+        preparser->names[count] = *name;
+    }
+    return upvalue != -1;
+}
+
+static void preparseArguments()
+{
+    int argCount = 0;
+    if (!check(TOKEN_RIGHT_PAREN))
+    {
+        do
+        {
+            preparseExpression();
+            if (argCount == 255)
+            {
+                error("Can't have more than 255 arguments.");
+            }
+            argCount++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+}
+
+// The right operand of the compound assignment just matched.
+static void preparseCompound()
+{
+    TokenType operatorType = parser.previous.type;
+    if (operatorType != TOKEN_PLUS_PLUS && operatorType != TOKEN_MINUS_MINUS)
+    {
+        preparseExpression();
+    }
+}
+
+static void preparseVariable(Token name, bool canAssign)
+{
+    Value constant;
+    Token prefix;
+    bool global = !preparseName(&name);
+    if (global && findConstant(&name, &constant))
+    {
+        if (matchPrefix(&prefix) || matchIncrement() ||
+            (canAssign && (match(TOKEN_EQUAL) || matchCompound())))
+        {
+            error("Can't assign to a constant.");
+        }
+        return;
+    }
+    if (global) useGlobal(&name);
+    
+    if (matchPrefix(&prefix))
+    {
+        // Nothing more to parse.
+    }
+    else if (canAssign && match(TOKEN_EQUAL))
+    {
+        preparseExpression();
+    }
+    else if ((canAssign && matchCompound()) || matchIncrement())
+    {
+        preparseCompound();
+    }
+}
+
+static void preparseSuper()
+{
+    if (currentClass == NULL)
+    {
+        error("Can't use 'super' outside of a class.");
+    }
+    else if (!currentClass->hasSuperclass)
+    {
+        error("Can't use 'super' in a class with no superclass.");
+    }
+    
+    // 'this' is the method's own first slot.
+    Token keyword = parser.previous;
+    consume(TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+    if (match(TOKEN_LEFT_PAREN)) preparseArguments();
+    preparseName(&keyword);
+}
+
+static void preparseInfix(bool canAssign)
+{
+    TokenType operatorType = parser.previous.type;
+    switch (operatorType)
+    {
+        case TOKEN_LEFT_PAREN:
+            preparseArguments();
+            break;
+        case TOKEN_DOT:
+        {
+            consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+            Token prefix;
+            if (matchPrefix(&prefix))
+            {
+                // Nothing more to parse.
+            }
+            else if (canAssign && match(TOKEN_EQUAL))
+            {
+                preparseExpression();
+            }
+            else if ((canAssign && matchCompound()) || matchIncrement())
+            {
+                preparseCompound();
+            }
+            else if (match(TOKEN_LEFT_PAREN))
+            {
+                preparseArguments();
+            }
+            break;
+        }
+        case TOKEN_AND: preparsePrecedence(PREC_AND); break;
+        case TOKEN_OR:  preparsePrecedence(PREC_OR); break;
+        default:
+            preparsePrecedence((Precedence)(getRule(operatorType)->precedence + 1));
+            break;
+    }
+}
+
+static void preparsePrecedence(Precedence precedence)
+{
+    advance();
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+    switch (parser.previous.type)
+    {
+        case TOKEN_LEFT_PAREN:
+            preparseExpression();
+            consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+            break;
+        case TOKEN_MINUS:
+        case TOKEN_BANG:
+            preparsePrecedence(PREC_UNARY);
+            break;
+        case TOKEN_PLUS_PLUS:
+        case TOKEN_MINUS_MINUS:
+        {
+            Token enclosingOperator = prefixOperator;
+            int enclosingDepth = prefixDepth;
+            prefixOperator = parser.previous;
+            prefixDepth = expressionDepth;
+            preparsePrecedence(PREC_UNARY);
+            if (prefixDepth != -1) error("Invalid assignment target.");
+            prefixOperator = enclosingOperator;
+            prefixDepth = enclosingDepth;
+            break;
+        }
+        case TOKEN_IDENTIFIER:
+            preparseVariable(parser.previous, canAssign);
+            break;
+        case TOKEN_THIS:
+            if (currentClass == NULL)
+            {
+                error("Can't use 'this' outside of a class.");
+                break;
+            }
+            preparseName(&parser.previous);
+            break;
+        case TOKEN_SUPER:
+            preparseSuper();
+            break;
+        case TOKEN_NUMBER:
+        case TOKEN_STRING:
+        case TOKEN_FALSE:
+        case TOKEN_NIL:
+        case TOKEN_TRUE:
+            break;
+        default:
+            error("Expect expression.");
+            return;
+    }
+    
+    while (precedence <= getRule(parser.current.type)->precedence)
+    {
+        advance();
+        preparseInfix(canAssign);
+    }
+    
+    if (canAssign && (match(TOKEN_EQUAL) || matchCompound()))
+    {
+        error("Invalid assignment target.");
+    }
+}
+
+static void preparseExpression()
+{
+    expressionDepth++;
+    preparsePrecedence(PREC_ASSIGNMENT);
+    expressionDepth--;
+}
+
+static void preparseBlock()
+{
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    {
+        preparseDeclaration();
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+static void preparseVarDeclaration()
+{
+    consume(TOKEN_IDENTIFIER, "Expect variable name.");
+    preparseDeclare();
+    if (match(TOKEN_EQUAL)) preparseExpression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    preparseMarkInitialized();
+}
+
+static void preparseExpressionStatement()
+{
+    preparseExpression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+}
+
+static void preparseFor()
+{
+    preparseBeginScope();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(TOKEN_SEMICOLON))
+    {
+        // No initializer.
+    }
+    else if (match(TOKEN_VAR))
+    {
+        preparseVarDeclaration();
+    }
+    else
+    {
+        preparseExpressionStatement();
+    }
+    
+    if (!match(TOKEN_SEMICOLON))
+    {
+        preparseExpression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    }
+    if (!match(TOKEN_RIGHT_PAREN))
+    {
+        preparseExpression();
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    }
+    preparseStatement();
+    preparseEndScope();
+}
+
+static void preparseSwitch()
+{
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+    preparseExpression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after value.");
+    
+    preparseBeginScope();
+    preparseAddLocal(syntheticToken(" switch"));
+    preparseMarkInitialized();
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
+    
+    // 0 before any case, 1 in a case and 2 in the default.
+    int state = 0;
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    {
+        if (match(TOKEN_CASE) || match(TOKEN_DEFAULT))
+        {
+            TokenType caseType = parser.previous.type;
+            if (state == 2)
+            {
+                error("Can't have another case or default after the default case.");
+            }
+            if (state == 1) preparseEndScope();
+            
+            if (caseType == TOKEN_CASE)
+            {
+                state = 1;
+                preparseExpression();
+                consume(TOKEN_COLON, "Expect ':' after case value.");
+            }
+            else
+            {
+                state = 2;
+                consume(TOKEN_COLON, "Expect ':' after default.");
+            }
+            preparseBeginScope();
+        }
+        else
+        {
+            if (state == 0)
+            {
+                errorAtCurrent("Can't have statements before any case.");
+            }
+            preparseDeclaration();
+        }
+    }
+    
+    if (state != 0) preparseEndScope();
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after switch cases.");
+    preparseEndScope();
+}
+
+static void preparseStatement()
+{
+    if (match(TOKEN_PRINT))
+    {
+        preparseExpression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+    }
+    else if (match(TOKEN_LEFT_BRACE))
+    {
+        preparseBeginScope();
+        preparseBlock();
+        preparseEndScope();
+    }
+    else if (match(TOKEN_IF))
+    {
+        consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+        preparseExpression();
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+        preparseStatement();
+        if (match(TOKEN_ELSE)) preparseStatement();
+    }
+    else if (match(TOKEN_WHILE))
+    {
+        consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+        preparseExpression();
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+        preparseStatement();
+    }
+    else if (match(TOKEN_FOR))
+    {
+        preparseFor();
+    }
+    else if (match(TOKEN_SWITCH))
+    {
+        preparseSwitch();
+    }
+    else if (match(TOKEN_RETURN))
+    {
+        if (!match(TOKEN_SEMICOLON))
+        {
+            if (preparser->type == TYPE_INITIALIZER)
+            {
+                error("Can't return a value from an initializer.");
+            }
+            preparseExpression();
+            consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        }
+    }
+    else
+    {
+        preparseExpressionStatement();
+    }
+}
+
+// The parameters and body of a function declared in the body.
+static void preparseFunction(FunctionType type)
 {
-    if (current->localCount == UINT8_COUNT)
+    FunctionType enclosingType = preparser->type;
+    int enclosingStart = preparser->functionStart;
+    preparser->type = type;
+    preparser->functionStart = preparser->localCount;
+    preparseBeginScope();
+    preparseAddLocal(syntheticToken(type != TYPE_FUNCTION ? "this" : ""));
+    preparseMarkInitialized();
+    
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(TOKEN_RIGHT_PAREN))
     {
-        error("Too many local variables in function.");
-        return;
+        int arity = 0;
+        do
+        {
+            if (++arity > 255)
+            {
+                errorAtCurrent("Can't have more than 255 parameters.");
+            }
+            consume(TOKEN_IDENTIFIER, "Expect parameter name.");
+            preparseDeclare();
+            preparseMarkInitialized();
+        } while (match(TOKEN_COMMA));
     }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    preparseBlock();
     
-    Local* local = &current->locals[current->localCount++];
-    local->name = name;
-    local->depth = -1;
-    local->isCaptured = false;
-}
-
-static bool identifiersEqual(Token* a, Token* b)
-{
-    if (a->length != b->length) return false;
-    return memcmp(a->start, b->start, a->length) == 0;
+    preparseEndScope();
+    preparser->type = enclosingType;
+    preparser->functionStart = enclosingStart;
 }
 
-static void declareVariable()
+static void preparseClass()
 {
-    if (current->scopeDepth == 0) return;
-
-    Token* name = &parser.previous;
+    consume(TOKEN_IDENTIFIER, "Expect class name.");
+    Token className = parser.previous;
+    preparseDeclare();
+    preparseMarkInitialized();
     
-    for (int i = current->localCount - 1; i >= 0; i--)
+    ClassCompiler classCompiler;
+    classCompiler.name = className;
+    classCompiler.enclosing = currentClass;
+    classCompiler.hasSuperclass = false;
+    currentClass = &classCompiler;
+    
+    if (match(TOKEN_LESS))
     {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth)
+        consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+        preparseVariable(parser.previous, false);
+        if (identifiersEqual(&className, &parser.previous))
         {
-            break;
+            error("A class can't inherit from itself.");
         }
-
-        if (identifiersEqual(name, &local->name))
+        preparseBeginScope();
+        preparseAddLocal(syntheticToken("super"));
+        preparseMarkInitialized();
+        classCompiler.hasSuperclass = true;
+    }
+    
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    {
+        consume(TOKEN_IDENTIFIER, "Expect method name.");
+        FunctionType type = TYPE_METHOD;
+        if (parser.previous.length == 4 &&
+            memcmp(parser.previous.start, "init", 4) == 0)
         {
-            error("Already variable with this name in this scope.");
+            type = TYPE_INITIALIZER;
         }
+        preparseFunction(type);
     }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
     
-    addLocal(*name);
+    if (classCompiler.hasSuperclass) preparseEndScope();
+    currentClass = currentClass->enclosing;
 }
 
-static uint8_t parseVariable(const char* errorMessage)
+static void preparseDeclaration()
 {
-    consume(TOKEN_IDENTIFIER, errorMessage);
+    if (match(TOKEN_VAR))
+    {
+        preparseVarDeclaration();
+    }
+    else if (match(TOKEN_CONST))
+    {
+        // The rest of the declaration is skipped by synchronize().
+        error("Can't declare a constant outside top-level code.");
+    }
+    else if (match(TOKEN_FUN))
+    {
+        consume(TOKEN_IDENTIFIER, "Expect function name.");
+        preparseDeclare();
+        preparseMarkInitialized();
+        preparseFunction(TYPE_FUNCTION);
+    }
+    else if (match(TOKEN_CLASS))
+    {
+        preparseClass();
+    }
+    else
+    {
+        preparseStatement();
+    }
     
-    declareVariable();
-    if (current->scopeDepth > 0) return 0;
+    if (parser.panicMode) synchronize();
+}
+
+// Parses the body of the function being compiled, up to and including its
+// closing brace, and adds to names the name each new upvalue of the
+// function was resolved from.
+static void preparseBody(Token** names, int* capacity)
+{
+    Preparser body;
+    body.locals = NULL;
+    body.localCount = 0;
+    body.localCapacity = 0;
+    body.scopeDepth = current->scopeDepth;
+    body.functionStart = 0;
+    body.type = current->type;
+    body.names = *names;
+    body.nameCapacity = *capacity;
+    preparser = &body;
     
-    return identifierConstant(&parser.previous);
+    preparseBlock();
+    
+    preparser = NULL;
+    FREE_ARRAY(Local, body.locals, body.localCapacity);
+    *names = body.names;
+    *capacity = body.nameCapacity;
 }
 
-static void markInitialized()
+// Keeps the source of the function's parameter list and body, from
+// start to the closing brace just consumed, for compileFunction().
+static void deferBody(const char* start, int line, int column,
+                      Token* names)
 {
-    if (current->scopeDepth == 0) return;
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+    ObjFunction* function = current->function;
+    LazyFunction* lazy = ALLOCATE(LazyFunction, 1);
+    lazy->length = (int)(parser.previous.start + 1 - start);
+    lazy->source = ALLOCATE(char, lazy->length + 1);
+    memcpy(lazy->source, start, lazy->length);
+    lazy->source[lazy->length] = '\0';
+    lazy->line = line;
+    lazy->column = column;
+    lazy->type = current->type;
+    lazy->inClass = currentClass != NULL;
+    lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+    lazy->upvalueCount = function->upvalueCount;
+    lazy->upvalues = ALLOCATE(Token, lazy->upvalueCount);
+    for (int i = 0; i < lazy->upvalueCount; i++)
+    {
+        lazy->upvalues[i] = names[i];
+        lazy->upvalues[i].start = lazy->source + (names[i].start - start);
+    }
+    function->lazy = lazy;
 }
 
-static void defineVariable(uint8_t global)
+static void function(FunctionType type)
 {
-    if (current->scopeDepth > 0)
+    Compiler compiler;
+    initCompiler(&compiler, type, newFunction());
+    beginScope();
+    
+    const char* start = parser.current.start;
+    int line = parser.current.line;
+    int column = parser.current.column;
+    parameters();
+    
+    // Bodies are compiled on the first call, except those of functions
+    // declared in a block, which are small and usually called, and whose
+    // closure can only be localized once the body is compiled.
+    ObjFunction* function;
+    if (type == TYPE_FUNCTION && compiler.enclosing->scopeDepth > 0)
     {
-        markInitialized();
+        block();
+        function = endCompiler();
+    }
+    else
+    {
+        Token* names = NULL;
+        int capacity = 0;
+        preparseBody(&names, &capacity);
+        if (!parser.hadError) deferBody(start, line, column, names);
+        FREE_ARRAY(Token, names, capacity);
+        function = current->function;
+        current = current->enclosing;
+    }
+    
+    // A function that captures nothing gets one shared closure, built
+    // here and loaded as a plain constant, so evaluating the declaration
+    // never allocates.
+    if (function->upvalueCount == 0)
+    {
+        push(OBJ_VAL(function));
+        ObjClosure* closure = newClosure(function);
+        pop();
+        emitConstant(OBJ_VAL(closure));
+        freeCompiler(&compiler);
         return;
     }
     
-    emitBytes(OP_DEFINE_GLOBAL, global);
-}
-
-static void varDeclaration()
-{
-    uint8_t global = parseVariable("Expect variable name.");
-
-    if (match(TOKEN_EQUAL))
+    // The wide form also widens every upvalue index.
+    int constant = makeConstant(OBJ_VAL(function));
+    bool wide = constant > UINT8_MAX;
+    for (int i = 0; i < function->upvalueCount; i++)
     {
-        expression();
+        if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
     }
-    else
+    
+    if (wide)
     {
-        emitByte(OP_NIL);
+        emitBytes(OP_WIDE, OP_CLOSURE);
+        emitBytes((constant >> 8) & 0xff, constant & 0xff);
     }
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
-
-    defineVariable(global);
-}
-
-static void function(FunctionType type)
-{
-    Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
-
-    // Compile the parameter list.
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-    if (!check(TOKEN_RIGHT_PAREN))
+    else
     {
-        do
-        {
-            current->function->arity++;
-            if (current->function->arity > 255)
-            {
-                errorAtCurrent("Can't have more than 255 parameters.");
-            }
-
-            uint8_t paramConstant = parseVariable("Expect parameter name.");
-            defineVariable(paramConstant);
-        } while (match(TOKEN_COMMA));
+        emitBytes(OP_CLOSURE, (uint8_t)constant);
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-
-    // The body.
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
-
-    // Create the function object.
-    ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
     
     for (int i = 0; i < function->upvalueCount; i++)
     {
+        int index = compiler.upvalues[i].index;
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        if (wide) emitByte((index >> 8) & 0xff);
+        emitByte(index & 0xff);
     }
+    freeCompiler(&compiler);
 }
 
 static void funDeclaration()
 {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
     markInitialized();
+    int start = currentChunk()->count;
     function(TYPE_FUNCTION);
+    if (current->scopeDepth > 0 && currentChunk()->count > start &&
+        currentChunk()->code[start] == OP_CLOSURE)
+    {
+        current->locals[current->localCount - 1].closure = start;
+    }
     defineVariable(global);
 }
 
 static void method()
 {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
+    methodSelector(copyString(parser.previous.start, parser.previous.length));
     FunctionType type = TYPE_METHOD;
     
     if (parser.previous.length == 4 &&
@@ -755,7 +2422,7 @@ static void method()
     }
     
     function(type);
-    emitBytes(OP_METHOD, constant);
+    emitOperand(OP_METHOD, constant);
 }
 
 static Token syntheticToken(const char* text)
@@ -770,10 +2437,10 @@ static void classDeclaration()
 {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
     declareVariable();
 
-    emitBytes(OP_CLASS, nameConstant);
+    emitOperand(OP_CLASS, nameConstant);
     defineVariable(nameConstant);
 
     ClassCompiler classCompiler;
@@ -820,12 +2487,70 @@ static void classDeclaration()
     currentClass = currentClass->enclosing;
 }
 
+// Whether the name is a global already, or used as one by code compiled
+// before, which would find no global once the constant replaces it.
+static bool usedAsGlobal(Token* name)
+{
+    ObjString* string = copyString(name->start, name->length);
+    Value value;
+    return tableGet(&vm.globalNames, string, &value) ||
+           tableGet(&vm.globals, string, &value);
+}
+
+// A constant's value has to be known when compiling. Its uses, in the
+// rest of the script and in any function compiled later, load the value
+// itself instead of a global. So it has to be declared before any use.
+static void constDeclaration()
+{
+    if (current->type != TYPE_SCRIPT || current->scopeDepth > 0)
+    {
+        // The rest of the declaration is skipped by synchronize().
+        error("Can't declare a constant outside top-level code.");
+        return;
+    }
+    consume(TOKEN_IDENTIFIER, "Expect constant name.");
+    Token name = parser.previous;
+    Value constant;
+    if (findConstant(&name, &constant))
+    {
+        error("Already a constant with this name.");
+    }
+    else if (usedAsGlobal(&name))
+    {
+        error("Can't declare a constant after its name is used as a global.");
+    }
+    consume(TOKEN_EQUAL, "Expect '=' after constant name.");
+    
+    Token valueStart = parser.current;
+    int start = currentChunk()->count;
+    expression();
+    Value value;
+    bool known = constantAt(start, currentChunk()->count, &value);
+    if (!known)
+    {
+        errorAt(&valueStart, "Constant value must be known at compile time.");
+    }
+    truncateCode(start);
+    consume(TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+    if (!known) return;
+    
+    // The value is kept alive by the chunk's constants already.
+    ObjString* key = copyString(name.start, name.length);
+    push(OBJ_VAL(key));
+    tableSet(&vm.constants, key, value);
+    pop();
+}
+
 static void declaration()
 {
     if (match(TOKEN_VAR))
     {
         varDeclaration();
     }
+    else if (match(TOKEN_CONST))
+    {
+        constDeclaration();
+    }
     else if (match(TOKEN_FUN))
     {
         funDeclaration();
@@ -860,10 +2585,10 @@ static int resolveLocal(Compiler* compiler, Token* name)
     return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
+static int addUpvalue(Compiler* compiler, int index, bool isLocal)
 {
     int upvalueCount = compiler->function->upvalueCount;
-    if (upvalueCount == UINT8_COUNT)
+    if (upvalueCount == UINT16_COUNT)
     {
         error("Too many closure variables in function.");
         return 0;
@@ -876,6 +2601,13 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
             return i;
         }
     }
+    if (upvalueCount == compiler->upvalueCapacity)
+    {
+        int oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues,
+                                        oldCapacity, compiler->upvalueCapacity);
+    }
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
     return compiler->function->upvalueCount++;
@@ -883,24 +2615,67 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
 
 static int resolveUpvalue(Compiler* compiler, Token* name)
 {
-    if (compiler->enclosing == NULL) return -1;
+    if (compiler->enclosing == NULL)
+    {
+        // A function compiled on its first call finds its upvalues by the
+        // names they were resolved from when it was declared.
+        LazyFunction* lazy = compiler->function->lazy;
+        if (lazy == NULL) return -1;
+        for (int i = 0; i < lazy->upvalueCount; i++)
+        {
+            if (identifiersEqual(name, &lazy->upvalues[i])) return i;
+        }
+        return -1;
+    }
 
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1)
     {
-        compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        Local* captured = &compiler->enclosing->locals[local];
+        int upvalueCount = compiler->function->upvalueCount;
+        int upvalue = addUpvalue(compiler, local, true);
+        if (compiler->function->upvalueCount > upvalueCount)
+        {
+            captured->captures++;
+        }
+        captured->escapes = true;
+        return upvalue;
     }
     
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1)
     {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, upvalue, false);
     }
 
     return -1;
 }
 
+// Compiles the variable's compound assignment with the operator, which
+// leaves the new value. The arithmetic reports errors at the operator.
+static void emitCompound(uint8_t getOp, uint8_t setOp, int arg,
+                         Token* operatorToken)
+{
+    int start = currentChunk()->count;
+    emitOperand(getOp, arg);
+    
+    uint8_t op;
+    int step = compoundOperand(operatorToken->type, &op);
+    if (step != -1 && getOp == OP_GET_LOCAL &&
+        arg <= UINT8_MAX && step <= UINT8_MAX)
+    {
+        truncateCode(start);
+        emitByteAt(OP_ADD_LOCAL, operatorToken);
+        emitByteAt((uint8_t)arg, operatorToken);
+        emitByteAt((uint8_t)step, operatorToken);
+    }
+    else
+    {
+        emitByteAt(op, operatorToken);
+        emitOperand(setOp, arg);
+    }
+}
+
 static void namedVariable(Token name, bool canAssign)
 {
     uint8_t getOp, setOp;
@@ -917,19 +2692,66 @@ static void namedVariable(Token name, bool canAssign)
     }
     else
     {
+        Value constant;
+        Token operatorToken;
+        if (findConstant(&name, &constant))
+        {
+            if (matchPrefix(&operatorToken) || matchIncrement() ||
+                (canAssign && (match(TOKEN_EQUAL) || matchCompound())))
+            {
+                error("Can't assign to a constant.");
+            }
+            emitConstant(constant);
+            return;
+        }
+        
+        // A math native called by name does its math in place. The VM
+        // falls back to a call if the global is assigned.
+        int intrinsic = findIntrinsic(name.start, name.length);
+        if (intrinsic != -1 && match(TOKEN_LEFT_PAREN))
+        {
+            uint8_t argCount = argumentList();
+            emitBytes(OP_INTRINSIC, (uint8_t)intrinsic);
+            emitByte(argCount);
+            return;
+        }
+        useGlobal(&name);
         arg = identifierConstant(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
     
-    if (canAssign && match(TOKEN_EQUAL))
+    Token operatorToken;
+    if (matchPrefix(&operatorToken))
+    {
+        if (getOp == OP_GET_LOCAL) current->locals[arg].escapes = true;
+        emitCompound(getOp, setOp, arg, &operatorToken);
+    }
+    else if (canAssign && match(TOKEN_EQUAL))
     {
+        if (getOp == OP_GET_LOCAL) current->locals[arg].escapes = true;
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        emitOperand(setOp, arg);
+    }
+    else if ((canAssign && matchCompound()) || matchIncrement())
+    {
+        operatorToken = parser.previous;
+        if (getOp == OP_GET_LOCAL) current->locals[arg].escapes = true;
+        // A postfix `++` or `--` leaves the value from before under the
+        // update, unless nothing reads it.
+        bool postfix = isIncrement(operatorToken.type) && !resultUnused();
+        if (postfix) emitOperand(getOp, arg);
+        emitCompound(getOp, setOp, arg, &operatorToken);
+        if (postfix) emitByte(OP_POP);
     }
     else
     {
-        emitBytes(getOp, (uint8_t)arg);
+        if (getOp == OP_GET_LOCAL)
+        {
+            if (check(TOKEN_LEFT_PAREN)) current->calleeLocal = arg;
+            else current->locals[arg].escapes = true;
+        }
+        emitOperand(getOp, arg);
     }
 }
 
@@ -961,20 +2783,20 @@ static void super_(bool canAssign)
     
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
     
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN))
     {
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
+        emitOperand(OP_SUPER_INVOKE, name);
         emitByte(argCount);
     }
     else
     {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        emitOperand(OP_GET_SUPER, name);
     }
 }
 
@@ -992,26 +2814,49 @@ static void literal(bool canAssign)
 
 static void binary(bool)
 {
-    // Remember the operator.
-    TokenType operatorType = parser.previous.type;
+    // Remember the operator, where the instruction reports its errors.
+    Token operatorToken = parser.previous;
+    TokenType operatorType = operatorToken.type;
+    int leftStart = operandStart;
 
     // Compile the right operand.
+    int rightStart = currentChunk()->count;
     ParseRule* rule = getRule(operatorType);
     parsePrecedence((Precedence)(rule->precedence + 1));
+    
+    // Fold the operator if both operands are constants.
+    Value a, b, result;
+    if (constantAt(leftStart, rightStart, &a) &&
+        constantAt(rightStart, currentChunk()->count, &b) &&
+        foldBinary(operatorType, a, b, &result))
+    {
+        emitFolded(leftStart, result);
+        return;
+    }
 
     // Emit the operator instruction.
+    Token* at = &operatorToken;
     switch (operatorType)
     {
-        case TOKEN_PLUS: emitByte(OP_ADD); break;
-        case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
-        case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
+        case TOKEN_PLUS: emitByteAt(OP_ADD, at); break;
+        case TOKEN_MINUS: emitByteAt(OP_SUBTRACT, at); break;
+        case TOKEN_STAR: emitByteAt(OP_MULTIPLY, at); break;
+        case TOKEN_SLASH: emitByteAt(OP_DIVIDE, at); break;
+        case TOKEN_BANG_EQUAL:
+            emitByteAt(OP_EQUAL, at);
+            emitByteAt(OP_NOT, at);
+            break;
+        case TOKEN_EQUAL_EQUAL:   emitByteAt(OP_EQUAL, at); break;
+        case TOKEN_GREATER:       emitByteAt(OP_GREATER, at); break;
+        case TOKEN_GREATER_EQUAL:
+            emitByteAt(OP_LESS, at);
+            emitByteAt(OP_NOT, at);
+            break;
+        case TOKEN_LESS:          emitByteAt(OP_LESS, at); break;
+        case TOKEN_LESS_EQUAL:
+            emitByteAt(OP_GREATER, at);
+            emitByteAt(OP_NOT, at);
+            break;
         default:
             return; // Unreachable.
     }
@@ -1061,29 +2906,90 @@ static uint8_t argumentList()
 
 static void call(bool)
 {
+    // A local function reads its caller's frame, so a call of one is
+    // never made a tail call, which would replace that frame.
+    int callee = current->calleeLocal;
+    current->calleeLocal = -1;
+    bool local = callee != -1 && current->locals[callee].closure != -1;
+    
     uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+    current->lastCall = local ? -1 : currentChunk()->count;
+    int site = addCallSite(currentChunk());
+    if (site > UINT16_MAX)
+    {
+        error("Too many calls in one chunk.");
+        site = 0;
+    }
+    emitOperand(OP_CALL, site);
+    emitByte(argCount);
+}
+
+// Compiles the compound assignment with the operator of the field of the
+// instance on the stack, which leaves the new value.
+static void emitPropertyCompound(int name, Token* operatorToken)
+{
+    // The field is looked up once when a constant is added to it.
+    // Otherwise the instance is kept for the store.
+    int start = currentChunk()->count;
+    emitByte(OP_DUP);
+    emitOperand(OP_GET_PROPERTY, name);
+    
+    uint8_t op;
+    int step = compoundOperand(operatorToken->type, &op);
+    if (step != -1 && name <= UINT8_MAX && step <= UINT8_MAX)
+    {
+        truncateCode(start);
+        emitByteAt(OP_ADD_PROPERTY, operatorToken);
+        emitByteAt((uint8_t)name, operatorToken);
+        emitByteAt((uint8_t)step, operatorToken);
+    }
+    else
+    {
+        emitByteAt(op, operatorToken);
+        emitOperand(OP_SET_PROPERTY, name);
+    }
 }
 
 static void dot(bool canAssign)
 {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
-    if (canAssign && match(TOKEN_EQUAL))
+    Token operatorToken;
+    if (matchPrefix(&operatorToken))
+    {
+        emitPropertyCompound(name, &operatorToken);
+    }
+    else if (canAssign && match(TOKEN_EQUAL))
     {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitOperand(OP_SET_PROPERTY, name);
+    }
+    else if ((canAssign && matchCompound()) || matchIncrement())
+    {
+        operatorToken = parser.previous;
+        // A postfix `++` or `--` reads the field first and moves the value
+        // from before under the instance, unless nothing reads it.
+        bool postfix = isIncrement(operatorToken.type) && !resultUnused();
+        if (postfix)
+        {
+            emitByte(OP_DUP);
+            emitOperand(OP_GET_PROPERTY, name);
+            emitByte(OP_SWAP);
+        }
+        emitPropertyCompound(name, &operatorToken);
+        if (postfix) emitByte(OP_POP);
     }
     else if (match(TOKEN_LEFT_PAREN))
     {
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
+        current->lastCall = currentChunk()->count;
+        emitOperand(OP_INVOKE, name);
         emitByte(argCount);
     }
     else
     {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitOperand(OP_GET_PROPERTY, name);
     }
 }
 
@@ -1095,15 +3001,18 @@ static void grouping(bool canAssign)
 
 
 
-static void emitConstant(Value value)
-{
-    emitBytes(OP_CONSTANT, makeConstant(value));
-}
-
 static void number(bool canAssign)
 {
     double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    if (memchr(parser.previous.start, '.', parser.previous.length) == NULL &&
+        value <= INT32_MAX)
+    {
+        emitConstant(INT_VAL((int32_t)value));
+    }
+    else
+    {
+        emitConstant(NUMBER_VAL(value));
+    }
 }
 
 static void string(bool canAssign)
@@ -1116,7 +3025,23 @@ static void unary(bool canAssign)
     TokenType operatorType = parser.previous.type;
 
     // Compile the operand.
+    int start = currentChunk()->count;
     parsePrecedence(PREC_UNARY);
+    
+    Value value;
+    if (constantAt(start, currentChunk()->count, &value))
+    {
+        if (operatorType == TOKEN_BANG)
+        {
+            emitFolded(start, BOOL_VAL(isFalsey(value)));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(value))
+        {
+            emitFolded(start, negateNumber(value));
+            return;
+        }
+    }
 
     // Emit the operator instruction.
     switch (operatorType)
@@ -1130,12 +3055,28 @@ static void unary(bool canAssign)
 
 
 
+// `++x` and `--x` are `x += 1` and `x -= 1`. The operator waits for the
+// variable or field that ends the operand.
+static void increment(bool)
+{
+    Token enclosingOperator = prefixOperator;
+    int enclosingDepth = prefixDepth;
+    prefixOperator = parser.previous;
+    prefixDepth = expressionDepth;
+    
+    parsePrecedence(PREC_UNARY);
+    if (prefixDepth != -1) error("Invalid assignment target.");
+    
+    prefixOperator = enclosingOperator;
+    prefixDepth = enclosingDepth;
+}
+
 ObjFunction* compile(const char* source)
 {
-    initScanner(source);
+    initScanner(source, 1, 1);
     
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(&compiler, TYPE_SCRIPT, newFunction());
     
     parser.hadError = false;
     parser.panicMode = false;
@@ -1148,15 +3089,64 @@ ObjFunction* compile(const char* source)
     }
     
     ObjFunction* function = endCompiler();
+    freeCompiler(&compiler);
     return parser.hadError ? NULL : function;
 }
 
+bool compileFunction(ObjFunction* function)
+{
+    LazyFunction* lazy = function->lazy;
+    initScanner(lazy->source, lazy->line, lazy->column);
+    parser.hadError = false;
+    parser.panicMode = false;
+    
+    ClassCompiler classCompiler;
+    classCompiler.enclosing = NULL;
+    classCompiler.name = syntheticToken("");
+    classCompiler.hasSuperclass = lazy->hasSuperclass;
+    currentClass = lazy->inClass ? &classCompiler : NULL;
+    
+    Compiler compiler;
+    initCompiler(&compiler, lazy->type, function);
+    function->arity = 0;
+    beginScope();
+    advance();
+    parameters();
+    block();
+    endCompiler();
+    freeCompiler(&compiler);
+    currentClass = NULL;
+    
+    if (parser.hadError)
+    {
+        // Left to be compiled, and to report the errors, again.
+        freeChunk(&function->chunk);
+        initChunk(&function->chunk);
+        return false;
+    }
+    function->lazy = NULL;
+    freeLazyFunction(lazy);
+    return true;
+}
+
+void freeLazyFunction(LazyFunction* lazy)
+{
+    if (lazy == NULL) return;
+    FREE_ARRAY(char, lazy->source, lazy->length + 1);
+    FREE_ARRAY(Token, lazy->upvalues, lazy->upvalueCount);
+    FREE(LazyFunction, lazy);
+}
+
 void markCompilerRoots()
 {
     Compiler* compiler = current;
     while (compiler != NULL)
     {
         markObject((Obj*)compiler->function);
+        for (int i = 0; i < compiler->unpackedCount; i++)
+        {
+            markObject((Obj*)compiler->unpacked[i]);
+        }
         compiler = compiler->enclosing;
     }
 }
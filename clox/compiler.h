@@ -4,4 +4,8 @@
 
 
 ObjFunction* compile(const char* source);
+// Compiles the body of a function whose compilation was put off until it
+// is called. Returns false after reporting errors in it.
+bool compileFunction(ObjFunction* function);
+void freeLazyFunction(LazyFunction* lazy);
 void markCompilerRoots();
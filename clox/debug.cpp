@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include "debug.h"
 #include "object.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name)
 {
@@ -12,6 +13,20 @@ void disassembleChunk(Chunk* chunk, const char* name)
     }
 }
 
+// Set while disassembling the instruction that follows an OP_WIDE.
+static bool wide = false;
+
+static int operandWidth()
+{
+    return wide ? 2 : 1;
+}
+
+static int readOperand(Chunk* chunk, int offset)
+{
+    if (!wide) return chunk->code[offset];
+    return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
 static int simpleInstruction(const char* name, int offset)
 {
     printf("%s\n", name);
@@ -20,49 +35,161 @@ static int simpleInstruction(const char* name, int offset)
 
 static int byteInstruction(const char* name, Chunk* chunk, int offset)
 {
-    uint8_t slot = chunk->code[offset + 1];
+    int slot = readOperand(chunk, offset + 1);
     printf("%-16s %4d\n", name, slot);
-    return offset + 2;
+    return offset + 1 + operandWidth();
 }
 
 static int constantInstruction(const char* name, Chunk* chunk, int offset)
 {
-    uint8_t constant = chunk->code[offset + 1];
+    int constant = readOperand(chunk, offset + 1);
     printf("%-16s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
-    return offset + 2;
+    return offset + 1 + operandWidth();
 }
 
 static int jumpInstruction(const char* name, int sign,
                            Chunk* chunk, int offset)
 {
-    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
-    jump |= chunk->code[offset + 2];
-    printf("%-16s %4d -> %d\n", name, offset,
-         offset + 3 + sign * jump);
-    return offset + 3;
+    uint8_t* code = &chunk->code[offset + 1];
+    int jump = (code[0] << 8) | code[1];
+    // A wide jump starts at its OP_WIDE prefix.
+    int start = offset;
+    int length = 3;
+    if (wide)
+    {
+        jump = (code[0] << 24) | (code[1] << 16) | (code[2] << 8) | code[3];
+        start = offset - 1;
+        length = 6;
+    }
+    printf("%-16s %4d -> %d\n", name, start,
+         start + length + sign * jump);
+    return start + length;
 }
 
 static int invokeInstruction(const char* name, Chunk* chunk, int offset)
 {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
+    int constant = readOperand(chunk, offset + 1);
+    uint8_t argCount = chunk->code[offset + 1 + operandWidth()];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 2 + operandWidth();
+}
+
+static int callInstruction(const char* name, Chunk* chunk, int offset)
+{
+    int site = readOperand(chunk, offset + 1);
+    uint8_t argCount = chunk->code[offset + 1 + operandWidth()];
+    printf("%-16s (%d args) %4d\n", name, argCount, site);
+    return offset + 2 + operandWidth();
+}
+
+static int inlineInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t* code = &chunk->code[offset + 1];
+    bool invoke = chunk->code[offset] == OP_INLINE_INVOKE;
+    if (invoke) code += 2;
+    int argCount = code[0];
+    int constant = (code[1] << 8) | code[2];
+    int skip = (code[3] << 8) | code[4];
+    int length = invoke ? 8 : 6;
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
+    printf("' else -> %d\n", offset + length + skip);
+    return offset + length;
+}
+
+static int reuseInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t* code = &chunk->code[offset + 1];
+    int constant = (code[1] << 8) | code[2];
+    printf("%-16s %4d '", name, code[0]);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+static int forLoopInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t* code = &chunk->code[offset + 1];
+    printf("%-16s %4d += '", name, code[0]);
+    printValue(chunk->constants.values[code[1]]);
+    if (chunk->code[offset] == OP_FOR_LOOP)
+    {
+        printf("' < %d\n", code[2]);
+    }
+    else
+    {
+        printf("' < '");
+        printValue(chunk->constants.values[code[2]]);
+        printf("'\n");
+    }
+    return offset + 4;
+}
+
+static int addInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t* code = &chunk->code[offset + 1];
+    if (chunk->code[offset] == OP_ADD_LOCAL)
+    {
+        printf("%-16s %4d += '", name, code[0]);
+    }
+    else
+    {
+        printf("%-16s %4d '", name, code[0]);
+        printValue(chunk->constants.values[code[0]]);
+        printf("' += '");
+    }
+    printValue(chunk->constants.values[code[1]]);
     printf("'\n");
     return offset + 3;
 }
 
+static int intrinsicInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t* code = &chunk->code[offset + 1];
+    printf("%-16s (%d args) '%s'\n", name, code[1],
+           vm.intrinsicNames[code[0]]->chars);
+    return offset + 3;
+}
+
+static int jumpTableInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t* code = &chunk->code[offset + 1];
+    int operand = (code[0] << 8) | code[1];
+    int count = (code[2] << 8) | code[3];
+    if (chunk->code[offset] == OP_JUMP_TABLE)
+    {
+        printf("%-16s %4d from '", name, count);
+        printValue(chunk->constants.values[operand]);
+        printf("'\n");
+    }
+    else
+    {
+        printf("%-16s %4d in table %d\n", name, count, operand);
+    }
+    return offset + 5;
+}
+
+static int disassembleOpcode(Chunk* chunk, int offset);
+
 int disassembleInstruction(Chunk* chunk, int offset)
 {
     printf("%04d ", offset);
     
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    int line = chunkLocation(chunk, offset).line;
+    if (offset > 0 && line == chunkLocation(chunk, offset - 1).line)
         printf("    | ");
     else
-        printf("%4d", chunk->lines[offset]);
+        printf("%4d", line);
+
+    return disassembleOpcode(chunk, offset);
+}
 
+static int disassembleOpcode(Chunk* chunk, int offset)
+{
     uint8_t instruction = chunk->code[offset];
     switch (instruction)
     {
@@ -92,10 +219,28 @@ int disassembleInstruction(Chunk* chunk, int offset)
             return simpleInstruction("OP_NEGATE", offset);
         case OP_NOT:
             return simpleInstruction("OP_NOT", offset);
+        case OP_ADD_NUMBER:
+            return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_SUBTRACT_NUMBER:
+            return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+        case OP_MULTIPLY_NUMBER:
+            return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+        case OP_DIVIDE_NUMBER:
+            return simpleInstruction("OP_DIVIDE_NUMBER", offset);
+        case OP_NEGATE_NUMBER:
+            return simpleInstruction("OP_NEGATE_NUMBER", offset);
+        case OP_GREATER_NUMBER:
+            return simpleInstruction("OP_GREATER_NUMBER", offset);
+        case OP_LESS_NUMBER:
+            return simpleInstruction("OP_LESS_NUMBER", offset);
         case OP_PRINT:
             return simpleInstruction("OP_PRINT", offset);
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
+        case OP_DUP:
+            return simpleInstruction("OP_DUP", offset);
+        case OP_SWAP:
+            return simpleInstruction("OP_SWAP", offset);
         case OP_DEFINE_GLOBAL:
               return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_GLOBAL:
@@ -106,29 +251,58 @@ int disassembleInstruction(Chunk* chunk, int offset)
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_ADD_LOCAL:
+            return addInstruction("OP_ADD_LOCAL", chunk, offset);
         case OP_JUMP:
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_FOR_LOOP:
+            return forLoopInstruction("OP_FOR_LOOP", chunk, offset);
+        case OP_FOR_LOOP_CONSTANT:
+            return forLoopInstruction("OP_FOR_LOOP_CONSTANT", chunk, offset);
+        case OP_JUMP_TABLE:
+            return jumpTableInstruction("OP_JUMP_TABLE", chunk, offset);
+        case OP_JUMP_TABLE_STRING:
+            return jumpTableInstruction("OP_JUMP_TABLE_STRING", chunk, offset);
         case OP_CALL:
-              return byteInstruction("OP_CALL", chunk, offset);
+              return callInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+              return callInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_CALL_CLOSURE:
+              return callInstruction("OP_CALL_CLOSURE", chunk, offset);
+        case OP_CALL_NATIVE:
+              return callInstruction("OP_CALL_NATIVE", chunk, offset);
+        case OP_CALL_CLASS:
+              return callInstruction("OP_CALL_CLASS", chunk, offset);
+        case OP_CALL_BOUND_METHOD:
+              return callInstruction("OP_CALL_BOUND_METHOD", chunk, offset);
+        case OP_INTRINSIC:
+            return intrinsicInstruction("OP_INTRINSIC", chunk, offset);
         case OP_CLOSURE:
+        case OP_LOCAL_CLOSURE:
         {
             offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
+            int constant = readOperand(chunk, offset);
+            offset += operandWidth();
+            const char* name = instruction == OP_CLOSURE ? "OP_CLOSURE"
+                                                         : "OP_LOCAL_CLOSURE";
+            printf("%-16s %4d ", name, constant);
             printValue(chunk->constants.values[constant]);
             printf("\n");
 
-            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+            Value value = chunk->constants.values[constant];
+            ObjFunction* function = IS_CLOSURE(value) ? AS_CLOSURE(value)->function
+                                                      : AS_FUNCTION(value);
             for (int j = 0; j < function->upvalueCount; j++)
             {
                 int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
+                int index = readOperand(chunk, offset);
+                offset += operandWidth();
                 printf("%04d      |                     %s %d\n",
-                   offset - 2, isLocal ? "local" : "upvalue", index);
+                   offset - 1 - operandWidth(), isLocal ? "local" : "upvalue", index);
             }
             return offset;
         }
@@ -136,6 +310,10 @@ int disassembleInstruction(Chunk* chunk, int offset)
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_GET_ENCLOSING:
+            return byteInstruction("OP_GET_ENCLOSING", chunk, offset);
+        case OP_SET_ENCLOSING:
+            return byteInstruction("OP_SET_ENCLOSING", chunk, offset);
         case OP_CLOSE_UPVALUE:
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_CLASS:
@@ -144,18 +322,38 @@ int disassembleInstruction(Chunk* chunk, int offset)
             return constantInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
             return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_ADD_PROPERTY:
+            return addInstruction("OP_ADD_PROPERTY", chunk, offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_TAIL_INVOKE:
+            return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_INLINE_CALL:
+            return inlineInstruction("OP_INLINE_CALL", chunk, offset);
+        case OP_INLINE_INVOKE:
+            return inlineInstruction("OP_INLINE_INVOKE", chunk, offset);
+        case OP_INLINE_RETURN:
+            return byteInstruction("OP_INLINE_RETURN", chunk, offset);
+        case OP_REUSE_PROPERTY:
+            return reuseInstruction("OP_REUSE_PROPERTY", chunk, offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_WIDE:
+        {
+            printf("OP_WIDE ");
+            wide = true;
+            offset = disassembleOpcode(chunk, offset + 1);
+            wide = false;
+            return offset;
+        }
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -1,6 +1,13 @@
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef POINTER_COMPRESSION
+#include <stdio.h>
+#endif
 #include "compiler.h"
 #include "memory.h"
+#include "tier.h"
 #include "vm.h"
 
 
@@ -10,6 +17,35 @@
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+#define HEAP_PAGE_SIZE 4096
+
+// Objects of one type live in pages of equally sized slots, so the heap
+// can be walked slot by slot without a list threaded through the objects.
+struct ObjPage
+{
+    ObjPage* next;
+    int slotSize;
+    int slotCount;
+};
+
+// A free slot keeps its header, flagged as free, and links to the next one.
+typedef struct
+{
+    Obj obj;
+    Obj* next;
+} FreeSlot;
+
+#ifdef POINTER_COMPRESSION
+#define HEAP_CAGE_SIZE ((size_t)1 << 32)
+
+uint8_t* heapCage = NULL;
+static uint8_t* cageTop = NULL;
+static ObjPage* freePages = NULL;
+#endif
+
+#define PAGE_SLOTS(page) ((uint8_t*)(page) + sizeof(ObjPage))
+#define PAGE_SLOT(page, index) \
+    ((Obj*)(PAGE_SLOTS(page) + (size_t)(index) * (page)->slotSize))
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize)
 {
@@ -36,61 +72,346 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize)
     return result;
 }
 
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+struct ArenaBlock
+{
+    ArenaBlock* next;
+    size_t size;
+    size_t used;
+};
+
+#define BLOCK_DATA(block) ((uint8_t*)(block) + sizeof(ArenaBlock))
+
+void initArena(Arena* arena)
+{
+    arena->blocks = NULL;
+}
+
+void* arenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize)
+{
+    oldSize = ARENA_ALIGN(oldSize);
+    newSize = ARENA_ALIGN(newSize);
+    
+    ArenaBlock* block = arena->blocks;
+    if (pointer != NULL && block != NULL &&
+        (uint8_t*)pointer + oldSize == BLOCK_DATA(block) + block->used &&
+        block->used - oldSize + newSize <= block->size)
+    {
+        block->used += newSize - oldSize;
+        return pointer;
+    }
+    
+    if (block == NULL || block->used + newSize > block->size)
+    {
+        size_t size = newSize > ARENA_BLOCK_SIZE ? newSize : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + size);
+        if (block == NULL) exit(1);
+        block->next = arena->blocks;
+        block->size = size;
+        block->used = 0;
+        arena->blocks = block;
+    }
+    
+    void* result = BLOCK_DATA(block) + block->used;
+    block->used += newSize;
+    if (oldSize > 0) memcpy(result, pointer, oldSize);
+    return result;
+}
+
+ArenaMark arenaMark(Arena* arena)
+{
+    ArenaMark mark;
+    mark.block = arena->blocks;
+    mark.used = arena->blocks != NULL ? arena->blocks->used : 0;
+    return mark;
+}
+
+void releaseArena(Arena* arena, ArenaMark mark)
+{
+    if (arena->blocks == NULL) return;
+    
+    while (arena->blocks != mark.block && arena->blocks->next != NULL)
+    {
+        ArenaBlock* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    arena->blocks->used = arena->blocks == mark.block ? mark.used : 0;
+}
+
+void freeArena(Arena* arena)
+{
+    while (arena->blocks != NULL)
+    {
+        ArenaBlock* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+#define CODE_SEGMENT_SIZE (64 * 1024)
+
+// The segment's memory is read-only, so what is known about it is kept
+// apart.
+struct CodeSegment
+{
+    CodeSegment* next;
+    uint8_t* base;
+    size_t size;
+    size_t used;
+    // Bytes handed out and not freed yet.
+    size_t live;
+};
+
+void initCodeSpace(CodeSpace* space)
+{
+    space->segments = NULL;
+}
+
+// Changes the protection of the whole pages the bytes are on.
+static void protectCode(void* code, size_t size, int protection)
+{
+    uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)code & ~(pageSize - 1);
+    uintptr_t end = ((uintptr_t)code + size + pageSize - 1) & ~(pageSize - 1);
+    if (mprotect((void*)start, end - start, protection) != 0) exit(1);
+}
+
+void* allocateCode(CodeSpace* space, size_t size)
+{
+    vm.bytesAllocated += size;
+#ifdef DEBUG_STRESS_GC
+    collectGarbage();
+#endif
+    if (vm.bytesAllocated > vm.nextGC)
+    {
+        collectGarbage();
+    }
+
+    CodeSegment* segment = space->segments;
+    if (segment == NULL || segment->used + size > segment->size)
+    {
+        size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        size_t segmentSize = size > CODE_SEGMENT_SIZE ? size
+                                                      : CODE_SEGMENT_SIZE;
+        segmentSize = (segmentSize + pageSize - 1) & ~(pageSize - 1);
+        void* base = mmap(NULL, segmentSize, PROT_READ,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) exit(1);
+        segment = (CodeSegment*)malloc(sizeof(CodeSegment));
+        if (segment == NULL) exit(1);
+        segment->next = space->segments;
+        segment->base = (uint8_t*)base;
+        segment->size = segmentSize;
+        segment->used = 0;
+        segment->live = 0;
+        space->segments = segment;
+    }
+
+    void* result = segment->base + segment->used;
+    segment->used += size;
+    segment->live += size;
+    protectCode(result, size, PROT_READ | PROT_WRITE);
+    return result;
+}
+
+void sealCode(void* code, size_t size)
+{
+    protectCode(code, size, PROT_READ);
+}
+
+void freeCode(CodeSpace* space, void* code, size_t size)
+{
+    vm.bytesAllocated -= size;
+
+    CodeSegment** link = &space->segments;
+    while ((uint8_t*)code < (*link)->base ||
+           (uint8_t*)code >= (*link)->base + (*link)->size)
+    {
+        link = &(*link)->next;
+    }
+    CodeSegment* segment = *link;
+    segment->live -= size;
+    if (segment->live > 0) return;
+
+    // The segment being allocated from is kept and bumped into again.
+    if (segment == space->segments)
+    {
+        segment->used = 0;
+        return;
+    }
+    *link = segment->next;
+    munmap(segment->base, segment->size);
+    free(segment);
+}
+
+void freeCodeSpace(CodeSpace* space)
+{
+    while (space->segments != NULL)
+    {
+        CodeSegment* next = space->segments->next;
+        munmap(space->segments->base, space->segments->size);
+        free(space->segments);
+        space->segments = next;
+    }
+}
+
+#ifdef POINTER_COMPRESSION
+static ObjPage* allocatePage()
+{
+    if (freePages != NULL)
+    {
+        ObjPage* page = freePages;
+        freePages = page->next;
+        return page;
+    }
+
+    if (heapCage == NULL)
+    {
+        // Reserve the whole cage up front. Pages are only backed by memory
+        // once they are touched.
+        void* cage = mmap(NULL, HEAP_CAGE_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (cage == MAP_FAILED) exit(1);
+        heapCage = (uint8_t*)cage;
+        // Skip the first page so that no object sits at offset 0.
+        cageTop = heapCage + HEAP_PAGE_SIZE;
+    }
+
+    if (cageTop + HEAP_PAGE_SIZE > heapCage + HEAP_CAGE_SIZE)
+    {
+        fprintf(stderr, "Heap cage exhausted.\n");
+        exit(1);
+    }
+
+    ObjPage* page = (ObjPage*)cageTop;
+    cageTop += HEAP_PAGE_SIZE;
+    return page;
+}
+
+static void releasePage(ObjPage* page)
+{
+    madvise(page, HEAP_PAGE_SIZE, MADV_DONTNEED);
+    page->next = freePages;
+    freePages = page;
+}
+#else
+static ObjPage* allocatePage()
+{
+    ObjPage* page = (ObjPage*)malloc(HEAP_PAGE_SIZE);
+    if (page == NULL) exit(1);
+    return page;
+}
+
+static void releasePage(ObjPage* page)
+{
+    free(page);
+}
+#endif
+
+static void addPage(ObjType type, size_t size)
+{
+    ObjPage* page = allocatePage();
+    page->slotSize = (int)size;
+    page->slotCount = (int)((HEAP_PAGE_SIZE - sizeof(ObjPage)) / size);
+    page->next = vm.pages[type];
+    vm.pages[type] = page;
+
+    for (int i = page->slotCount - 1; i >= 0; i--)
+    {
+        FreeSlot* slot = (FreeSlot*)PAGE_SLOT(page, i);
+        slot->obj.header = OBJ_FREE_BIT;
+        slot->next = vm.freeSlots[type];
+        vm.freeSlots[type] = (Obj*)slot;
+    }
+}
+
+Obj* allocateSlot(ObjType type, size_t size)
+{
+    vm.bytesAllocated += size;
+#ifdef DEBUG_STRESS_GC
+    collectGarbage();
+#endif
+    if (vm.bytesAllocated > vm.nextGC)
+    {
+        collectGarbage();
+    }
+
+    if (vm.freeSlots[type] == NULL) addPage(type, size);
+
+    FreeSlot* slot = (FreeSlot*)vm.freeSlots[type];
+    vm.freeSlots[type] = slot->next;
+    return (Obj*)slot;
+}
+
+static void freeSlot(Obj* object, size_t size)
+{
+    vm.bytesAllocated -= size;
+    object->header = OBJ_FREE_BIT;
+}
+
 static void freeObject(Obj* object)
 {
 #ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void*)object, object->type);
+    printf("%p free type %d\n", (void*)object, objType(object));
 #endif
-    switch (object->type)
+    switch (objType(object))
     {
         case OBJ_STRING:
         {
             ObjString* string = (ObjString*)object;
             FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            freeSlot(object, sizeof(ObjString));
             break;
         }
         case OBJ_FUNCTION:
         {
             ObjFunction* function = (ObjFunction*)object;
+            freeOptimizedCode(function->optimized);
+            freeOptimizedCode(function->retired);
+            FREE_ARRAY(TypeCheck, function->checks, function->checkCount);
+            freeLazyFunction(function->lazy);
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+            freeSlot(object, sizeof(ObjFunction));
             break;
         }
         case OBJ_CLOSURE:
         {
             ObjClosure* closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            FREE_ARRAY(OBJ_REF(ObjUpvalue), closure->upvalues, closure->upvalueCount);
+            freeSlot(object, sizeof(ObjClosure));
             break;
         }
         case OBJ_UPVALUE:
         {
-            FREE(ObjUpvalue, object);
+            freeSlot(object, sizeof(ObjUpvalue));
             break;
         }
         case OBJ_CLASS:
         {
             ObjClass* klass = (ObjClass*)object;
+            FREE_ARRAY(OBJ_REF(ObjClosure), klass->vtable, klass->vtableCount);
             freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            freeSlot(object, sizeof(ObjClass));
             break;
         }
         case OBJ_INSTANCE:
         {
             ObjInstance* instance = (ObjInstance*)object;
             freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            freeSlot(object, sizeof(ObjInstance));
             break;
         }
         case OBJ_BOUND_METHOD:
         {
-            FREE(ObjBoundMethod, object);
+            freeSlot(object, sizeof(ObjBoundMethod));
             break;
         }
         case OBJ_NATIVE:
         {
-            FREE(ObjNative, object);
+            freeSlot(object, sizeof(ObjNative));
             break;
         }
             
@@ -99,12 +420,22 @@ static void freeObject(Obj* object)
 
 void freeObjects()
 {
-    Obj* object = vm.objects;
-    while (object != NULL)
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++)
     {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+        ObjPage* page = vm.pages[type];
+        while (page != NULL)
+        {
+            for (int i = 0; i < page->slotCount; i++)
+            {
+                Obj* object = PAGE_SLOT(page, i);
+                if (!isFree(object)) freeObject(object);
+            }
+            ObjPage* next = page->next;
+            releasePage(page);
+            page = next;
+        }
+        vm.pages[type] = NULL;
+        vm.freeSlots[type] = NULL;
     }
     free(vm.grayStack);
 }
@@ -112,13 +443,13 @@ void freeObjects()
 void markObject(Obj* object)
 {
     if (object == NULL) return;
-    if (object->isMarked) return;
+    if (isMarked(object)) return;
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif
-    object->isMarked = true;
+    object->header |= OBJ_MARKED_BIT;
     if (vm.grayCapacity < vm.grayCount + 1)
     {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
@@ -145,13 +476,24 @@ static void markRoots()
     {
         markObject((Obj*)vm.frames[i].closure);
     }
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+    for (int i = 0; i < vm.openUpvalueCount; i++)
     {
-        markObject((Obj*)upvalue);
+        markObject((Obj*)vm.openUpvalues[i]);
     }
     markTable(&vm.globals);
+    markTable(&vm.constants);
+    markTable(&vm.globalNames);
     markCompilerRoots();
     markObject((Obj*)vm.initString);
+    for (int i = 0; i < INTRINSIC_COUNT; i++)
+    {
+        markObject((Obj*)vm.intrinsicNames[i]);
+    }
+    for (int i = 0; i < vm.selectorCount; i++)
+    {
+        markObject((Obj*)vm.selectors[i]);
+        markValue(vm.selectorMethods[i]);
+    }
 }
 
 static void markArray(ValueArray* array)
@@ -170,7 +512,7 @@ static void blackenObject(Obj* object)
     printf("\n");
 #endif
     
-    switch (object->type)
+    switch (objType(object))
     {
         case OBJ_CLOSURE:
         {
@@ -187,6 +529,16 @@ static void blackenObject(Obj* object)
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
+            for (int i = 0; i < function->chunk.tableCount; i++)
+            {
+                markTable(&function->chunk.tables[i]);
+            }
+            // A cached target is compared by address, so it has to stay
+            // the object it was.
+            for (int i = 0; i < function->chunk.callCount; i++)
+            {
+                markObject((Obj*)function->chunk.calls[i].target);
+            }
             break;
         }
         case OBJ_UPVALUE:
@@ -196,6 +548,10 @@ static void blackenObject(Obj* object)
         {
             ObjClass* klass = (ObjClass*)object;
             markObject((Obj*)klass->name);
+            for (int i = 0; i < klass->vtableCount; i++)
+            {
+                markObject((Obj*)klass->vtable[i]);
+            }
             markTable(&klass->methods);
             break;
         }
@@ -230,30 +586,48 @@ static void traceReferences()
 
 static void sweep()
 {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    while (object != NULL)
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++)
     {
-        if (object->isMarked)
-        {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        }
-        else
+        // Rebuild the free list while walking, so pages left without a
+        // single live object can be handed back whole.
+        vm.freeSlots[type] = NULL;
+        ObjPage** link = &vm.pages[type];
+        while (*link != NULL)
         {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL)
+            ObjPage* page = *link;
+            Obj* freeBefore = vm.freeSlots[type];
+            int liveCount = 0;
+            for (int i = page->slotCount - 1; i >= 0; i--)
             {
-                previous->next = object;
+                Obj* object = PAGE_SLOT(page, i);
+                if (isFree(object))
+                {
+                    // Already available.
+                }
+                else if (isMarked(object))
+                {
+                    object->header &= ~OBJ_MARKED_BIT;
+                    liveCount++;
+                    continue;
+                }
+                else
+                {
+                    freeObject(object);
+                }
+                ((FreeSlot*)object)->next = vm.freeSlots[type];
+                vm.freeSlots[type] = object;
+            }
+
+            if (liveCount == 0)
+            {
+                vm.freeSlots[type] = freeBefore;
+                *link = page->next;
+                releasePage(page);
             }
             else
             {
-                vm.objects = object;
+                link = &page->next;
             }
-
-            freeObject(unreached);
         }
     }
 }
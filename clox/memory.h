@@ -18,6 +18,52 @@
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+
+// Memory handed out by bumping a pointer and taken back all at once. It
+// is outside the collector's accounting, so growing into it never starts
+// a collection.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct
+{
+    ArenaBlock* blocks;
+} Arena;
+
+// A point in the arena, to take back everything allocated after it.
+typedef struct
+{
+    ArenaBlock* block;
+    size_t used;
+} ArenaMark;
+
+void initArena(Arena* arena);
+// Like reallocate, for growing. The arena's last allocation grows in
+// place; any other is copied to the top.
+void* arenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize);
+ArenaMark arenaMark(Arena* arena);
+// Takes back what was allocated since the mark, keeping one block to
+// bump into again.
+void releaseArena(Arena* arena, ArenaMark mark);
+void freeArena(Arena* arena);
+
+// Memory for code that is written once and then only read. It is mapped
+// read-only except while a piece of it is written, so a stray write
+// faults instead of changing instructions.
+typedef struct CodeSegment CodeSegment;
+
+typedef struct
+{
+    CodeSegment* segments;
+} CodeSpace;
+
+void initCodeSpace(CodeSpace* space);
+// Returns size bytes that can be written until sealCode().
+void* allocateCode(CodeSpace* space, size_t size);
+void sealCode(void* code, size_t size);
+void freeCode(CodeSpace* space, void* code, size_t size);
+void freeCodeSpace(CodeSpace* space);
+
+Obj* allocateSlot(ObjType type, size_t size);
 void freeObjects();
 
 void markObject(Obj* object);
@@ -25,11 +25,8 @@ static uint32_t hashString(const char* key, int length)
 
 static Obj* allocateObject(size_t size, ObjType type)
 {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
-    object->type = type;
-    object->isMarked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+    Obj* object = allocateSlot(type, size);
+    object->header = (uint32_t)type;
     
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %ld for %d\n", (void*)object, size, type);
@@ -43,6 +40,8 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash)
     string->length = length;
     string->chars = chars;
     string->hash = hash;
+    string->selector = -1;
+    string->intrinsic = -1;
 
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
@@ -67,6 +66,16 @@ ObjString* copyString(const char* chars, int length)
 ObjString* takeString(char* chars, int length)
 {
     uint32_t hash = hashString(chars, length);
+    
+    // Built at run time, it must still be the same object as a constant
+    // of the same text, whenever that constant is compiled.
+    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    if (interned != NULL)
+    {
+        FREE_ARRAY(char, chars, length + 1);
+        return interned;
+    }
+    
     return allocateString(chars, length, hash);
 }
 
@@ -105,6 +114,9 @@ void printObject(Value value)
         case OBJ_BOUND_METHOD:
             printFunction(AS_BOUND_METHOD(value)->method->function);
             break;
+        case OBJ_NATIVE:
+            printf("<native fn>");
+            break;
     }
 }
 
@@ -114,8 +126,16 @@ ObjFunction* newFunction()
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 
     function->arity = 0;
+    function->maxSlots = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->hotness = 0;
+    function->numberParams = UINT32_MAX;
+    function->checks = NULL;
+    function->checkCount = 0;
+    function->optimized = NULL;
+    function->retired = NULL;
+    function->lazy = NULL;
     initChunk(&function->chunk);
     return function;
 }
@@ -124,12 +144,13 @@ ObjNative* newNative(NativeFn function)
 {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->intrinsic = -1;
     return native;
 }
 
 ObjClosure* newClosure(ObjFunction* function)
 {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+    OBJ_REF(ObjUpvalue)* upvalues = ALLOCATE(OBJ_REF(ObjUpvalue), function->upvalueCount);
     for (int i = 0; i < function->upvalueCount; i++)
     {
         upvalues[i] = NULL;
@@ -146,7 +167,6 @@ ObjUpvalue* newUpvalue(Value* slot)
 {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->location = slot;
-    upvalue->next = NULL;
     upvalue->closed = NIL_VAL;
     return upvalue;
 }
@@ -155,7 +175,12 @@ ObjClass* newClass(ObjString* name)
 {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
+    klass->vtable = NULL;
+    klass->vtableBase = 0;
+    klass->vtableCount = 0;
+    klass->methodCount = 0;
     initTable(&klass->methods);
+    klass->initializer = NULL;
     return klass;
 }
 
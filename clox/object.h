@@ -5,14 +5,14 @@
 #include "chunk.h"
 #include "table.h"
 
-#define OBJ_TYPE(value)        (AS_OBJ(value)->type)
+#define OBJ_TYPE(value)        (objType(AS_OBJ(value)))
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
-#define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
+#define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
 #define IS_CLASS(value)        isObjType(value, OBJ_CLASS)
@@ -33,17 +33,46 @@ typedef enum {
     OBJ_NATIVE
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_NATIVE + 1)
+
+// The header packs the object type into the low byte and keeps the GC
+// flags above it. Objects are not linked together: the collector finds
+// them by walking the heap pages they are allocated from.
+#define OBJ_TYPE_MASK  0xff
+#define OBJ_MARKED_BIT 0x100
+#define OBJ_FREE_BIT   0x200
+
 struct Obj {
-    ObjType type;
-    bool isMarked;
-    struct Obj* next;
+    uint32_t header;
 };
 
+typedef struct ObjPage ObjPage;
+
+static inline ObjType objType(Obj* object)
+{
+    return (ObjType)(object->header & OBJ_TYPE_MASK);
+}
+
+static inline bool isMarked(Obj* object)
+{
+    return (object->header & OBJ_MARKED_BIT) != 0;
+}
+
+static inline bool isFree(Obj* object)
+{
+    return (object->header & OBJ_FREE_BIT) != 0;
+}
+
 struct ObjString {
     Obj obj;
     int length;
     char* chars;
     uint32_t hash;
+    // Index into class vtables when this name is used as a method name,
+    // or -1.
+    int selector;
+    // The intrinsic that is the global of this name at startup, or -1.
+    int intrinsic;
 };
 
 ObjString* copyString(const char* chars, int length);
@@ -54,16 +83,41 @@ ObjString* takeString(char* chars, int length);
 
 static inline bool isObjType(Value value, ObjType type)
 {
-    return IS_OBJ(value) && AS_OBJ(value)->type == type;
+    return IS_OBJ(value) && objType(AS_OBJ(value)) == type;
 }
 
+typedef struct TypeCheck TypeCheck;
+typedef struct OptimizedCode OptimizedCode;
+typedef struct LazyFunction LazyFunction;
+
 typedef struct
 {
     Obj obj;
     int upvalueCount;
     int arity;
+    // Stack slots a call needs: the most its code has on the stack at
+    // once, set when the body is compiled.
+    int maxSlots;
     Chunk chunk;
-    ObjString* name;
+    OBJ_REF(ObjString) name;
+    // Calls counted while the function warms up, and the parameters that
+    // were numbers on every one of them, a bit each. Once it tiers up,
+    // only those the optimized code assumes are.
+    int hotness;
+    uint32_t numberParams;
+    // Type checks that the optimizing tier drops when the parameters
+    // they depend on were numbers on every call.
+    TypeCheck* checks;
+    int checkCount;
+    // Code from the optimizing tier, or NULL. It shares chunk's constants
+    // and is only entered when the arguments match numberParams. Code
+    // whose assumptions broke is kept in retired for frames still
+    // running it.
+    OptimizedCode* optimized;
+    OptimizedCode* retired;
+    // Source of a body that is compiled on the first call, or NULL once
+    // chunk holds it.
+    LazyFunction* lazy;
 } ObjFunction;
 
 ObjFunction* newFunction();
@@ -73,7 +127,9 @@ typedef Value (*NativeFn)(int argCount, Value* args);
 typedef struct
 {
     Obj obj;
+    // NULL for an intrinsic, which the VM runs itself.
     NativeFn function;
+    int intrinsic;
 } ObjNative;
 
 ObjNative* newNative(NativeFn function);
@@ -82,7 +138,6 @@ typedef struct ObjUpvalue
 {
     Obj obj;
     Value* location;
-    struct ObjUpvalue* next;
     Value closed;
 } ObjUpvalue;
 
@@ -91,8 +146,8 @@ ObjUpvalue* newUpvalue(Value* slot);
 typedef struct
 {
     Obj obj;
-    ObjFunction* function;
-    ObjUpvalue** upvalues;
+    OBJ_REF(ObjFunction) function;
+    OBJ_REF(ObjUpvalue)* upvalues;
     int upvalueCount;
 } ObjClosure;
 
@@ -101,8 +156,17 @@ ObjClosure* newClosure(ObjFunction* function);
 typedef struct
 {
     Obj obj;
-    ObjString* name;
+    OBJ_REF(ObjString) name;
+    // Methods indexed by selector - vtableBase, NULL where the class has
+    // none. The vtable only spans the selectors the class defines or
+    // inherits. When they are too spread out for that to pay, methods
+    // holds them all instead and the vtable is empty.
+    OBJ_REF(ObjClosure)* vtable;
+    int vtableBase;
+    int vtableCount;
+    int methodCount;
     Table methods;
+    OBJ_REF(ObjClosure) initializer;
 } ObjClass;
 
 ObjClass* newClass(ObjString* name);
@@ -110,7 +174,7 @@ ObjClass* newClass(ObjString* name);
 typedef struct
 {
     Obj obj;
-    ObjClass* klass;
+    OBJ_REF(ObjClass) klass;
     Table fields;
 } ObjInstance;
 
@@ -120,8 +184,8 @@ ObjInstance* newInstance(ObjClass* klass);
 typedef struct
 {
     Obj obj;
+    OBJ_REF(ObjClosure) method;
     Value receiver;
-    ObjClosure* method;
 } ObjBoundMethod;
 
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
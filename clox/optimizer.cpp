@@ -0,0 +1,446 @@
+#include <string.h>
+
+#include "optimizer.h"
+#include "memory.h"
+#include "vm.h"
+
+// The optimizer works on a decoded copy of the chunk, one entry per
+// instruction, and lays the surviving instructions out again at the end.
+// Jumps refer to instruction indexes while it runs, so removing code
+// never invalidates them.
+typedef struct
+{
+    int offset;
+    int length;
+    // The opcode, after any OP_WIDE prefix.
+    uint8_t op;
+    bool wide;
+    // Index of the instruction a jump goes to, or -1.
+    int target;
+    // Set on the entries of a jump table, which stay wide jumps so the
+    // VM can index them, even where they could be removed or narrowed.
+    bool entry;
+    int newOffset;
+    bool removed;
+    bool reachable;
+    bool isTarget;
+} Instruction;
+
+typedef struct
+{
+    Chunk* chunk;
+    Instruction* code;
+    // Number of instructions. code[count] is a sentinel for the end.
+    int count;
+} Optimizer;
+
+static bool isJump(uint8_t op)
+{
+    return op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE;
+}
+
+static bool isUnconditionalJump(uint8_t op)
+{
+    return op == OP_JUMP || op == OP_LOOP;
+}
+
+static bool isJumpTable(uint8_t op)
+{
+    return op == OP_JUMP_TABLE || op == OP_JUMP_TABLE_STRING;
+}
+
+// Number of entries after a jump table instruction.
+static int entryCount(Chunk* chunk, Instruction* instruction)
+{
+    uint8_t* bytes = &chunk->code[instruction->offset];
+    return ((bytes[3] << 8) | bytes[4]) + 1;
+}
+
+// Instructions that push one value and have no other effect.
+static bool isPurePush(uint8_t op)
+{
+    switch (op)
+    {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_ENCLOSING:
+        case OP_DUP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int nextLive(Optimizer* optimizer, int index)
+{
+    while (index < optimizer->count && optimizer->code[index].removed) index++;
+    return index;
+}
+
+static void decode(Optimizer* optimizer)
+{
+    Chunk* chunk = optimizer->chunk;
+
+    int count = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+    {
+        count++;
+    }
+
+    int* indexAt = ALLOCATE(int, chunk->count + 1);
+    optimizer->code = ALLOCATE(Instruction, count + 1);
+    optimizer->count = count;
+
+    int index = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+    {
+        Instruction* instruction = &optimizer->code[index];
+        instruction->offset = offset;
+        instruction->length = instructionLength(chunk, offset);
+        instruction->op = chunk->code[offset];
+        instruction->wide = instruction->op == OP_WIDE;
+        if (instruction->wide) instruction->op = chunk->code[offset + 1];
+        instruction->target = -1;
+        instruction->entry = false;
+        instruction->removed = false;
+        indexAt[offset] = index++;
+    }
+    indexAt[chunk->count] = count;
+
+    Instruction* end = &optimizer->code[count];
+    end->offset = chunk->count;
+    end->length = 0;
+    end->op = OP_RETURN;
+    end->wide = false;
+    end->target = -1;
+    end->entry = false;
+    end->removed = false;
+
+    for (int i = 0; i < count; i++)
+    {
+        Instruction* instruction = &optimizer->code[i];
+        if (isJumpTable(instruction->op))
+        {
+            int entries = entryCount(chunk, instruction);
+            for (int j = 1; j <= entries && i + j < count; j++)
+            {
+                optimizer->code[i + j].entry = true;
+            }
+        }
+        if (!isJump(instruction->op)) continue;
+
+        uint8_t* bytes = &chunk->code[instruction->offset];
+        int jump = (bytes[1] << 8) | bytes[2];
+        if (instruction->wide)
+        {
+            jump = (bytes[2] << 24) | (bytes[3] << 16) | (bytes[4] << 8) | bytes[5];
+        }
+        int next = instruction->offset + instruction->length;
+        instruction->target =
+            indexAt[instruction->op == OP_LOOP ? next - jump : next + jump];
+    }
+
+    FREE_ARRAY(int, indexAt, chunk->count + 1);
+}
+
+// Points jumps past other jumps they would land on. Conditional jumps
+// only move forward, since there is no backward conditional jump.
+static bool threadJumps(Optimizer* optimizer)
+{
+    bool changed = false;
+
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        Instruction* instruction = &optimizer->code[i];
+        if (instruction->removed || !isJump(instruction->op)) continue;
+
+        int target = nextLive(optimizer, instruction->target);
+        for (int hops = 0; hops < optimizer->count; hops++)
+        {
+            Instruction* landing = &optimizer->code[target];
+            int next;
+            if (isUnconditionalJump(landing->op))
+            {
+                next = nextLive(optimizer, landing->target);
+            }
+            else if (landing->op == OP_JUMP_IF_FALSE &&
+                     instruction->op == OP_JUMP_IF_FALSE)
+            {
+                // The condition is still on the stack and still false.
+                next = nextLive(optimizer, landing->target);
+            }
+            else
+            {
+                break;
+            }
+
+            if (next == target || next == i ||
+                (instruction->op == OP_JUMP_IF_FALSE && next <= i))
+            {
+                break;
+            }
+            target = next;
+        }
+
+        if (target != instruction->target)
+        {
+            instruction->target = target;
+            changed = true;
+        }
+
+        // Jumping to a return is the same as returning.
+        if (isUnconditionalJump(instruction->op) && !instruction->entry &&
+            target < optimizer->count &&
+            optimizer->code[target].op == OP_RETURN)
+        {
+            instruction->op = OP_RETURN;
+            instruction->wide = false;
+            instruction->length = 1;
+            instruction->target = -1;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static void markReachable(Optimizer* optimizer)
+{
+    for (int i = 0; i <= optimizer->count; i++)
+    {
+        optimizer->code[i].reachable = false;
+        optimizer->code[i].isTarget = false;
+    }
+
+    int* worklist = ALLOCATE(int, optimizer->count + 1);
+    int pending = 0;
+    worklist[pending++] = nextLive(optimizer, 0);
+
+    while (pending > 0)
+    {
+        int index = worklist[--pending];
+        if (index >= optimizer->count) continue;
+
+        Instruction* instruction = &optimizer->code[index];
+        if (instruction->reachable) continue;
+        instruction->reachable = true;
+
+        if (instruction->target != -1)
+        {
+            instruction->target = nextLive(optimizer, instruction->target);
+            optimizer->code[instruction->target].isTarget = true;
+            worklist[pending++] = instruction->target;
+        }
+        if (instruction->op != OP_RETURN &&
+            !isUnconditionalJump(instruction->op))
+        {
+            worklist[pending++] = nextLive(optimizer, index + 1);
+        }
+        // The table goes on to any of its entries.
+        if (isJumpTable(instruction->op))
+        {
+            int entries = entryCount(optimizer->chunk, instruction);
+            for (int j = 2; j <= entries; j++)
+            {
+                worklist[pending++] = index + j;
+            }
+        }
+    }
+
+    FREE_ARRAY(int, worklist, optimizer->count + 1);
+}
+
+static bool removeDeadCode(Optimizer* optimizer)
+{
+    bool changed = false;
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        Instruction* instruction = &optimizer->code[i];
+        if (!instruction->removed && !instruction->reachable)
+        {
+            instruction->removed = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static bool removeRedundantCode(Optimizer* optimizer)
+{
+    bool changed = false;
+
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        Instruction* instruction = &optimizer->code[i];
+        if (instruction->removed || instruction->entry) continue;
+
+        int next = nextLive(optimizer, i + 1);
+
+        // A jump to the next instruction does nothing. The conditional
+        // one leaves the condition on the stack either way.
+        if (isJump(instruction->op) &&
+            nextLive(optimizer, instruction->target) == next)
+        {
+            instruction->removed = true;
+            changed = true;
+            continue;
+        }
+
+        // A value pushed only to be popped. If a jump lands on the push,
+        // skipping the pair has the same effect, but one landing on the
+        // pop needs the value.
+        if (isPurePush(instruction->op) && next < optimizer->count &&
+            optimizer->code[next].op == OP_POP &&
+            !optimizer->code[next].isTarget)
+        {
+            instruction->removed = true;
+            optimizer->code[next].removed = true;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static int jumpLength(Instruction* instruction)
+{
+    return instruction->wide ? 6 : 3;
+}
+
+// Gives every instruction its new offset and returns the new size.
+static int assignOffsets(Optimizer* optimizer)
+{
+    int size = 0;
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        Instruction* instruction = &optimizer->code[i];
+        instruction->newOffset = size;
+        if (instruction->removed) continue;
+        size += isJump(instruction->op) ? jumpLength(instruction)
+                                        : instruction->length;
+    }
+    optimizer->code[optimizer->count].newOffset = size;
+    return size;
+}
+
+static int jumpDistance(Optimizer* optimizer, Instruction* instruction)
+{
+    int target = optimizer->code[nextLive(optimizer, instruction->target)].newOffset;
+    return target - (instruction->newOffset + jumpLength(instruction));
+}
+
+static void relayout(Optimizer* optimizer)
+{
+    Chunk* chunk = optimizer->chunk;
+
+    // Every jump starts out narrow. Widening one can push others out of
+    // range, so repeat until none needs to change; jumps only ever widen,
+    // so this ends.
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        Instruction* instruction = &optimizer->code[i];
+        if (isJump(instruction->op)) instruction->wide = instruction->entry;
+    }
+    int size = assignOffsets(optimizer);
+    bool widened = true;
+    while (widened)
+    {
+        widened = false;
+        for (int i = 0; i < optimizer->count; i++)
+        {
+            Instruction* instruction = &optimizer->code[i];
+            if (instruction->removed || !isJump(instruction->op) ||
+                instruction->wide) continue;
+
+            int jump = jumpDistance(optimizer, instruction);
+            if (jump > UINT16_MAX || -jump > UINT16_MAX)
+            {
+                instruction->wide = true;
+                widened = true;
+            }
+        }
+        if (widened) size = assignOffsets(optimizer);
+    }
+
+    uint8_t* code = (uint8_t*)arenaGrow(&vm.codeArena, NULL, 0, size);
+    Location* locations = (Location*)arenaGrow(&vm.codeArena, NULL, 0,
+                                               sizeof(Location) * size);
+
+    for (int i = 0; i < optimizer->count; i++)
+    {
+        Instruction* instruction = &optimizer->code[i];
+        if (instruction->removed) continue;
+
+        int from = instruction->offset;
+        int to = instruction->newOffset;
+        if (!isJump(instruction->op))
+        {
+            for (int j = 0; j < instruction->length; j++)
+            {
+                code[to + j] = chunk->code[from + j];
+                locations[to + j] = chunk->locations[from];
+            }
+            // A jump turned into a return has only its opcode left.
+            if (!instruction->wide) code[to] = instruction->op;
+            continue;
+        }
+
+        int length = jumpLength(instruction);
+        for (int j = 0; j < length; j++)
+        {
+            locations[to + j] = chunk->locations[from];
+        }
+
+        int jump = jumpDistance(optimizer, instruction);
+        uint8_t op = instruction->op;
+        if (op != OP_JUMP_IF_FALSE) op = jump < 0 ? OP_LOOP : OP_JUMP;
+        if (jump < 0) jump = -jump;
+
+        uint8_t* bytes = &code[to];
+        if (instruction->wide)
+        {
+            *bytes++ = OP_WIDE;
+            *bytes++ = op;
+            *bytes++ = (jump >> 24) & 0xff;
+            *bytes++ = (jump >> 16) & 0xff;
+        }
+        else
+        {
+            *bytes++ = op;
+        }
+        *bytes++ = (jump >> 8) & 0xff;
+        *bytes = jump & 0xff;
+    }
+
+    chunk->code = code;
+    chunk->locations = locations;
+    chunk->count = size;
+    chunk->capacity = size;
+}
+
+void optimizeChunk(Chunk* chunk)
+{
+    if (chunk->count == 0) return;
+
+    Optimizer optimizer;
+    optimizer.chunk = chunk;
+    decode(&optimizer);
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = threadJumps(&optimizer);
+        markReachable(&optimizer);
+        changed |= removeDeadCode(&optimizer);
+        changed |= removeRedundantCode(&optimizer);
+    }
+
+    relayout(&optimizer);
+    FREE_ARRAY(Instruction, optimizer.code, optimizer.count + 1);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "chunk.h"
+
+void optimizeChunk(Chunk* chunk);
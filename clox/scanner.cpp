@@ -9,15 +9,31 @@ typedef struct
     const char* start;
     const char* current;
     int line;
+    // Where the current line starts, and its column there, which is only
+    // past 1 on the first line of a function compiled on its first call.
+    const char* lineStart;
+    int lineColumn;
+    // Column of the token at start.
+    int column;
 } Scanner;
 
 Scanner scanner;
 
-void initScanner(const char* source)
+void initScanner(const char* source, int line, int column)
 {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
+    scanner.line = line;
+    scanner.lineStart = source;
+    scanner.lineColumn = column;
+    scanner.column = column;
+}
+
+static void newLine()
+{
+    scanner.line++;
+    scanner.lineStart = scanner.current + 1;
+    scanner.lineColumn = 1;
 }
 
 static bool isAtEnd()
@@ -32,6 +48,7 @@ static Token makeToken(TokenType type)
     token.start = scanner.start;
     token.length = (int)(scanner.current - scanner.start);
     token.line = scanner.line;
+    token.column = scanner.column;
 
     return token;
 }
@@ -43,6 +60,7 @@ static Token errorToken(const char* message)
     token.start = message;
     token.length = (int)strlen(message);
     token.line = scanner.line;
+    token.column = scanner.column;
 
     return token;
 }
@@ -85,7 +103,7 @@ static void skipWhitespace()
                 advance();
                 break;
             case '\n':
-                scanner.line++;
+                newLine();
                 advance();
                 break;
             case '/':
@@ -109,7 +127,7 @@ static Token string()
 {
     while (peek() != '"' && !isAtEnd())
     {
-        if (peek() == '\n') scanner.line++;
+        if (peek() == '\n') newLine();
         advance();
     }
 
@@ -164,7 +182,18 @@ static TokenType identifierType()
     switch (scanner.start[0])
     {
         case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+        case 'c':
+              if (scanner.current - scanner.start > 1)
+              {
+                  switch (scanner.start[1])
+                  {
+                      case 'a': return checkKeyword(2, 2, "se", TOKEN_CASE);
+                      case 'l': return checkKeyword(2, 3, "ass", TOKEN_CLASS);
+                      case 'o': return checkKeyword(2, 3, "nst", TOKEN_CONST);
+                  }
+              }
+              break;
+        case 'd': return checkKeyword(1, 6, "efault", TOKEN_DEFAULT);
         case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
         case 'f':
               if (scanner.current - scanner.start > 1)
@@ -182,7 +211,16 @@ static TokenType identifierType()
         case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
         case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
         case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+        case 's':
+              if (scanner.current - scanner.start > 1)
+              {
+                  switch (scanner.start[1])
+                  {
+                      case 'u': return checkKeyword(2, 3, "per", TOKEN_SUPER);
+                      case 'w': return checkKeyword(2, 4, "itch", TOKEN_SWITCH);
+                  }
+              }
+              break;
         case 't':
               if (scanner.current - scanner.start > 1)
               {
@@ -212,6 +250,8 @@ Token scanToken()
     skipWhitespace();
     
     scanner.start = scanner.current;
+    scanner.column = scanner.lineColumn +
+                     (int)(scanner.start - scanner.lineStart);
 
     if (isAtEnd()) return makeToken(TOKEN_EOF);
     
@@ -228,12 +268,17 @@ Token scanToken()
         case '{': return makeToken(TOKEN_LEFT_BRACE);
         case '}': return makeToken(TOKEN_RIGHT_BRACE);
         case ';': return makeToken(TOKEN_SEMICOLON);
+        case ':': return makeToken(TOKEN_COLON);
         case ',': return makeToken(TOKEN_COMMA);
         case '.': return makeToken(TOKEN_DOT);
-        case '-': return makeToken(TOKEN_MINUS);
-        case '+': return makeToken(TOKEN_PLUS);
-        case '/': return makeToken(TOKEN_SLASH);
-        case '*': return makeToken(TOKEN_STAR);
+        case '-':
+            if (match('-')) return makeToken(TOKEN_MINUS_MINUS);
+            return makeToken(match('=') ? TOKEN_MINUS_EQUAL : TOKEN_MINUS);
+        case '+':
+            if (match('+')) return makeToken(TOKEN_PLUS_PLUS);
+            return makeToken(match('=') ? TOKEN_PLUS_EQUAL : TOKEN_PLUS);
+        case '/': return makeToken(match('=') ? TOKEN_SLASH_EQUAL : TOKEN_SLASH);
+        case '*': return makeToken(match('=') ? TOKEN_STAR_EQUAL : TOKEN_STAR);
         case '!': return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
         case '=': return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
         case '<': return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
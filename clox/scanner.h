@@ -5,7 +5,7 @@ typedef enum
   // Single-character tokens.
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-    TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
+    TOKEN_COLON, TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
     TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
 
     // One or two character tokens.
@@ -13,14 +13,17 @@ typedef enum
     TOKEN_EQUAL, TOKEN_EQUAL_EQUAL,
     TOKEN_GREATER, TOKEN_GREATER_EQUAL,
     TOKEN_LESS, TOKEN_LESS_EQUAL,
+    TOKEN_MINUS_EQUAL, TOKEN_MINUS_MINUS,
+    TOKEN_PLUS_EQUAL, TOKEN_PLUS_PLUS,
+    TOKEN_SLASH_EQUAL, TOKEN_STAR_EQUAL,
 
     // Literals.
     TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
 
     // Keywords.
-    TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
-    TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
-    TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
+    TOKEN_AND, TOKEN_CASE, TOKEN_CLASS, TOKEN_CONST, TOKEN_DEFAULT, TOKEN_ELSE,
+    TOKEN_FALSE, TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
+    TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_SWITCH, TOKEN_THIS,
     TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
 
     TOKEN_ERROR,
@@ -33,7 +36,11 @@ typedef struct
     const char* start;
     int length;
     int line;
+    // Counted from 1, a tab being one column like any other character.
+    int column;
 } Token;
 
-void initScanner(const char* source);
+// Starts scanning source, whose first line is numbered line and whose
+// first character is at column.
+void initScanner(const char* source, int line, int column);
 Token scanToken();
@@ -121,6 +121,15 @@ bool tableGet(Table* table, ObjString* key, Value* value)
     return true;
 }
 
+Value* tableFind(Table* table, ObjString* key)
+{
+    if (table->count == 0) return NULL;
+
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    if (entry->key == NULL) return NULL;
+    return &entry->value;
+}
+
 bool tableDelete(Table* table, ObjString* key)
 {
     if (table->count == 0) return false;
@@ -179,7 +188,7 @@ void tableRemoveWhite(Table* table)
     for (int i = 0; i < table->capacity; i++)
     {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked)
+        if (entry->key != NULL && !isMarked((Obj*)entry->key))
         {
             tableDelete(table, entry->key);
         }
@@ -5,7 +5,7 @@
 
 typedef struct
 {
-    ObjString* key;
+    OBJ_REF(ObjString) key;
     Value value;
 } Entry;
 
@@ -22,6 +22,8 @@ void freeTable(Table* table);
 bool tableSet(Table* table, ObjString* key, Value value);
 void tableAddAll(Table* from, Table* to);
 bool tableGet(Table* table, ObjString* key, Value* value);
+// The value stored for key, to update in place, or NULL.
+Value* tableFind(Table* table, ObjString* key);
 bool tableDelete(Table* table, ObjString* key);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
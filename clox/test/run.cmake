@@ -0,0 +1,41 @@
+# Runs one test script with clox and checks it against the comments in
+# the script:
+#   // expect: <text>        the next line of standard output
+#   // expect error: <text>  text standard error has somewhere
+#   // expect exit: <code>   the exit code, 0 when there is none
+# Called as: cmake -DCLOX=<clox> -DTEST=<script> -P run.cmake
+
+file(STRINGS ${TEST} lines REGEX "// expect")
+set(expected "")
+set(errors "")
+set(exit 0)
+foreach(line IN LISTS lines)
+    if(line MATCHES "// expect: (.*)$")
+        set(expected "${expected}${CMAKE_MATCH_1}\n")
+    elseif(line MATCHES "// expect error: (.*)$")
+        list(APPEND errors "${CMAKE_MATCH_1}")
+    elseif(line MATCHES "// expect exit: ([0-9]+)")
+        set(exit ${CMAKE_MATCH_1})
+    endif()
+endforeach()
+
+execute_process(COMMAND ${CLOX} ${TEST}
+                OUTPUT_VARIABLE output
+                ERROR_VARIABLE error
+                RESULT_VARIABLE result)
+
+if(NOT result STREQUAL exit)
+    message(FATAL_ERROR "Expected exit ${exit}, got ${result}.\n${error}")
+endif()
+if(NOT output STREQUAL expected)
+    message(FATAL_ERROR "Expected output:\n${expected}Got:\n${output}")
+endif()
+foreach(text IN LISTS errors)
+    string(FIND "${error}" "${text}" found)
+    if(found EQUAL -1)
+        message(FATAL_ERROR "Expected error '${text}', got:\n${error}")
+    endif()
+endforeach()
+if(errors STREQUAL "" AND NOT error STREQUAL "")
+    message(FATAL_ERROR "Unexpected error:\n${error}")
+endif()
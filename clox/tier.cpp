@@ -0,0 +1,2664 @@
+#include <string.h>
+
+#include "tier.h"
+#include "memory.h"
+#include "vm.h"
+
+// The optimizing tier writes a hot function's bytecode out again with
+// these changes: arithmetic runs unchecked where the parameters its
+// operands come from were numbers on every call so far, calls of small
+// functions known by then have the callee's body copied in, and other
+// calls expect the kind of callee they have called so far.
+//
+// Before writing the code out, lift() follows the values in each block
+// as expressions of the values the slots held on entry. A pure
+// expression computed twice in a block, or a property of the same
+// instance read again with nothing stored or called in between, is kept
+// in a temporary the first time and read back from it after that. A
+// pure expression whose operands no loop around it stores to is
+// computed once, before the outermost such loop is entered. The
+// temporaries get their own frame slots after the parameters.
+//
+// An instance that never leaves the frame is not made at all when its
+// class's initializer only stores to fields: replaceScalars() keeps each
+// field in a temporary instead, behind a check that the callee is still
+// that class. If it isn't, the code as it was runs after the call.
+//
+// Which checks the parameters decide is worked out once, when the
+// function is compiled, by inferTypes(). It follows the types each frame
+// slot can hold through the function's basic blocks, along with the
+// parameters that make the slot a number when they all are. Locals and
+// temporaries are tracked alike, since the instructions address both by
+// their position in the frame. Checks no parameter decides are dropped
+// from the baseline code right away, and the rest are kept with the
+// function for the tier.
+
+typedef uint8_t TypeSet;
+
+#define TYPE_NIL    0x1
+#define TYPE_BOOL   0x2
+#define TYPE_NUMBER 0x4
+#define TYPE_OBJ    0x8
+#define TYPE_ANY    0xf
+
+// The parameters of a value that is a number when they all are, a bit
+// each, or NOT_NUMBER if no parameter's type decides it. Only the first
+// 31 parameters are followed, so the value never means a set of them.
+#define NOT_NUMBER UINT32_MAX
+
+typedef struct
+{
+    TypeSet types;
+    uint32_t params;
+} Type;
+
+typedef struct
+{
+    int offset;
+    int length;
+    // The opcode, after any OP_WIDE prefix.
+    uint8_t op;
+    // Slot or constant index, argument count for calls, or the offset a
+    // jump goes to.
+    int operand;
+    // Argument count of the invoke instructions.
+    int argCount;
+    // The parameters that make the instruction's operands numbers, or
+    // NOT_NUMBER. Set where the instruction has an unchecked form.
+    uint32_t params;
+    // Where the instruction went in the optimized code.
+    int newOffset;
+    // Set on the entries of a jump table but the last, as the table may
+    // go on to the entry after.
+    bool entry;
+    // The IR value the instruction leaves on top of the stack, or -1.
+    int value;
+    // How the optimized code replaces the instruction.
+    uint8_t rewrite;
+    // The loop the instruction is the header of, or -1.
+    int loop;
+    // Where the code computing the values hoisted out of that loop
+    // starts in the optimized code.
+    int hoistOffset;
+    // The instance kept in temporaries whose code the instruction is
+    // part of, or -1.
+    int scalar;
+} TierInstruction;
+
+typedef enum
+{
+    REWRITE_KEEP,
+    // Part of code that computes a value kept in a temporary.
+    REWRITE_SKIP,
+    // The last of that code, replaced by reading the temporary.
+    REWRITE_LOAD,
+    // Computes a value read again later, so stores it in its temporary.
+    REWRITE_SAVE,
+    // An OP_GET_PROPERTY of a property read before, which becomes an
+    // OP_REUSE_PROPERTY.
+    REWRITE_REUSE,
+    // A property of an instance kept in temporaries, read or stored as
+    // the temporary its value is. Pushing the instance is skipped.
+    REWRITE_FIELD
+} Rewrite;
+
+// The IR has a value for everything the function computes. Instructions
+// that compute the same thing from the same values give the same value,
+// which is how common subexpressions are found.
+#define VALUE_ENTRY  UINT8_MAX
+#define VALUE_OPAQUE (UINT8_MAX - 1)
+
+// The loop of a value made of constants alone.
+#define ANY_LOOP -2
+
+typedef struct
+{
+    // The opcode that computes it, or VALUE_ENTRY for what a slot holds
+    // on entry to a block, or VALUE_OPAQUE for anything else.
+    uint8_t op;
+    // Constant index, the slot of a VALUE_ENTRY, or a property's name.
+    int operand;
+    // The block a VALUE_ENTRY is the slot's value at the start of, or
+    // the loop it stays the same all through, after the blocks. For a
+    // property read, the stores and calls made before it.
+    int context;
+    int inputs[2];
+    // The outermost loop the value stays the same through, and can be
+    // computed ahead of, or -1.
+    int loop;
+    // The first instruction to compute it in the block it was last
+    // computed in.
+    int definer;
+    // Places that read it from its temporary instead of computing it.
+    int uses;
+    int temp;
+    bool hoisted;
+} TierValue;
+
+typedef struct
+{
+    // Instructions [header, end]. The last is an OP_LOOP to the header.
+    int header;
+    int end;
+    int parent;
+    // Stack height at the header.
+    int height;
+} TierLoop;
+
+// Where a field of an instance starts out: a parameter of the class's
+// initializer, a constant, or nil, true or false.
+typedef struct
+{
+    int field;
+    uint8_t op;
+    int param;
+    Value constant;
+} TierStore;
+
+// An instance that never leaves the frame making it, kept in a temporary
+// for each field instead. Its class's initializer only stores to fields.
+typedef struct
+{
+    // The call making it, and the instruction after which it is gone.
+    int call;
+    int end;
+    // The local it is kept in.
+    int slot;
+    Value klass;
+    ObjString* fields[SCALAR_MAX_FIELDS];
+    int fieldCount;
+    TierStore stores[SCALAR_MAX_FIELDS];
+    int storeCount;
+} TierScalar;
+
+typedef struct
+{
+    // Instructions [start, end).
+    int start;
+    int end;
+    int successors[2];
+    int successorCount;
+    // Types of the frame slots on entry, or NULL while unreached.
+    Type* entry;
+    int height;
+    bool queued;
+} TierBlock;
+
+typedef struct
+{
+    ObjFunction* function;
+    TierInstruction* code;
+    int count;
+    TierBlock* blocks;
+    int blockCount;
+    // Block starting at each instruction, or -1.
+    int* blockAt;
+    int maxSlots;
+    // Slots captured by a closure. A call can change them, so nothing
+    // is assumed about their type.
+    bool* captured;
+    // Set when the bytecode does something the analysis can't follow.
+    bool failed;
+    // Where each byte of the function's code came from.
+    Location* locations;
+    // The IR, once lift() builds it. The values that compute something
+    // are also in a hash table, by what they compute.
+    TierValue* values;
+    int valueCount;
+    int valueCapacity;
+    int* valueTable;
+    int valueTableCapacity;
+    // Stores to properties and calls so far, and blocks started.
+    int epoch;
+    TierLoop* loops;
+    int loopCount;
+    int loopCapacity;
+    // Innermost loop each instruction is in, or -1.
+    int* loopAt;
+    // The slots each loop stores to, maxSlots for each loop.
+    bool* loopWrites;
+    // Slots the optimized code keeps values in, after the parameters.
+    // The function's other locals are moved up past them.
+    int temps;
+    TierScalar* scalars;
+    int scalarCount;
+    int scalarCapacity;
+    // The first temporary of the instances' fields. They share them, as
+    // the code of one never runs in the middle of another's.
+    int fieldTemp;
+} Tier;
+
+static bool isJump(uint8_t op)
+{
+    return op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE;
+}
+
+static bool isForLoop(uint8_t op)
+{
+    return op == OP_FOR_LOOP || op == OP_FOR_LOOP_CONSTANT;
+}
+
+static bool isJumpTable(uint8_t op)
+{
+    return op == OP_JUMP_TABLE || op == OP_JUMP_TABLE_STRING;
+}
+
+static int readOperand(uint8_t* code, bool wide)
+{
+    if (!wide) return code[0];
+    return (code[0] << 8) | code[1];
+}
+
+static void decode(Tier* tier)
+{
+    Chunk* chunk = &tier->function->chunk;
+
+    int count = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+    {
+        count++;
+    }
+    tier->code = ALLOCATE(TierInstruction, count);
+    tier->count = count;
+
+    int index = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+    {
+        TierInstruction* instruction = &tier->code[index++];
+        instruction->offset = offset;
+        instruction->length = instructionLength(chunk, offset);
+        instruction->argCount = 0;
+        instruction->params = NOT_NUMBER;
+        instruction->entry = false;
+        instruction->value = -1;
+        instruction->rewrite = REWRITE_KEEP;
+        instruction->loop = -1;
+        instruction->hoistOffset = -1;
+        instruction->scalar = -1;
+
+        bool wide = chunk->code[offset] == OP_WIDE;
+        uint8_t* bytes = &chunk->code[wide ? offset + 1 : offset];
+        instruction->op = bytes[0];
+        instruction->operand = 0;
+        if (instruction->length > (wide ? 2 : 1))
+        {
+            instruction->operand = readOperand(bytes + 1, wide);
+        }
+
+        int width = wide ? 2 : 1;
+        switch (instruction->op)
+        {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_LOOP:
+            {
+                int jump = (bytes[1] << 8) | bytes[2];
+                if (wide)
+                {
+                    jump = (bytes[1] << 24) | (bytes[2] << 16) |
+                           (bytes[3] << 8) | bytes[4];
+                }
+                int next = offset + instruction->length;
+                instruction->operand =
+                    instruction->op == OP_LOOP ? next - jump : next + jump;
+                break;
+            }
+            case OP_CALL:
+            case OP_TAIL_CALL:
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE:
+            case OP_SUPER_INVOKE:
+                instruction->argCount = bytes[1 + width];
+                break;
+            case OP_INTRINSIC:
+                instruction->argCount = bytes[2];
+                break;
+            case OP_JUMP_TABLE:
+            case OP_JUMP_TABLE_STRING:
+                // The entries but the last, which are decoded next.
+                instruction->argCount = (bytes[3] << 8) | bytes[4];
+                break;
+            case OP_CLOSURE:
+            case OP_LOCAL_CLOSURE:
+            {
+                // A local function writes the slots it captures in place.
+                Value constant = chunk->constants.values[instruction->operand];
+                ObjFunction* function = IS_CLOSURE(constant)
+                    ? AS_CLOSURE(constant)->function : AS_FUNCTION(constant);
+                uint8_t* upvalue = bytes + 1 + width;
+                for (int i = 0; i < function->upvalueCount; i++)
+                {
+                    int slot = readOperand(upvalue + 1, wide);
+                    if (upvalue[0] && slot < tier->maxSlots)
+                    {
+                        tier->captured[slot] = true;
+                    }
+                    upvalue += 1 + width;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (!isJumpTable(tier->code[i].op)) continue;
+        for (int j = 1; j <= tier->code[i].argCount && i + j < count; j++)
+        {
+            tier->code[i + j].entry = true;
+        }
+    }
+}
+
+// Finds the instruction at offset, which must start one.
+static int instructionAt(Tier* tier, int offset)
+{
+    int low = 0;
+    int high = tier->count - 1;
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        if (tier->code[middle].offset == offset) return middle;
+        if (tier->code[middle].offset < offset) low = middle + 1;
+        else high = middle - 1;
+    }
+    tier->failed = true;
+    return 0;
+}
+
+static void findBlocks(Tier* tier)
+{
+    bool* leader = ALLOCATE(bool, tier->count + 1);
+    memset(leader, 0, sizeof(bool) * (tier->count + 1));
+    leader[0] = true;
+
+    for (int i = 0; i < tier->count; i++)
+    {
+        TierInstruction* instruction = &tier->code[i];
+        if (isJump(instruction->op))
+        {
+            leader[instructionAt(tier, instruction->operand)] = true;
+        }
+        if (isJump(instruction->op) || isJumpTable(instruction->op) ||
+            instruction->op == OP_RETURN)
+        {
+            leader[i + 1] = true;
+        }
+        // A counted loop goes on to its OP_LOOP or past it.
+        if (isForLoop(instruction->op))
+        {
+            leader[i + 1] = true;
+            if (i + 2 <= tier->count) leader[i + 2] = true;
+        }
+    }
+
+    tier->blockAt = ALLOCATE(int, tier->count);
+    int blockCount = 0;
+    for (int i = 0; i < tier->count; i++)
+    {
+        tier->blockAt[i] = leader[i] ? blockCount++ : -1;
+    }
+    FREE_ARRAY(bool, leader, tier->count + 1);
+
+    tier->blocks = ALLOCATE(TierBlock, blockCount);
+    tier->blockCount = blockCount;
+    for (int i = 0, block = -1; i < tier->count; i++)
+    {
+        if (tier->blockAt[i] == -1) continue;
+        block = tier->blockAt[i];
+        tier->blocks[block].start = i;
+        if (block > 0) tier->blocks[block - 1].end = i;
+    }
+    tier->blocks[blockCount - 1].end = tier->count;
+
+    for (int b = 0; b < blockCount; b++)
+    {
+        TierBlock* block = &tier->blocks[b];
+        block->entry = NULL;
+        block->height = 0;
+        block->queued = false;
+        block->successorCount = 0;
+
+        TierInstruction* last = &tier->code[block->end - 1];
+        if (isJump(last->op))
+        {
+            block->successors[block->successorCount++] =
+                tier->blockAt[instructionAt(tier, last->operand)];
+        }
+        if (((last->op != OP_JUMP && last->op != OP_LOOP) || last->entry) &&
+            last->op != OP_RETURN && b + 1 < blockCount)
+        {
+            block->successors[block->successorCount++] = b + 1;
+        }
+        if (isForLoop(last->op))
+        {
+            if (block->end + 1 < tier->count)
+            {
+                block->successors[block->successorCount++] =
+                    tier->blockAt[block->end + 1];
+            }
+            else
+            {
+                tier->failed = true;
+            }
+        }
+    }
+}
+
+static Type typeOf(TypeSet types)
+{
+    Type type;
+    type.types = types;
+    type.params = types == TYPE_NUMBER ? 0 : NOT_NUMBER;
+    return type;
+}
+
+static Type valueType(Value value)
+{
+    if (IS_NIL(value)) return typeOf(TYPE_NIL);
+    if (IS_BOOL(value)) return typeOf(TYPE_BOOL);
+    if (IS_NUMBER(value)) return typeOf(TYPE_NUMBER);
+    return typeOf(TYPE_OBJ);
+}
+
+// Applies the instruction's effect on the types of the frame slots.
+static void transfer(Tier* tier, TierInstruction* instruction,
+                     Type* slots, int* height)
+{
+#define PUSH(type) \
+    do { \
+        if (*height >= tier->maxSlots) { tier->failed = true; return; } \
+        slots[(*height)++] = (type); \
+    } while (false)
+#define POP(count) \
+    do { \
+        if (*height < (count)) { tier->failed = true; return; } \
+        *height -= (count); \
+    } while (false)
+#define PEEK(distance) (slots[*height - 1 - (distance)])
+
+    switch (instruction->op)
+    {
+        case OP_CONSTANT:
+            PUSH(valueType(tier->function->chunk.constants.values[instruction->operand]));
+            break;
+        case OP_NIL:
+            PUSH(typeOf(TYPE_NIL));
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            PUSH(typeOf(TYPE_BOOL));
+            break;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+            POP(2);
+            PUSH(typeOf(TYPE_BOOL));
+            break;
+        case OP_ADD:
+        {
+            // Numbers add to a number and strings to a string.
+            POP(2);
+            Type a = slots[*height];
+            Type b = slots[*height + 1];
+            TypeSet both = a.types & b.types & (TYPE_NUMBER | TYPE_OBJ);
+            Type result;
+            result.types = both != 0 ? both : TYPE_ANY;
+            result.params = a.params | b.params;
+            PUSH(result);
+            break;
+        }
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+            POP(2);
+            PUSH(typeOf(TYPE_NUMBER));
+            break;
+        case OP_NEGATE:
+        case OP_NEGATE_NUMBER:
+            POP(1);
+            PUSH(typeOf(TYPE_NUMBER));
+            break;
+        case OP_NOT:
+            POP(1);
+            PUSH(typeOf(TYPE_BOOL));
+            break;
+        case OP_PRINT:
+        case OP_POP:
+        case OP_JUMP_TABLE:
+        case OP_JUMP_TABLE_STRING:
+        case OP_DEFINE_GLOBAL:
+        case OP_CLOSE_UPVALUE:
+        case OP_METHOD:
+        case OP_INHERIT:
+            POP(1);
+            break;
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_ENCLOSING:
+            PUSH(typeOf(TYPE_ANY));
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_SET_ENCLOSING:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_RETURN:
+            break;
+        case OP_GET_LOCAL:
+        {
+            int slot = instruction->operand;
+            if (slot >= *height) { tier->failed = true; return; }
+            PUSH(tier->captured[slot] ? typeOf(TYPE_ANY) : slots[slot]);
+            break;
+        }
+        case OP_SET_LOCAL:
+        {
+            int slot = instruction->operand;
+            if (slot >= *height || *height == 0) { tier->failed = true; return; }
+            if (!tier->captured[slot]) slots[slot] = PEEK(0);
+            break;
+        }
+        case OP_FOR_LOOP:
+        case OP_FOR_LOOP_CONSTANT:
+        {
+            // Anything but a number is an error.
+            int slot = instruction->operand;
+            if (slot >= *height) { tier->failed = true; return; }
+            if (!tier->captured[slot]) slots[slot] = typeOf(TYPE_NUMBER);
+            break;
+        }
+        case OP_ADD_LOCAL:
+        {
+            int slot = instruction->operand;
+            if (slot >= *height) { tier->failed = true; return; }
+            if (!tier->captured[slot]) slots[slot] = typeOf(TYPE_NUMBER);
+            PUSH(typeOf(TYPE_NUMBER));
+            break;
+        }
+        case OP_DUP:
+        {
+            if (*height == 0) { tier->failed = true; return; }
+            Type value = PEEK(0);
+            PUSH(value);
+            break;
+        }
+        case OP_SWAP:
+        {
+            if (*height < 2) { tier->failed = true; return; }
+            Type top = PEEK(0);
+            PEEK(0) = PEEK(1);
+            PEEK(1) = top;
+            break;
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            POP(instruction->argCount + 1);
+            PUSH(typeOf(TYPE_ANY));
+            break;
+        case OP_INTRINSIC:
+            // The global may be something else by now.
+            POP(instruction->argCount);
+            PUSH(typeOf(TYPE_ANY));
+            break;
+        case OP_SUPER_INVOKE:
+            POP(instruction->argCount + 2);
+            PUSH(typeOf(TYPE_ANY));
+            break;
+        case OP_CLOSURE:
+        case OP_LOCAL_CLOSURE:
+        case OP_CLASS:
+            PUSH(typeOf(TYPE_OBJ));
+            break;
+        case OP_GET_PROPERTY:
+            POP(1);
+            PUSH(typeOf(TYPE_ANY));
+            break;
+        case OP_ADD_PROPERTY:
+            POP(1);
+            PUSH(typeOf(TYPE_NUMBER));
+            break;
+        case OP_SET_PROPERTY:
+        {
+            POP(2);
+            Type value = slots[*height + 1];
+            PUSH(value);
+            break;
+        }
+        case OP_GET_SUPER:
+            POP(2);
+            PUSH(typeOf(TYPE_OBJ));
+            break;
+        default:
+            tier->failed = true;
+            break;
+    }
+
+#undef PUSH
+#undef POP
+#undef PEEK
+}
+
+// Merges a predecessor's exit state into the block's entry state.
+static bool flowInto(Tier* tier, TierBlock* block, Type* slots, int height)
+{
+    if (block->entry == NULL)
+    {
+        block->entry = ALLOCATE(Type, tier->maxSlots);
+        memcpy(block->entry, slots, sizeof(Type) * height);
+        block->height = height;
+        return true;
+    }
+
+    if (block->height != height)
+    {
+        tier->failed = true;
+        return false;
+    }
+
+    bool changed = false;
+    for (int i = 0; i < height; i++)
+    {
+        Type merged;
+        merged.types = block->entry[i].types | slots[i].types;
+        merged.params = block->entry[i].params | slots[i].params;
+        if (merged.types != block->entry[i].types ||
+            merged.params != block->entry[i].params)
+        {
+            block->entry[i] = merged;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void analyze(Tier* tier)
+{
+    ObjFunction* function = tier->function;
+    Type* slots = ALLOCATE(Type, tier->maxSlots);
+    int* worklist = ALLOCATE(int, tier->blockCount);
+    int pending = 0;
+
+    // Slot zero holds the closure or the receiver.
+    int height = function->arity + 1;
+    if (height > tier->maxSlots) tier->failed = true;
+    else
+    {
+        slots[0] = typeOf(TYPE_OBJ);
+        for (int i = 0; i < function->arity; i++)
+        {
+            slots[i + 1].types = TYPE_ANY;
+            slots[i + 1].params = i < 31 ? 1u << i : NOT_NUMBER;
+        }
+        flowInto(tier, &tier->blocks[0], slots, height);
+        tier->blocks[0].queued = true;
+        worklist[pending++] = 0;
+    }
+
+    while (pending > 0 && !tier->failed)
+    {
+        TierBlock* block = &tier->blocks[worklist[--pending]];
+        block->queued = false;
+
+        height = block->height;
+        memcpy(slots, block->entry, sizeof(Type) * height);
+        for (int i = block->start; i < block->end && !tier->failed; i++)
+        {
+            transfer(tier, &tier->code[i], slots, &height);
+        }
+        if (tier->failed) break;
+
+        for (int i = 0; i < block->successorCount; i++)
+        {
+            // Leaving a counted loop pushes the false its condition
+            // would have left.
+            int successor = block->successors[i];
+            int successorHeight = height;
+            if (isForLoop(tier->code[block->end - 1].op) && i == 1)
+            {
+                if (height >= tier->maxSlots) { tier->failed = true; break; }
+                slots[successorHeight++] = typeOf(TYPE_BOOL);
+            }
+            if (flowInto(tier, &tier->blocks[successor], slots, successorHeight) &&
+                !tier->blocks[successor].queued)
+            {
+                tier->blocks[successor].queued = true;
+                worklist[pending++] = successor;
+            }
+        }
+    }
+
+    FREE_ARRAY(int, worklist, tier->blockCount);
+    FREE_ARRAY(Type, slots, tier->maxSlots);
+}
+
+static uint8_t uncheckedOp(uint8_t op)
+{
+    switch (op)
+    {
+        case OP_ADD:      return OP_ADD_NUMBER;
+        case OP_SUBTRACT: return OP_SUBTRACT_NUMBER;
+        case OP_MULTIPLY: return OP_MULTIPLY_NUMBER;
+        case OP_DIVIDE:   return OP_DIVIDE_NUMBER;
+        case OP_NEGATE:   return OP_NEGATE_NUMBER;
+        case OP_GREATER:  return OP_GREATER_NUMBER;
+        case OP_LESS:     return OP_LESS_NUMBER;
+        default:          return op;
+    }
+}
+
+// Sets the params of each instruction with an unchecked form from the
+// types its operands have once the analysis is done.
+static void findChecks(Tier* tier)
+{
+    Type* slots = ALLOCATE(Type, tier->maxSlots);
+    for (int b = 0; b < tier->blockCount && !tier->failed; b++)
+    {
+        TierBlock* block = &tier->blocks[b];
+        if (block->entry == NULL) continue;
+        int height = block->height;
+        memcpy(slots, block->entry, sizeof(Type) * height);
+
+        for (int i = block->start; i < block->end && !tier->failed; i++)
+        {
+            TierInstruction* instruction = &tier->code[i];
+            int operands = instruction->op == OP_NEGATE ? 1 : 2;
+            if (uncheckedOp(instruction->op) != instruction->op &&
+                height >= operands)
+            {
+                instruction->params = 0;
+                for (int j = 0; j < operands; j++)
+                {
+                    instruction->params |= slots[height - 1 - j].params;
+                }
+            }
+            transfer(tier, instruction, slots, &height);
+        }
+    }
+    FREE_ARRAY(Type, slots, tier->maxSlots);
+}
+
+static void initTier(Tier* tier, ObjFunction* function)
+{
+    tier->function = function;
+    tier->code = NULL;
+    tier->count = 0;
+    tier->blocks = NULL;
+    tier->blockCount = 0;
+    tier->blockAt = NULL;
+    tier->failed = false;
+    tier->values = NULL;
+    tier->valueCount = 0;
+    tier->valueCapacity = 0;
+    tier->valueTable = NULL;
+    tier->valueTableCapacity = 0;
+    tier->epoch = 0;
+    tier->loops = NULL;
+    tier->loopCount = 0;
+    tier->loopCapacity = 0;
+    tier->loopAt = NULL;
+    tier->loopWrites = NULL;
+    tier->temps = 0;
+    tier->scalars = NULL;
+    tier->scalarCount = 0;
+    tier->scalarCapacity = 0;
+    tier->fieldTemp = 0;
+    tier->maxSlots = function->maxSlots;
+    tier->captured = ALLOCATE(bool, tier->maxSlots);
+    memset(tier->captured, 0, sizeof(bool) * tier->maxSlots);
+    // A chunk still being compiled has them at hand. A packed one has
+    // its line table decoded.
+    Chunk* chunk = &function->chunk;
+    tier->locations = chunk->locations;
+    if (tier->locations == NULL)
+    {
+        tier->locations = ALLOCATE(Location, chunk->count);
+        chunkLocations(chunk, tier->locations);
+    }
+}
+
+static void freeTier(Tier* tier)
+{
+    for (int i = 0; i < tier->blockCount; i++)
+    {
+        if (tier->blocks[i].entry != NULL)
+        {
+            FREE_ARRAY(Type, tier->blocks[i].entry, tier->maxSlots);
+        }
+    }
+    FREE_ARRAY(TierBlock, tier->blocks, tier->blockCount);
+    if (tier->blockAt != NULL) FREE_ARRAY(int, tier->blockAt, tier->count);
+    FREE_ARRAY(TierInstruction, tier->code, tier->count);
+    FREE_ARRAY(bool, tier->captured, tier->maxSlots);
+    FREE_ARRAY(TierValue, tier->values, tier->valueCapacity);
+    FREE_ARRAY(int, tier->valueTable, tier->valueTableCapacity);
+    FREE_ARRAY(TierLoop, tier->loops, tier->loopCapacity);
+    if (tier->loopAt != NULL) FREE_ARRAY(int, tier->loopAt, tier->count);
+    FREE_ARRAY(bool, tier->loopWrites, tier->loopCapacity * tier->maxSlots);
+    FREE_ARRAY(TierScalar, tier->scalars, tier->scalarCapacity);
+    Chunk* chunk = &tier->function->chunk;
+    if (tier->locations != chunk->locations)
+    {
+        FREE_ARRAY(Location, tier->locations, chunk->count);
+    }
+}
+
+static int addValue(Tier* tier, uint8_t op, int operand, int context,
+                    int a, int b)
+{
+    if (tier->valueCapacity < tier->valueCount + 1)
+    {
+        int oldCapacity = tier->valueCapacity;
+        tier->valueCapacity = GROW_CAPACITY(oldCapacity);
+        tier->values = GROW_ARRAY(TierValue, tier->values,
+                                  oldCapacity, tier->valueCapacity);
+    }
+    TierValue* value = &tier->values[tier->valueCount];
+    value->op = op;
+    value->operand = operand;
+    value->context = context;
+    value->inputs[0] = a;
+    value->inputs[1] = b;
+    value->loop = -1;
+    value->definer = -1;
+    value->uses = 0;
+    value->temp = -1;
+    value->hoisted = false;
+    return tier->valueCount++;
+}
+
+static uint32_t hashValue(TierValue* value)
+{
+    int fields[] = {value->op, value->operand, value->context,
+                    value->inputs[0], value->inputs[1]};
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 5; i++)
+    {
+        hash ^= (uint32_t)fields[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void growValueTable(Tier* tier)
+{
+    FREE_ARRAY(int, tier->valueTable, tier->valueTableCapacity);
+    tier->valueTableCapacity = GROW_CAPACITY(tier->valueTableCapacity);
+    int capacity = tier->valueTableCapacity;
+    tier->valueTable = ALLOCATE(int, capacity);
+    for (int i = 0; i < capacity; i++) tier->valueTable[i] = -1;
+
+    for (int v = 0; v < tier->valueCount; v++)
+    {
+        if (tier->values[v].op == VALUE_OPAQUE) continue;
+        uint32_t index = hashValue(&tier->values[v]) & (capacity - 1);
+        while (tier->valueTable[index] != -1) index = (index + 1) & (capacity - 1);
+        tier->valueTable[index] = v;
+    }
+}
+
+// The value computing op from the operand and inputs, made the first
+// time it is asked for.
+static int findValue(Tier* tier, uint8_t op, int operand, int context,
+                     int a, int b)
+{
+    // The table is kept at most half full.
+    if (2 * (tier->valueCount + 1) > tier->valueTableCapacity)
+    {
+        growValueTable(tier);
+    }
+
+    int v = addValue(tier, op, operand, context, a, b);
+    TierValue* value = &tier->values[v];
+    int capacity = tier->valueTableCapacity;
+    uint32_t index = hashValue(value) & (capacity - 1);
+    for (;;)
+    {
+        int found = tier->valueTable[index];
+        if (found == -1) break;
+        TierValue* other = &tier->values[found];
+        if (other->op == op && other->operand == operand &&
+            other->context == context && other->inputs[0] == a &&
+            other->inputs[1] == b)
+        {
+            tier->valueCount--;
+            return found;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+    tier->valueTable[index] = v;
+    return v;
+}
+
+// A value nothing else is known to be the same as.
+static int opaqueValue(Tier* tier)
+{
+    return addValue(tier, VALUE_OPAQUE, 0, 0, -1, -1);
+}
+
+// The value the slot holds at the start of the block. It is the same
+// all through the outermost loop around the block that never stores to
+// the slot.
+static int entryValue(Tier* tier, int block, int slot)
+{
+    int loop = tier->loopAt[tier->blocks[block].start];
+    int outer = -1;
+    while (loop != -1 && slot < tier->loops[loop].height &&
+           !tier->loopWrites[loop * tier->maxSlots + slot])
+    {
+        outer = loop;
+        loop = tier->loops[loop].parent;
+    }
+    if (outer == -1) return findValue(tier, VALUE_ENTRY, slot, block, -1, -1);
+
+    int value = findValue(tier, VALUE_ENTRY, slot, tier->blockCount + outer,
+                          -1, -1);
+    tier->values[value].loop = outer;
+    return value;
+}
+
+// The outermost loop two values both stay the same through, of the
+// loops around the block computing them.
+static int commonLoop(Tier* tier, int a, int b)
+{
+    if (a == -1 || b == -1) return -1;
+    if (a == ANY_LOOP) return b;
+    if (b == ANY_LOOP) return a;
+    // Both loops are around the same block, so one is in the other.
+    return tier->loops[a].header > tier->loops[b].header ? a : b;
+}
+
+// Whether the loop is only entered through its header, so that code put
+// ahead of the header runs before anything in the loop does.
+static bool enteredAtHeader(Tier* tier, TierLoop* loop)
+{
+    for (int i = 0; i < tier->count; i++)
+    {
+        if (i >= loop->header && i <= loop->end) continue;
+        TierInstruction* instruction = &tier->code[i];
+        int first = tier->count;
+        int last = -1;
+        if (isJump(instruction->op))
+        {
+            first = last = instructionAt(tier, instruction->operand);
+        }
+        else if (isForLoop(instruction->op))
+        {
+            first = last = i + 2;
+        }
+        else if (isJumpTable(instruction->op))
+        {
+            first = i + 1;
+            last = i + 1 + instruction->argCount;
+        }
+        if (last > loop->header && first <= loop->end) return false;
+    }
+    return true;
+}
+
+// Finds the loops, from their OP_LOOPs, and the slots each stores to.
+// Returns false if they don't nest.
+static bool findLoops(Tier* tier, int* heights)
+{
+    tier->loopAt = ALLOCATE(int, tier->count);
+    for (int i = 0; i < tier->count; i++) tier->loopAt[i] = -1;
+
+    int count = 0;
+    for (int i = 0; i < tier->count; i++)
+    {
+        if (tier->code[i].op == OP_LOOP) count++;
+    }
+    if (count == 0) return true;
+    tier->loops = ALLOCATE(TierLoop, count);
+    tier->loopCapacity = count;
+
+    // Loops back to the same header are one loop, kept in header order.
+    for (int i = 0; i < tier->count; i++)
+    {
+        if (tier->code[i].op != OP_LOOP) continue;
+        int header = instructionAt(tier, tier->code[i].operand);
+        int j = tier->loopCount;
+        while (j > 0 && tier->loops[j - 1].header > header) j--;
+        if (j > 0 && tier->loops[j - 1].header == header)
+        {
+            if (i > tier->loops[j - 1].end) tier->loops[j - 1].end = i;
+            continue;
+        }
+        memmove(&tier->loops[j + 1], &tier->loops[j],
+                sizeof(TierLoop) * (tier->loopCount - j));
+        tier->loops[j].header = header;
+        tier->loops[j].end = i;
+        tier->loopCount++;
+    }
+
+    // Those entered elsewhere are left alone.
+    int kept = 0;
+    for (int l = 0; l < tier->loopCount; l++)
+    {
+        TierLoop* loop = &tier->loops[l];
+        loop->height = heights[tier->code[loop->header].offset];
+        if (loop->height == -1 || !enteredAtHeader(tier, loop)) continue;
+        tier->loops[kept++] = *loop;
+    }
+    tier->loopCount = kept;
+
+    int* open = ALLOCATE(int, tier->loopCapacity);
+    int depth = 0;
+    bool nested = true;
+    for (int l = 0; l < tier->loopCount && nested; l++)
+    {
+        TierLoop* loop = &tier->loops[l];
+        while (depth > 0 && tier->loops[open[depth - 1]].end < loop->header)
+        {
+            depth--;
+        }
+        if (depth > 0 && loop->end > tier->loops[open[depth - 1]].end)
+        {
+            nested = false;
+        }
+        loop->parent = depth > 0 ? open[depth - 1] : -1;
+        open[depth++] = l;
+    }
+    FREE_ARRAY(int, open, tier->loopCapacity);
+    if (!nested) return false;
+
+    tier->loopWrites = ALLOCATE(bool, tier->loopCapacity * tier->maxSlots);
+    memset(tier->loopWrites, 0,
+           sizeof(bool) * tier->loopCapacity * tier->maxSlots);
+    for (int l = 0; l < tier->loopCount; l++)
+    {
+        TierLoop* loop = &tier->loops[l];
+        tier->code[loop->header].loop = l;
+        bool* writes = &tier->loopWrites[l * tier->maxSlots];
+        for (int i = loop->header; i <= loop->end; i++)
+        {
+            tier->loopAt[i] = l;
+            TierInstruction* instruction = &tier->code[i];
+            if ((instruction->op == OP_SET_LOCAL ||
+                 instruction->op == OP_ADD_LOCAL ||
+                 isForLoop(instruction->op)) &&
+                instruction->operand < tier->maxSlots)
+            {
+                writes[instruction->operand] = true;
+            }
+        }
+    }
+    return true;
+}
+
+// Whether the instruction computes its result from its operands alone,
+// without failing: arithmetic the type checks let run unchecked,
+// comparisons for equality, and not.
+static bool isPure(TierInstruction* instruction)
+{
+    switch (instruction->op)
+    {
+        case OP_EQUAL:
+        case OP_NOT:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_NEGATE_NUMBER:
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+            return true;
+        default:
+            return uncheckedOp(instruction->op) != instruction->op &&
+                   instruction->params != NOT_NUMBER;
+    }
+}
+
+// How many values the instruction takes off the stack and puts back.
+// Instructions that only look at the top value take it and put it back.
+static bool stackEffect(TierInstruction* instruction, int* pops, int* pushes)
+{
+    *pops = 0;
+    *pushes = 0;
+    switch (instruction->op)
+    {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_ENCLOSING:
+        case OP_ADD_LOCAL:
+        case OP_CLOSURE:
+        case OP_CLASS:
+            *pushes = 1;
+            return true;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+            *pops = 2;
+            *pushes = 1;
+            return true;
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_NEGATE_NUMBER:
+        case OP_GET_PROPERTY:
+        case OP_ADD_PROPERTY:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_SET_UPVALUE:
+        case OP_SET_ENCLOSING:
+        case OP_JUMP_IF_FALSE:
+            *pops = 1;
+            *pushes = 1;
+            return true;
+        case OP_PRINT:
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_CLOSE_UPVALUE:
+        case OP_METHOD:
+        case OP_INHERIT:
+        case OP_JUMP_TABLE:
+        case OP_JUMP_TABLE_STRING:
+        case OP_RETURN:
+            *pops = 1;
+            return true;
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_FOR_LOOP:
+        case OP_FOR_LOOP_CONSTANT:
+            return true;
+        case OP_DUP:
+            *pops = 1;
+            *pushes = 2;
+            return true;
+        case OP_SWAP:
+            *pops = 2;
+            *pushes = 2;
+            return true;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            *pops = instruction->argCount + 1;
+            *pushes = 1;
+            return true;
+        case OP_SUPER_INVOKE:
+            *pops = instruction->argCount + 2;
+            *pushes = 1;
+            return true;
+        case OP_INTRINSIC:
+            *pops = instruction->argCount;
+            *pushes = 1;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether the instruction may store to a property, or run code that
+// does.
+static bool storesProperties(uint8_t op)
+{
+    switch (op)
+    {
+        case OP_SET_PROPERTY:
+        case OP_ADD_PROPERTY:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_INTRINSIC:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Marks the instructions from start to end, which compute the value end
+// leaves, to be replaced by a read of the value's temporary.
+static bool replaceCode(Tier* tier, int start, int end)
+{
+    for (int i = start; i < end; i++)
+    {
+        TierInstruction* instruction = &tier->code[i];
+        if (instruction->rewrite == REWRITE_LOAD)
+        {
+            tier->values[instruction->value].uses--;
+        }
+        else if (instruction->rewrite != REWRITE_KEEP &&
+                 instruction->rewrite != REWRITE_SKIP)
+        {
+            return false;
+        }
+        instruction->rewrite = REWRITE_SKIP;
+    }
+    tier->code[end].rewrite = REWRITE_LOAD;
+    tier->values[tier->code[end].value].uses++;
+    return true;
+}
+
+// Follows the instruction's effect on the values in the frame's slots.
+// starts holds, for each slot on the stack, the first instruction of the
+// code that pushed it, if that code does nothing else, or -1.
+static bool liftInstruction(Tier* tier, int block, int i, int* slots,
+                            int* starts, int* height)
+{
+    TierInstruction* instruction = &tier->code[i];
+    int pops;
+    int pushes;
+    if (!stackEffect(instruction, &pops, &pushes) || *height < pops ||
+        *height - pops + pushes > tier->maxSlots)
+    {
+        return false;
+    }
+    int top = *height - pops;
+    for (int s = top; s < *height; s++)
+    {
+        if (slots[s] == -1) slots[s] = entryValue(tier, block, s);
+    }
+
+    int blockStart = tier->blocks[block].start;
+    int value = -1;
+    int start = -1;
+    switch (instruction->op)
+    {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        {
+            int operand = instruction->op == OP_CONSTANT
+                ? instruction->operand : 0;
+            value = findValue(tier, instruction->op, operand, 0, -1, -1);
+            tier->values[value].loop = ANY_LOOP;
+            start = i;
+            break;
+        }
+        case OP_GET_LOCAL:
+        {
+            // A closure can store to a captured slot during a call.
+            int slot = instruction->operand;
+            if (slot >= *height) return false;
+            if (tier->captured[slot])
+            {
+                value = opaqueValue(tier);
+            }
+            else
+            {
+                if (slots[slot] == -1) slots[slot] = entryValue(tier, block, slot);
+                value = slots[slot];
+            }
+            start = i;
+            break;
+        }
+        case OP_SET_LOCAL:
+        {
+            int slot = instruction->operand;
+            if (slot >= top) return false;
+            value = slots[top];
+            if (!tier->captured[slot]) slots[slot] = value;
+            break;
+        }
+        case OP_ADD_LOCAL:
+        case OP_FOR_LOOP:
+        case OP_FOR_LOOP_CONSTANT:
+        {
+            int slot = instruction->operand;
+            if (slot >= top) return false;
+            value = opaqueValue(tier);
+            if (!tier->captured[slot]) slots[slot] = value;
+            break;
+        }
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_SET_ENCLOSING:
+        case OP_JUMP_IF_FALSE:
+            value = slots[top];
+            break;
+        case OP_DUP:
+            slots[top + 1] = slots[top];
+            starts[top] = -1;
+            value = slots[top];
+            break;
+        case OP_SWAP:
+        {
+            int swapped = slots[top];
+            slots[top] = slots[top + 1];
+            slots[top + 1] = swapped;
+            starts[top] = -1;
+            value = swapped;
+            break;
+        }
+        case OP_GET_PROPERTY:
+        {
+            // Read again with no store or call since, it is the same.
+            value = findValue(tier, OP_GET_PROPERTY, instruction->operand,
+                              tier->epoch, slots[top], -1);
+            TierValue* read = &tier->values[value];
+            if (read->definer != -1)
+            {
+                instruction->rewrite = REWRITE_REUSE;
+                tier->code[read->definer].rewrite = REWRITE_SAVE;
+                read->uses++;
+            }
+            else
+            {
+                read->definer = i;
+            }
+            break;
+        }
+        default:
+        {
+            if (!isPure(instruction))
+            {
+                if (pushes > 0) value = opaqueValue(tier);
+                break;
+            }
+
+            int a = slots[top];
+            int b = pops == 2 ? slots[top + 1] : -1;
+            value = findValue(tier, uncheckedOp(instruction->op), 0, 0, a, b);
+            TierValue* computed = &tier->values[value];
+            computed->loop = commonLoop(tier, tier->values[a].loop,
+                                        b != -1 ? tier->values[b].loop
+                                                : ANY_LOOP);
+            if (starts[top] != -1 && (b == -1 || starts[top + 1] != -1))
+            {
+                start = starts[top];
+            }
+            instruction->value = value;
+
+            if (start != -1 && computed->loop >= 0)
+            {
+                // The same all through a loop, so computed ahead of it.
+                if (!replaceCode(tier, start, i)) return false;
+                computed->hoisted = true;
+            }
+            else if (start != -1 && computed->definer >= blockStart &&
+                     i - start >= 2)
+            {
+                // Computed before in the block.
+                if (!replaceCode(tier, start, i)) return false;
+                TierInstruction* definer = &tier->code[computed->definer];
+                if (definer->rewrite != REWRITE_KEEP &&
+                    definer->rewrite != REWRITE_SAVE)
+                {
+                    return false;
+                }
+                definer->rewrite = REWRITE_SAVE;
+            }
+            else if (computed->definer < blockStart)
+            {
+                computed->definer = i;
+            }
+            break;
+        }
+    }
+
+    if (storesProperties(instruction->op)) tier->epoch++;
+    instruction->value = value;
+    *height = top + pushes;
+    if (pushes == 1)
+    {
+        slots[top] = value;
+        starts[top] = start;
+    }
+    else if (pushes == 2)
+    {
+        starts[top + 1] = -1;
+    }
+    return true;
+}
+
+// Whether the code of an instance kept in temporaries is in the block.
+// lift() leaves those blocks alone.
+static bool holdsScalar(Tier* tier, TierBlock* block)
+{
+    for (int i = block->start; i < block->end; i++)
+    {
+        if (tier->code[i].scalar != -1) return true;
+    }
+    return false;
+}
+
+// Whether the optimized code can move the function's locals up past
+// temporaries. A local function reads its enclosing frame's slots where
+// the baseline code has them.
+static bool movesLocals(Tier* tier)
+{
+    for (int i = 0; i < tier->count; i++)
+    {
+        if (tier->code[i].op == OP_LOCAL_CLOSURE) return false;
+    }
+    return true;
+}
+
+// Lifts the function into the IR and finds what the optimized code can
+// keep in temporaries instead of computing again: values computed before
+// in the same block, properties read before with nothing stored since,
+// and values that stay the same all through a loop, which are computed
+// once ahead of it. heights holds the stack height at each offset.
+static void lift(Tier* tier, int* heights)
+{
+    if (!movesLocals(tier)) return;
+
+    bool lifted = findLoops(tier, heights);
+    int* slots = ALLOCATE(int, tier->maxSlots);
+    int* starts = ALLOCATE(int, tier->maxSlots);
+    for (int b = 0; b < tier->blockCount && lifted; b++)
+    {
+        TierBlock* block = &tier->blocks[b];
+        int height = heights[tier->code[block->start].offset];
+        if (height == -1 || holdsScalar(tier, block)) continue;
+        if (height > tier->maxSlots)
+        {
+            lifted = false;
+            break;
+        }
+        for (int s = 0; s < height; s++)
+        {
+            slots[s] = -1;
+            starts[s] = -1;
+        }
+        tier->epoch++;
+        for (int i = block->start; i < block->end && lifted; i++)
+        {
+            lifted = liftInstruction(tier, b, i, slots, starts, &height);
+        }
+    }
+    FREE_ARRAY(int, slots, tier->maxSlots);
+    FREE_ARRAY(int, starts, tier->maxSlots);
+
+    // Values read again get temporaries, as long as every slot still
+    // fits in a byte.
+    int temps = 0;
+    for (int v = 0; v < tier->valueCount && lifted; v++)
+    {
+        if (tier->values[v].uses > 0) tier->values[v].temp = temps++;
+    }
+    if (tier->maxSlots + temps > UINT8_MAX) lifted = false;
+
+    for (int i = 0; i < tier->count; i++)
+    {
+        TierInstruction* instruction = &tier->code[i];
+        if (instruction->scalar != -1) continue;
+        if (!lifted)
+        {
+            instruction->rewrite = REWRITE_KEEP;
+            instruction->loop = -1;
+        }
+        else if (instruction->rewrite == REWRITE_SAVE &&
+                 tier->values[instruction->value].uses == 0)
+        {
+            instruction->rewrite = REWRITE_KEEP;
+        }
+    }
+    tier->temps = lifted ? temps : 0;
+}
+
+// Instances that never leave the frame.
+
+static int scalarField(TierScalar* scalar, ObjString* name)
+{
+    for (int i = 0; i < scalar->fieldCount; i++)
+    {
+        if (scalar->fields[i] == name) return i;
+    }
+    return -1;
+}
+
+// Reads what the class's initializer stores into scalar, if storing
+// parameters and constants to fields of this is all it does.
+static bool readInitializer(ObjClass* klass, int argCount,
+                            TierScalar* scalar)
+{
+    ObjClosure* initializer = klass->initializer;
+    if (initializer == NULL || initializer->upvalueCount != 0) return false;
+    ObjFunction* function = initializer->function;
+    if (function->lazy != NULL || function->arity != argCount) return false;
+
+    Chunk* chunk = &function->chunk;
+    Tier body;
+    initTier(&body, function);
+    decode(&body);
+    scalar->fieldCount = 0;
+    scalar->storeCount = 0;
+    bool read = !body.failed;
+    int i = 0;
+    // Each store is this, the value, OP_SET_PROPERTY and OP_POP.
+    while (read && i + 1 < body.count && body.code[i + 1].op != OP_RETURN)
+    {
+        TierInstruction* code = &body.code[i];
+        read = i + 3 < body.count && scalar->storeCount < SCALAR_MAX_FIELDS &&
+               code[0].op == OP_GET_LOCAL && code[0].operand == 0 &&
+               code[2].op == OP_SET_PROPERTY && code[3].op == OP_POP;
+        if (!read) break;
+
+        TierStore* store = &scalar->stores[scalar->storeCount++];
+        store->op = code[1].op;
+        switch (code[1].op)
+        {
+            case OP_GET_LOCAL:
+                store->param = code[1].operand;
+                read = store->param >= 1 && store->param <= argCount;
+                break;
+            case OP_CONSTANT:
+                store->constant = chunk->constants.values[code[1].operand];
+                break;
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                break;
+            default:
+                read = false;
+                break;
+        }
+        ObjString* name = AS_STRING(chunk->constants.values[code[2].operand]);
+        store->field = scalarField(scalar, name);
+        if (store->field == -1)
+        {
+            store->field = scalar->fieldCount;
+            scalar->fields[scalar->fieldCount++] = name;
+        }
+        i += 4;
+    }
+    // Then this is returned.
+    read = read && i + 1 < body.count &&
+           body.code[i].op == OP_GET_LOCAL && body.code[i].operand == 0;
+    freeTier(&body);
+    return read;
+}
+
+// The instruction in the same block as instruction i that pushed what is
+// in slot by the time i runs, or -1.
+static int pushedBy(Tier* tier, int* heights, int i, int slot)
+{
+    for (int j = i - 1; j >= 0; j--)
+    {
+        TierInstruction* instruction = &tier->code[j];
+        int height = heights[instruction->offset];
+        int pops, pushes;
+        if (height == -1 || !stackEffect(instruction, &pops, &pushes))
+        {
+            return -1;
+        }
+        if (height - pops <= slot)
+        {
+            return height - pops + pushes > slot ? j : -1;
+        }
+        if (tier->blockAt[j] != -1) return -1;
+    }
+    return -1;
+}
+
+// Follows the instance the scalar's call makes through the rest of the
+// block. It may stay in its local, have the fields its initializer
+// stores read and stored through that, and be popped with the local or
+// left behind by a return. Marks what touches it, and returns the
+// instruction after which it is gone, or -1 if it escapes.
+static int followInstance(Tier* tier, int* heights, TierScalar* scalar,
+                          bool* held)
+{
+    int slot = scalar->slot;
+    if (tier->captured[slot]) return -1;
+    for (int s = 0; s < tier->maxSlots; s++) held[s] = false;
+    held[slot] = true;
+
+    int start = tier->code[scalar->call].offset;
+    for (int i = scalar->call + 1;
+         i < tier->count && tier->blockAt[i] == -1; i++)
+    {
+        TierInstruction* instruction = &tier->code[i];
+        int height = heights[instruction->offset];
+        int pops, pushes;
+        if (height <= slot ||
+            instruction->offset + instruction->length - start >
+                SCALAR_MAX_BYTES ||
+            !stackEffect(instruction, &pops, &pushes))
+        {
+            return -1;
+        }
+
+        // Where the instance is taken from, if a field is.
+        int receiver = -1;
+        switch (instruction->op)
+        {
+            case OP_GET_LOCAL:
+                if (instruction->operand != slot) break;
+                if (height >= tier->maxSlots) return -1;
+                instruction->rewrite = REWRITE_SKIP;
+                held[height] = true;
+                continue;
+            case OP_SET_LOCAL:
+            case OP_ADD_LOCAL:
+                if (instruction->operand == slot) return -1;
+                break;
+            case OP_GET_PROPERTY:
+                receiver = height - 1;
+                break;
+            case OP_SET_PROPERTY:
+                if (held[height - 1]) return -1;
+                receiver = height - 2;
+                break;
+            case OP_POP:
+                if (height - 1 == slot) return i;
+                break;
+            case OP_RETURN:
+                return held[height - 1] ? -1 : i;
+            default:
+                break;
+        }
+
+        if (receiver > slot && held[receiver])
+        {
+            ObjString* name = AS_STRING(
+                tier->function->chunk.constants.values[instruction->operand]);
+            int field = scalarField(scalar, name);
+            if (field == -1) return -1;
+            instruction->rewrite = REWRITE_FIELD;
+            instruction->value = field;
+            held[receiver] = false;
+            continue;
+        }
+        for (int s = height - pops; s < height; s++)
+        {
+            if (held[s]) return -1;
+        }
+        for (int s = height - pops; s < height - pops + pushes; s++)
+        {
+            held[s] = false;
+        }
+    }
+    return -1;
+}
+
+// Finds the calls making an instance that never leaves the frame, of a
+// class whose initializer only stores to fields. The optimized code
+// keeps its fields in temporaries instead, as long as the callee is
+// still that class. heights holds the stack height at each offset.
+static void replaceScalars(Tier* tier, int* heights)
+{
+    if (!movesLocals(tier)) return;
+
+    Chunk* chunk = &tier->function->chunk;
+    bool* held = ALLOCATE(bool, tier->maxSlots);
+    for (int i = 0; i < tier->count; i++)
+    {
+        TierInstruction* call = &tier->code[i];
+        int height = heights[call->offset];
+        if (call->op != OP_CALL || height == -1) continue;
+
+        TierScalar scalar;
+        scalar.call = i;
+        scalar.slot = height - call->argCount - 1;
+        int origin = pushedBy(tier, heights, i, scalar.slot);
+        if (origin == -1 || tier->code[origin].op != OP_GET_GLOBAL) continue;
+        ObjString* name =
+            AS_STRING(chunk->constants.values[tier->code[origin].operand]);
+        if (!tableGet(&vm.globals, name, &scalar.klass) ||
+            !IS_CLASS(scalar.klass) ||
+            !readInitializer(AS_CLASS(scalar.klass), call->argCount, &scalar))
+        {
+            continue;
+        }
+
+        scalar.end = followInstance(tier, heights, &scalar, held);
+        if (scalar.end == -1)
+        {
+            for (int j = i + 1; j < tier->count && tier->blockAt[j] == -1; j++)
+            {
+                tier->code[j].rewrite = REWRITE_KEEP;
+                tier->code[j].value = -1;
+            }
+            continue;
+        }
+
+        if (tier->scalarCapacity < tier->scalarCount + 1)
+        {
+            int oldCapacity = tier->scalarCapacity;
+            tier->scalarCapacity = GROW_CAPACITY(oldCapacity);
+            tier->scalars = GROW_ARRAY(TierScalar, tier->scalars,
+                                       oldCapacity, tier->scalarCapacity);
+        }
+        for (int j = i; j <= scalar.end; j++)
+        {
+            tier->code[j].scalar = tier->scalarCount;
+        }
+        tier->scalars[tier->scalarCount++] = scalar;
+        i = scalar.end;
+    }
+    FREE_ARRAY(bool, held, tier->maxSlots);
+}
+
+// Gives the instances' fields their temporaries, after lift()'s, unless
+// they no longer fit in a byte. Then no instance is kept in them.
+static void placeScalars(Tier* tier)
+{
+    int fields = 0;
+    for (int s = 0; s < tier->scalarCount; s++)
+    {
+        if (tier->scalars[s].fieldCount > fields)
+        {
+            fields = tier->scalars[s].fieldCount;
+        }
+    }
+    tier->fieldTemp = tier->temps;
+    if (tier->maxSlots + tier->temps + fields <= UINT8_MAX)
+    {
+        tier->temps += fields;
+        return;
+    }
+
+    for (int i = 0; i < tier->count; i++)
+    {
+        TierInstruction* instruction = &tier->code[i];
+        if (instruction->scalar == -1) continue;
+        instruction->scalar = -1;
+        instruction->rewrite = REWRITE_KEEP;
+        instruction->value = -1;
+    }
+    tier->scalarCount = 0;
+}
+
+// The optimized code as it is written.
+typedef struct
+{
+    uint8_t* code;
+    Location* locations;
+    int count;
+    int capacity;
+    InlineSite* sites;
+    int siteCount;
+    int siteCapacity;
+    // Slots the frame needs for the bodies copied into it.
+    int maxSlots;
+} Emitter;
+
+static void initEmitter(Emitter* out)
+{
+    out->code = NULL;
+    out->locations = NULL;
+    out->count = 0;
+    out->capacity = 0;
+    out->sites = NULL;
+    out->siteCount = 0;
+    out->siteCapacity = 0;
+    out->maxSlots = 0;
+}
+
+static void freeEmitter(Emitter* out)
+{
+    FREE_ARRAY(uint8_t, out->code, out->capacity);
+    FREE_ARRAY(Location, out->locations, out->capacity);
+    FREE_ARRAY(InlineSite, out->sites, out->siteCapacity);
+    initEmitter(out);
+}
+
+static void emitByte(Emitter* out, uint8_t byte, Location location)
+{
+    if (out->capacity < out->count + 1)
+    {
+        int oldCapacity = out->capacity;
+        out->capacity = GROW_CAPACITY(oldCapacity);
+        out->code = GROW_ARRAY(uint8_t, out->code, oldCapacity, out->capacity);
+        out->locations = GROW_ARRAY(Location, out->locations,
+                                    oldCapacity, out->capacity);
+    }
+    out->code[out->count] = byte;
+    out->locations[out->count] = location;
+    out->count++;
+}
+
+static void emitShort(Emitter* out, int value, Location location)
+{
+    emitByte(out, (value >> 8) & 0xff, location);
+    emitByte(out, value & 0xff, location);
+}
+
+// Emits an instruction with a slot or constant operand, behind OP_WIDE
+// if the operand needs it.
+static void emitOperand(Emitter* out, uint8_t op, int operand,
+                        Location location)
+{
+    if (operand > UINT8_MAX)
+    {
+        emitByte(out, OP_WIDE, location);
+        emitByte(out, op, location);
+        emitShort(out, operand, location);
+    }
+    else
+    {
+        emitByte(out, op, location);
+        emitByte(out, operand, location);
+    }
+}
+
+// Where a slot of the baseline frame is in the optimized one, which has
+// the temporaries after the parameters.
+static int shiftSlot(Tier* tier, int slot)
+{
+    return slot > tier->function->arity ? slot + tier->temps : slot;
+}
+
+static int tempSlot(Tier* tier, int value)
+{
+    return tier->function->arity + 1 + tier->values[value].temp;
+}
+
+// Copies the instruction, with the locals it names moved past the
+// temporaries.
+static void copyInstruction(Tier* tier, Emitter* out,
+                            TierInstruction* instruction, Location location)
+{
+    Chunk* chunk = &tier->function->chunk;
+    if (instruction->op == OP_GET_LOCAL || instruction->op == OP_SET_LOCAL)
+    {
+        emitOperand(out, instruction->op,
+                    shiftSlot(tier, instruction->operand), location);
+        return;
+    }
+
+    int start = out->count;
+    for (int j = 0; j < instruction->length; j++)
+    {
+        emitByte(out, chunk->code[instruction->offset + j], location);
+    }
+    if (tier->temps == 0) return;
+
+    // Slots fit in a byte with the temporaries, so no operand widens.
+    bool wide = out->code[start] == OP_WIDE;
+    uint8_t* bytes = &out->code[wide ? start + 1 : start];
+    switch (instruction->op)
+    {
+        case OP_FOR_LOOP:
+            bytes[3] = shiftSlot(tier, bytes[3]);
+            bytes[1] = shiftSlot(tier, bytes[1]);
+            break;
+        case OP_ADD_LOCAL:
+        case OP_FOR_LOOP_CONSTANT:
+            bytes[1] = shiftSlot(tier, bytes[1]);
+            break;
+        case OP_CLOSURE:
+        {
+            int width = wide ? 2 : 1;
+            ObjFunction* function =
+                AS_FUNCTION(chunk->constants.values[instruction->operand]);
+            uint8_t* upvalue = bytes + 1 + width;
+            for (int i = 0; i < function->upvalueCount; i++)
+            {
+                if (upvalue[0])
+                {
+                    int slot = shiftSlot(tier, readOperand(upvalue + 1, wide));
+                    if (wide) upvalue[1] = (slot >> 8) & 0xff;
+                    upvalue[width] = slot & 0xff;
+                }
+                upvalue += 1 + width;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+// Emits code computing the value from the slots and constants it is
+// made of, and returns how many values it pushes at most.
+static int emitValue(Tier* tier, Emitter* out, int v, Location location)
+{
+    TierValue* value = &tier->values[v];
+    switch (value->op)
+    {
+        case VALUE_ENTRY:
+            emitOperand(out, OP_GET_LOCAL, shiftSlot(tier, value->operand),
+                        location);
+            return 1;
+        case OP_CONSTANT:
+            emitOperand(out, OP_CONSTANT, value->operand, location);
+            return 1;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            emitByte(out, value->op, location);
+            return 1;
+        default:
+        {
+            int peak = emitValue(tier, out, value->inputs[0], location);
+            if (value->inputs[1] != -1)
+            {
+                int second = 1 + emitValue(tier, out, value->inputs[1],
+                                           location);
+                if (second > peak) peak = second;
+            }
+            emitByte(out, value->op, location);
+            return peak;
+        }
+    }
+}
+
+// Computes the values hoisted out of the loop into their temporaries,
+// ahead of its header, where the stack is height high in the baseline
+// code. Returns how many there are.
+static int emitHoisted(Tier* tier, Emitter* out, int loop, int height,
+                       Location location)
+{
+    int count = 0;
+    for (int v = 0; v < tier->valueCount; v++)
+    {
+        TierValue* value = &tier->values[v];
+        if (!value->hoisted || value->uses == 0 || value->loop != loop)
+        {
+            continue;
+        }
+        int peak = emitValue(tier, out, v, location);
+        emitOperand(out, OP_SET_LOCAL, tempSlot(tier, v), location);
+        emitByte(out, OP_POP, location);
+        int slots = height + tier->temps + peak + 1;
+        if (slots > out->maxSlots) out->maxSlots = slots;
+        count++;
+    }
+    return count;
+}
+
+static void addSite(Emitter* out, InlineSite site)
+{
+    if (out->siteCapacity < out->siteCount + 1)
+    {
+        int oldCapacity = out->siteCapacity;
+        out->siteCapacity = GROW_CAPACITY(oldCapacity);
+        out->sites = GROW_ARRAY(InlineSite, out->sites,
+                                oldCapacity, out->siteCapacity);
+    }
+    out->sites[out->siteCount++] = site;
+}
+
+// Index of the value among the function's constants, adding it if it
+// isn't one yet.
+static int constantFor(Tier* tier, Value value)
+{
+    Chunk* chunk = &tier->function->chunk;
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        if (valuesIdentical(chunk->constants.values[i], value)) return i;
+    }
+    return addConstant(chunk, value);
+}
+
+// Decodes the callee into body if it can be copied into a caller: short
+// straight-line code that keeps to its own frame.
+static bool inlinable(ObjFunction* callee, Tier* body)
+{
+    initTier(body, callee);
+    if (callee->chunk.count > INLINE_MAX_BYTES) return false;
+    decode(body);
+
+    // Anything after the first return is dead, there being no jumps.
+    bool returns = false;
+    for (int i = 0; i < body->count && !returns && !body->failed; i++)
+    {
+        TierInstruction* instruction = &body->code[i];
+        switch (instruction->op)
+        {
+            case OP_CONSTANT:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_ADD_NUMBER:
+            case OP_SUBTRACT_NUMBER:
+            case OP_MULTIPLY_NUMBER:
+            case OP_DIVIDE_NUMBER:
+            case OP_NEGATE_NUMBER:
+            case OP_GREATER_NUMBER:
+            case OP_LESS_NUMBER:
+            case OP_PRINT:
+            case OP_POP:
+            case OP_DUP:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_ADD_LOCAL:
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+            case OP_ADD_PROPERTY:
+            case OP_INTRINSIC:
+            case OP_CALL:
+            case OP_TAIL_CALL:
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE:
+                break;
+            case OP_RETURN:
+                returns = true;
+                break;
+            default:
+                body->failed = true;
+                break;
+        }
+    }
+    return returns && !body->failed;
+}
+
+// Copies the callee's body up to its return, moved up the caller's frame
+// to base.
+static bool emitBody(Tier* tier, Emitter* out, Tier* body, int base)
+{
+    Chunk* chunk = &body->function->chunk;
+    for (int i = 0; i < body->count; i++)
+    {
+        TierInstruction* instruction = &body->code[i];
+        Location location = body->locations[instruction->offset];
+        switch (instruction->op)
+        {
+            case OP_CONSTANT:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE:
+            {
+                Value value = chunk->constants.values[instruction->operand];
+                int constant = constantFor(tier, value);
+                if (constant > UINT16_MAX) return false;
+                if (instruction->op == OP_CONSTANT ||
+                    instruction->op == OP_GET_GLOBAL ||
+                    instruction->op == OP_SET_GLOBAL ||
+                    instruction->op == OP_GET_PROPERTY ||
+                    instruction->op == OP_SET_PROPERTY)
+                {
+                    emitOperand(out, instruction->op, constant, location);
+                }
+                else
+                {
+                    // The caller's frame stays, so a tail call can't
+                    // reuse it.
+                    emitOperand(out, OP_INVOKE, constant, location);
+                    emitByte(out, instruction->argCount, location);
+                }
+                break;
+            }
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                emitOperand(out, instruction->op,
+                            base + instruction->operand, location);
+                break;
+            case OP_ADD_LOCAL:
+            case OP_ADD_PROPERTY:
+            {
+                // Both operands are single bytes.
+                uint8_t* bytes = &chunk->code[instruction->offset];
+                int first = instruction->op == OP_ADD_LOCAL
+                    ? base + bytes[1]
+                    : constantFor(tier, chunk->constants.values[bytes[1]]);
+                int step = constantFor(tier, chunk->constants.values[bytes[2]]);
+                if (first > UINT8_MAX || step > UINT8_MAX) return false;
+                emitByte(out, instruction->op, location);
+                emitByte(out, first, location);
+                emitByte(out, step, location);
+                break;
+            }
+            case OP_CALL:
+            case OP_TAIL_CALL:
+            {
+                // The copy is a call site of its own in the caller.
+                int site = addCallSite(&tier->function->chunk);
+                if (site > UINT16_MAX) return false;
+                emitOperand(out, OP_CALL, site, location);
+                emitByte(out, instruction->argCount, location);
+                break;
+            }
+            case OP_INTRINSIC:
+                for (int j = 0; j < instruction->length; j++)
+                {
+                    emitByte(out, chunk->code[instruction->offset + j],
+                             location);
+                }
+                break;
+            case OP_RETURN:
+                return true;
+            default:
+                emitByte(out, instruction->op, location);
+                break;
+        }
+    }
+    return true;
+}
+
+// Replaces a call whose callee is known by now with a copy of the
+// callee's body, behind a check that the callee is still that one.
+// origins holds the instruction that pushed each slot in the current
+// block, or -1.
+static bool inlineCall(Tier* tier, Emitter* out, TierInstruction* call,
+                       int* origins, int height, Location location)
+{
+    Chunk* chunk = &tier->function->chunk;
+    int argCount;
+    Value expected;
+    switch (call->op)
+    {
+        case OP_CALL:
+        {
+            // Only calls of a global function are followed.
+            argCount = call->argCount;
+            int slot = height - argCount - 1;
+            if (slot < 0 || origins[slot] == -1) return false;
+            TierInstruction* origin = &tier->code[origins[slot]];
+            if (origin->op != OP_GET_GLOBAL ||
+                origin->rewrite != REWRITE_KEEP) return false;
+            ObjString* name =
+                AS_STRING(chunk->constants.values[origin->operand]);
+            if (!tableGet(&vm.globals, name, &expected)) return false;
+            break;
+        }
+        case OP_INVOKE:
+        {
+            // Only methods that no other class defines differently.
+            argCount = call->argCount;
+            ObjString* name =
+                AS_STRING(chunk->constants.values[call->operand]);
+            if (name->selector == -1) return false;
+            expected = vm.selectorMethods[name->selector];
+            break;
+        }
+        default:
+            return false;
+    }
+
+    if (!IS_CLOSURE(expected)) return false;
+    ObjClosure* closure = AS_CLOSURE(expected);
+    ObjFunction* callee = closure->function;
+    int base = shiftSlot(tier, height - argCount - 1);
+    // A callee never called yet has no body to copy.
+    if (callee == tier->function || callee->lazy != NULL ||
+        closure->upvalueCount != 0 ||
+        callee->arity != argCount || base < 0 || base > UINT8_MAX)
+    {
+        return false;
+    }
+
+    Tier body;
+    int start = out->count;
+    bool copied = false;
+    if (inlinable(callee, &body))
+    {
+        int constant = constantFor(tier, expected);
+        copied = constant <= UINT16_MAX;
+        if (copied)
+        {
+            if (call->op == OP_INVOKE)
+            {
+                emitByte(out, OP_INLINE_INVOKE, location);
+                emitShort(out, call->operand, location);
+            }
+            else
+            {
+                emitByte(out, OP_INLINE_CALL, location);
+            }
+            emitByte(out, argCount, location);
+            emitShort(out, constant, location);
+            emitShort(out, 0, location);
+        }
+
+        InlineSite site;
+        site.start = out->count;
+        site.callee = callee;
+        site.location = location;
+        copied = copied && emitBody(tier, out, &body, base);
+        site.end = out->count;
+
+        if (copied)
+        {
+            emitByte(out, OP_INLINE_RETURN, location);
+            emitByte(out, base, location);
+            int skip = out->count - site.start;
+            out->code[site.start - 2] = (skip >> 8) & 0xff;
+            out->code[site.start - 1] = skip & 0xff;
+            addSite(out, site);
+            // The body's frame starts at base.
+            int slots = base + callee->maxSlots;
+            if (slots > out->maxSlots) out->maxSlots = slots;
+        }
+        else
+        {
+            out->count = start;
+        }
+    }
+    freeTier(&body);
+    return copied;
+}
+
+// The call instruction for the kind of callee the call site's cache
+// holds.
+static uint8_t specializedCall(CallCache* cache)
+{
+    if (cache->target == NULL) return OP_CALL;
+    switch (cache->type)
+    {
+        case OBJ_CLOSURE:      return OP_CALL_CLOSURE;
+        case OBJ_NATIVE:       return OP_CALL_NATIVE;
+        case OBJ_CLASS:        return OP_CALL_CLASS;
+        case OBJ_BOUND_METHOD: return OP_CALL_BOUND_METHOD;
+        default:               return OP_CALL;
+    }
+}
+
+static int fieldSlot(Tier* tier, int field)
+{
+    return tier->function->arity + 1 + tier->fieldTemp + field;
+}
+
+// Writes out the code from the scalar's call to where the instance is
+// gone twice. The first copy runs if the callee is still the class, and
+// keeps the fields in temporaries, with the class left in the instance's
+// local. The second is the code as it was, run after the OP_INLINE_CALL
+// has made the call.
+static void emitScalar(Tier* tier, Emitter* out, TierScalar* scalar,
+                       int height)
+{
+    TierInstruction* call = &tier->code[scalar->call];
+    Location location = tier->locations[call->offset];
+    emitByte(out, OP_INLINE_CALL, location);
+    emitByte(out, call->argCount, location);
+    emitShort(out, constantFor(tier, scalar->klass), location);
+    emitShort(out, 0, location);
+    int fast = out->count;
+
+    for (int i = 0; i < scalar->storeCount; i++)
+    {
+        TierStore* store = &scalar->stores[i];
+        switch (store->op)
+        {
+            case OP_GET_LOCAL:
+                emitOperand(out, OP_GET_LOCAL,
+                            shiftSlot(tier, scalar->slot + store->param),
+                            location);
+                break;
+            case OP_CONSTANT:
+                emitOperand(out, OP_CONSTANT,
+                            constantFor(tier, store->constant), location);
+                break;
+            default:
+                emitByte(out, store->op, location);
+                break;
+        }
+        emitOperand(out, OP_SET_LOCAL, fieldSlot(tier, store->field),
+                    location);
+        emitByte(out, OP_POP, location);
+    }
+    for (int i = 0; i < call->argCount; i++) emitByte(out, OP_POP, location);
+    int slots = height + tier->temps + 1;
+    if (slots > out->maxSlots) out->maxSlots = slots;
+
+    for (int i = scalar->call + 1; i <= scalar->end; i++)
+    {
+        TierInstruction* instruction = &tier->code[i];
+        Location at = tier->locations[instruction->offset];
+        instruction->newOffset = out->count;
+        if (instruction->rewrite == REWRITE_FIELD)
+        {
+            uint8_t op = instruction->op == OP_GET_PROPERTY ? OP_GET_LOCAL
+                                                            : OP_SET_LOCAL;
+            emitOperand(out, op, fieldSlot(tier, instruction->value), at);
+        }
+        else if (instruction->rewrite == REWRITE_SKIP)
+        {
+            continue;
+        }
+        else if (instruction->params != NOT_NUMBER)
+        {
+            emitByte(out, uncheckedOp(instruction->op), at);
+        }
+        else
+        {
+            copyInstruction(tier, out, instruction, at);
+        }
+    }
+    // The slow copy returns from the call to the byte after this jump, so
+    // it has the call's location.
+    emitByte(out, OP_JUMP, location);
+    emitShort(out, 0, location);
+    int jump = out->count;
+    int skip = out->count - fast;
+    out->code[fast - 2] = (skip >> 8) & 0xff;
+    out->code[fast - 1] = skip & 0xff;
+
+    for (int i = scalar->call + 1; i <= scalar->end; i++)
+    {
+        TierInstruction* instruction = &tier->code[i];
+        Location at = tier->locations[instruction->offset];
+        if (instruction->params != NOT_NUMBER)
+        {
+            emitByte(out, uncheckedOp(instruction->op), at);
+        }
+        else
+        {
+            copyInstruction(tier, out, instruction, at);
+        }
+    }
+    int over = out->count - jump;
+    out->code[jump - 2] = (over >> 8) & 0xff;
+    out->code[jump - 1] = over & 0xff;
+}
+
+// Writes the function's code out again, with unchecked arithmetic where
+// the instruction's params are set, the rewrites lift() chose, and, if
+// inlining, small callees copied in. heights holds the stack height at
+// each offset. Returns how many instructions changed, or -1 if a jump no
+// longer fits.
+static int emitCode(Tier* tier, Emitter* out, int* heights, bool inlining)
+{
+    Chunk* chunk = &tier->function->chunk;
+    // The instruction that pushed each slot in the current block, or -1.
+    int* origins = ALLOCATE(int, tier->maxSlots);
+    int changed = 0;
+
+    // The temporaries start out nil.
+    for (int i = 0; i < tier->temps; i++)
+    {
+        emitByte(out, OP_NIL, tier->locations[0]);
+    }
+    if (tier->temps > 0) out->maxSlots = tier->maxSlots + tier->temps;
+
+    for (int i = 0; i < tier->count; i++)
+    {
+        TierInstruction* instruction = &tier->code[i];
+        Location location = tier->locations[instruction->offset];
+        int height = heights[instruction->offset];
+        instruction->hoistOffset = out->count;
+        if (instruction->loop != -1)
+        {
+            changed += emitHoisted(tier, out, instruction->loop, height,
+                                   location);
+        }
+        instruction->newOffset = out->count;
+        if (tier->blockAt[i] != -1)
+        {
+            for (int j = 0; j < height; j++) origins[j] = -1;
+        }
+
+        if (instruction->scalar != -1)
+        {
+            // The rest of the instance's code is written out with its call.
+            TierScalar* scalar = &tier->scalars[instruction->scalar];
+            if (scalar->call != i) continue;
+            emitScalar(tier, out, scalar, height);
+            for (int j = scalar->slot; j < tier->maxSlots; j++) origins[j] = -1;
+            changed++;
+            continue;
+        }
+
+        bool done = true;
+        switch (instruction->rewrite)
+        {
+            case REWRITE_SKIP:
+                break;
+            case REWRITE_LOAD:
+                emitOperand(out, OP_GET_LOCAL,
+                            tempSlot(tier, instruction->value), location);
+                changed++;
+                break;
+            case REWRITE_REUSE:
+                emitByte(out, OP_REUSE_PROPERTY, location);
+                emitByte(out, tempSlot(tier, instruction->value), location);
+                emitShort(out, instruction->operand, location);
+                changed++;
+                break;
+            default:
+                done = false;
+                break;
+        }
+        if (done)
+        {
+            // Rewritten already.
+        }
+        else if (instruction->params != NOT_NUMBER)
+        {
+            emitByte(out, uncheckedOp(instruction->op), location);
+            done = true;
+            changed++;
+        }
+        else if (inlining && height != -1)
+        {
+            done = inlineCall(tier, out, instruction, origins, height, location);
+            if (done) changed++;
+        }
+
+        if (i + 1 < tier->count && tier->blockAt[i + 1] == -1)
+        {
+            int after = heights[tier->code[i + 1].offset];
+            if (after > 0) origins[after - 1] = i;
+        }
+
+        if (!done) copyInstruction(tier, out, instruction, location);
+        
+        // A call that has called one kind of callee so far expects it.
+        if (!done && instruction->op == OP_CALL)
+        {
+            uint8_t op = specializedCall(&chunk->calls[instruction->operand]);
+            if (op != OP_CALL)
+            {
+                bool wide = out->code[instruction->newOffset] == OP_WIDE;
+                out->code[instruction->newOffset + (wide ? 1 : 0)] = op;
+                changed++;
+            }
+        }
+
+        if (instruction->rewrite == REWRITE_SAVE)
+        {
+            emitOperand(out, OP_SET_LOCAL, tempSlot(tier, instruction->value),
+                        location);
+        }
+    }
+
+    // Jumps were copied as they were. Point them at the new offsets.
+    for (int i = 0; i < tier->count && changed != -1; i++)
+    {
+        TierInstruction* instruction = &tier->code[i];
+        if (!isJump(instruction->op)) continue;
+
+        // Entering a loop goes through the code hoisted out of it.
+        int from = instruction->newOffset + instruction->length;
+        int target = instructionAt(tier, instruction->operand);
+        int to = tier->code[target].newOffset;
+        int loop = tier->code[target].loop;
+        if (loop != -1 && (i < target || i > tier->loops[loop].end))
+        {
+            to = tier->code[target].hoistOffset;
+        }
+        int jump = instruction->op == OP_LOOP ? from - to : to - from;
+        uint8_t* code = &out->code[instruction->newOffset];
+        if (code[0] == OP_WIDE)
+        {
+            code[2] = (jump >> 24) & 0xff;
+            code[3] = (jump >> 16) & 0xff;
+            code[4] = (jump >> 8) & 0xff;
+            code[5] = jump & 0xff;
+        }
+        else if (jump > UINT16_MAX)
+        {
+            changed = -1;
+        }
+        else
+        {
+            code[1] = (jump >> 8) & 0xff;
+            code[2] = jump & 0xff;
+        }
+    }
+
+    FREE_ARRAY(int, origins, tier->maxSlots);
+    return changed;
+}
+
+static OptimizedCode* finishCode(Emitter* out)
+{
+    OptimizedCode* optimized = ALLOCATE(OptimizedCode, 1);
+    optimized->code = GROW_ARRAY(uint8_t, out->code, out->capacity, out->count);
+    optimized->lineSize = encodeLines(out->locations, out->count, NULL);
+    optimized->lines = ALLOCATE(uint8_t, optimized->lineSize);
+    encodeLines(out->locations, out->count, optimized->lines);
+    FREE_ARRAY(Location, out->locations, out->capacity);
+    optimized->count = out->count;
+    optimized->sites = GROW_ARRAY(InlineSite, out->sites,
+                                  out->siteCapacity, out->siteCount);
+    optimized->siteCount = out->siteCount;
+    initEmitter(out);
+    return optimized;
+}
+
+void tierUp(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    if (chunk->count == 0) return;
+
+    Tier tier;
+    initTier(&tier, function);
+    decode(&tier);
+    findBlocks(&tier);
+
+    // The checks whose parameters were numbers on every call are
+    // dropped, and only those parameters are checked on entry.
+    uint32_t assumed = 0;
+    for (int i = 0, j = 0; i < tier.count && j < function->checkCount; i++)
+    {
+        TypeCheck* check = &function->checks[j];
+        if (tier.code[i].offset != check->offset) continue;
+        if ((check->params & ~function->numberParams) == 0)
+        {
+            tier.code[i].params = check->params;
+            assumed |= check->params;
+        }
+        j++;
+    }
+
+    if (!tier.failed)
+    {
+        int* heights = ALLOCATE(int, chunk->count);
+        stackHeight(chunk, function->arity + 1, heights);
+        replaceScalars(&tier, heights);
+        lift(&tier, heights);
+        placeScalars(&tier);
+        Emitter out;
+        initEmitter(&out);
+        int changed = emitCode(&tier, &out, heights, true);
+        if (changed == -1)
+        {
+            // Inlining pushed a short jump out of range.
+            freeEmitter(&out);
+            changed = emitCode(&tier, &out, heights, false);
+        }
+        FREE_ARRAY(int, heights, chunk->count);
+
+        if (changed > 0)
+        {
+            if (out.maxSlots > function->maxSlots)
+            {
+                function->maxSlots = out.maxSlots;
+            }
+            function->numberParams = assumed;
+            function->optimized = finishCode(&out);
+        }
+        else
+        {
+            freeEmitter(&out);
+        }
+    }
+
+    freeTier(&tier);
+}
+
+void inferTypes(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    if (chunk->count == 0) return;
+
+    Tier tier;
+    initTier(&tier, function);
+    decode(&tier);
+    findBlocks(&tier);
+    if (!tier.failed) analyze(&tier);
+    if (!tier.failed) findChecks(&tier);
+
+    if (!tier.failed)
+    {
+        // The unchecked instructions are the same length, so the code
+        // keeps its layout.
+        int count = 0;
+        for (int i = 0; i < tier.count; i++)
+        {
+            TierInstruction* instruction = &tier.code[i];
+            if (instruction->params == 0)
+            {
+                chunk->code[instruction->offset] = uncheckedOp(instruction->op);
+            }
+            else if (instruction->params != NOT_NUMBER)
+            {
+                count++;
+            }
+        }
+
+        function->checks = ALLOCATE(TypeCheck, count);
+        function->checkCount = count;
+        for (int i = 0, j = 0; i < tier.count; i++)
+        {
+            TierInstruction* instruction = &tier.code[i];
+            if (instruction->params == 0 ||
+                instruction->params == NOT_NUMBER) continue;
+            function->checks[j].offset = instruction->offset;
+            function->checks[j].params = instruction->params;
+            j++;
+        }
+    }
+
+    freeTier(&tier);
+}
+
+void freeOptimizedCode(OptimizedCode* optimized)
+{
+    if (optimized == NULL) return;
+    FREE_ARRAY(uint8_t, optimized->code, optimized->count);
+    FREE_ARRAY(uint8_t, optimized->lines, optimized->lineSize);
+    FREE_ARRAY(InlineSite, optimized->sites, optimized->siteCount);
+    FREE_ARRAY(OptimizedCode, optimized, 1);
+}
+
+InlineSite* inlineSiteAt(OptimizedCode* optimized, int offset)
+{
+    for (int i = 0; i < optimized->siteCount; i++)
+    {
+        InlineSite* site = &optimized->sites[i];
+        if (offset >= site->start && offset < site->end) return site;
+    }
+    return NULL;
+}
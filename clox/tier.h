@@ -0,0 +1,65 @@
+#pragma once
+
+#include "object.h"
+
+// Calls after which a function is handed to the optimizing tier.
+#ifndef TIER_UP_CALLS
+#define TIER_UP_CALLS 1000
+#endif
+
+// Largest function, in bytes of bytecode, the tier inlines into a caller.
+#ifndef INLINE_MAX_BYTES
+#define INLINE_MAX_BYTES 32
+#endif
+
+// Most fields, and longest code in bytes, of an instance the tier keeps
+// in temporaries instead of making it.
+#ifndef SCALAR_MAX_FIELDS
+#define SCALAR_MAX_FIELDS 8
+#endif
+#ifndef SCALAR_MAX_BYTES
+#define SCALAR_MAX_BYTES 1024
+#endif
+
+// A callee's body copied into optimized code.
+typedef struct
+{
+    // Offsets of the body, not counting the OP_INLINE_RETURN that ends it.
+    int start;
+    int end;
+    ObjFunction* callee;
+    // Where the call site is.
+    Location location;
+} InlineSite;
+
+// An instruction whose type check the parameters decide: its operands
+// are numbers whenever the parameters in params, a bit each, are.
+struct TypeCheck
+{
+    int offset;
+    uint32_t params;
+};
+
+struct OptimizedCode
+{
+    uint8_t* code;
+    int count;
+    // Line table of the code, like a chunk's.
+    uint8_t* lines;
+    int lineSize;
+    InlineSite* sites;
+    int siteCount;
+};
+
+// Builds function->optimized from the function's bytecode, its checks
+// and the argument types seen while it warmed up, if that finds anything
+// to do.
+void tierUp(ObjFunction* function);
+// Works out the types in a newly compiled function. Swaps in the
+// unchecked instructions where the operands are numbers whatever it is
+// called with, and keeps in function->checks those that depend on what
+// the parameters are.
+void inferTypes(ObjFunction* function);
+void freeOptimizedCode(OptimizedCode* optimized);
+// The inlined body the instruction at offset belongs to, or NULL.
+InlineSite* inlineSiteAt(OptimizedCode* optimized, int offset);
@@ -39,20 +39,29 @@ void printValue(Value value)
           printf(AS_BOOL(value) ? "true" : "false");
           break;
         case VAL_NIL: printf("nil"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+        case VAL_NUMBER:
+        case VAL_INT: printf("%g", AS_NUMBER(value)); break;
         case VAL_OBJ: printObject(value); break;
     }
 }
 
+bool valuesIdentical(Value a, Value b)
+{
+    if (a.type != b.type) return false;
+    if (IS_NUMBER(a)) return memcmp(&a.as, &b.as, sizeof(a.as)) == 0;
+    return valuesEqual(a, b);
+}
+
 bool valuesEqual(Value a, Value b)
 {
+    if (IS_INT(a) && IS_INT(b)) return AS_INT(a) == AS_INT(b);
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
     if (a.type != b.type) return false;
 
     switch (a.type)
     {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:    return true;
-        case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
         default:
             return false; // Unreachable.
@@ -7,33 +7,90 @@ typedef enum
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
+    VAL_INT,
     VAL_OBJ
 } ValueType;
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef POINTER_COMPRESSION
+// All objects live in one reserved region of address space (the cage),
+// so a reference to one fits in a 32-bit offset from the cage base.
+// Offset 0 is never handed out and stands for NULL.
+extern uint8_t* heapCage;
+
+template <typename T>
+struct CompressedRef
+{
+    uint32_t offset;
+
+    operator T*() const
+    {
+        return offset == 0 ? NULL : (T*)(heapCage + offset);
+    }
+
+    template <typename U>
+    explicit operator U*() const
+    {
+        return (U*)(T*)*this;
+    }
+
+    T* operator->() const
+    {
+        return (T*)(heapCage + offset);
+    }
+
+    CompressedRef& operator=(T* object)
+    {
+        offset = object == NULL ? 0 : (uint32_t)((uint8_t*)object - heapCage);
+        return *this;
+    }
+};
+
+#define OBJ_REF(type) CompressedRef<type>
+#else
+#define OBJ_REF(type) type*
+#endif
+
 typedef struct
 {
     ValueType type;
     union {
         bool boolean;
         double number;
-        Obj* obj;
+        // Always holds an int32_t, but is written as a full word so that
+        // copying a Value right after creating one does not stall.
+        int64_t integer;
+        OBJ_REF(Obj) obj;
     } as;
 } Value;
 
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
-#define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+// A number is either a double or, while it is a small integer, a VAL_INT.
+// The two representations are interchangeable: AS_NUMBER reads either.
+#define IS_NUMBER(value)  ((value).type == VAL_NUMBER || (value).type == VAL_INT)
+#define IS_INT(value)     ((value).type == VAL_INT)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 #define AS_BOOL(value)    ((value).as.boolean)
-#define AS_NUMBER(value)  ((value).as.number)
-#define AS_OBJ(value)     ((value).as.obj)
+#define AS_NUMBER(value)  \
+    ((value).type == VAL_INT ? (double)(value).as.integer : (value).as.number)
+#define AS_INT(value)     ((value).as.integer)
+#define AS_OBJ(value)     ((Obj*)(value).as.obj)
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
-#define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define INT_VAL(value)    ((Value){VAL_INT, {.integer = (int64_t)(value)}})
+#define OBJ_VAL(object)   objVal((Obj*)object)
+
+static inline Value objVal(Obj* object)
+{
+    Value value;
+    value.type = VAL_OBJ;
+    value.as.obj = object;
+    return value;
+}
 
 
 typedef struct
@@ -48,3 +105,84 @@ void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
 bool valuesEqual(Value a, Value b);
+// Like valuesEqual, but tells apart the constants 1 and 1.0, or 0 and -0,
+// which print differently.
+bool valuesIdentical(Value a, Value b);
+
+// Number operators. Integer operands stay integers only when the result
+// is exactly what the double operation gives, so overflow, fractions and
+// negative zero all fall back to doubles. The type tests use a plain '&'
+// so both operands are checked with a single branch.
+static inline Value addNumbers(Value a, Value b)
+{
+    int32_t result;
+    if ((IS_INT(a) & IS_INT(b)) &&
+        !__builtin_add_overflow(AS_INT(a), AS_INT(b), &result))
+    {
+        return INT_VAL(result);
+    }
+    return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value subtractNumbers(Value a, Value b)
+{
+    int32_t result;
+    if ((IS_INT(a) & IS_INT(b)) &&
+        !__builtin_sub_overflow(AS_INT(a), AS_INT(b), &result))
+    {
+        return INT_VAL(result);
+    }
+    return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+static inline Value multiplyNumbers(Value a, Value b)
+{
+    int32_t result;
+    if ((IS_INT(a) & IS_INT(b)) &&
+        !__builtin_mul_overflow(AS_INT(a), AS_INT(b), &result) &&
+        (result != 0 || (AS_INT(a) >= 0 && AS_INT(b) >= 0)))
+    {
+        return INT_VAL(result);
+    }
+    return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+static inline Value divideNumbers(Value a, Value b)
+{
+    if (IS_INT(a) & IS_INT(b))
+    {
+        int32_t x = AS_INT(a);
+        int32_t y = AS_INT(b);
+        if (y > 0 || (y < 0 && x != 0 && x != INT32_MIN))
+        {
+            if (x % y == 0) return INT_VAL(x / y);
+        }
+    }
+    return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+static inline Value negateNumber(Value a)
+{
+    if (IS_INT(a) && AS_INT(a) != 0 && AS_INT(a) != INT32_MIN)
+    {
+        return INT_VAL(-AS_INT(a));
+    }
+    return NUMBER_VAL(-AS_NUMBER(a));
+}
+
+static inline Value lessNumbers(Value a, Value b)
+{
+    if (IS_INT(a) & IS_INT(b)) return BOOL_VAL(AS_INT(a) < AS_INT(b));
+    return BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b));
+}
+
+static inline Value greaterNumbers(Value a, Value b)
+{
+    if (IS_INT(a) & IS_INT(b)) return BOOL_VAL(AS_INT(a) > AS_INT(b));
+    return BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b));
+}
+
+static inline bool isFalsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
@@ -1,7 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
 
 #include "common.h"
 #include "debug.h"
@@ -9,17 +11,53 @@
 #include "vm.h"
 #include "object.h"
 #include "memory.h"
+#include "tier.h"
 
 
 VM vm;
 
 
+#define STACK_MIN 1024
+#define FRAMES_MIN 64
+
+static void closeUpvalues(Value* last);
+
 static void resetStack()
 {
+    closeUpvalues(vm.stack);
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
 }
 
+// The optimized code ip points into, or NULL if it is in the baseline
+// code.
+static OptimizedCode* optimizedFor(ObjFunction* function, uint8_t* ip)
+{
+    OptimizedCode* candidates[] = {function->optimized, function->retired};
+    for (int i = 0; i < 2; i++)
+    {
+        OptimizedCode* code = candidates[i];
+        if (code != NULL && ip >= code->code && ip <= code->code + code->count)
+        {
+            return code;
+        }
+    }
+    return NULL;
+}
+
+static void printFrameLine(ObjFunction* function, Location location)
+{
+    fprintf(stderr, "[line %d:%d] in ", location.line, location.column);
+    if (function->name == NULL)
+    {
+        fprintf(stderr, "script\n");
+    }
+    else
+    {
+        fprintf(stderr, "%s()\n", function->name->chars);
+    }
+}
+
 static void runtimeError(const char* format, ...)
 {
     va_list args;
@@ -32,18 +70,31 @@ static void runtimeError(const char* format, ...)
     {
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
-        // -1 because the IP is sitting on the next instruction to be
-        // executed.
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ",
-                function->chunk.lines[instruction]);
-        if (function->name == NULL)
+        OptimizedCode* optimized = optimizedFor(function, frame->ip);
+        if (optimized == NULL)
         {
-            fprintf(stderr, "script\n");
+            // -1 because the IP is sitting on the next instruction to be
+            // executed.
+            size_t instruction = frame->ip - function->chunk.code - 1;
+            printFrameLine(function,
+                           chunkLocation(&function->chunk, (int)instruction));
+            continue;
+        }
+
+        // Code inlined from a callee reports the callee's frame as
+        // well, as if it had been called.
+        int instruction = (int)(frame->ip - optimized->code - 1);
+        Location location = decodeLine(optimized->lines, optimized->lineSize,
+                                       instruction);
+        InlineSite* site = inlineSiteAt(optimized, instruction);
+        if (site != NULL)
+        {
+            printFrameLine(site->callee, location);
+            printFrameLine(function, site->location);
         }
         else
         {
-            fprintf(stderr, "%s()\n", function->name->chars);
+            printFrameLine(function, location);
         }
     }
 
@@ -64,29 +115,176 @@ static void defineNative(const char* name, NativeFn function)
     pop();
 }
 
+typedef struct
+{
+    const char* name;
+    // -1 for one or more arguments.
+    int arity;
+} IntrinsicInfo;
+
+// In the order of the Intrinsic enum.
+static const IntrinsicInfo intrinsics[] = {
+    {"abs",   1},
+    {"ceil",  1},
+    {"floor", 1},
+    {"sqrt",  1},
+    {"exp",   1},
+    {"log",   1},
+    {"sin",   1},
+    {"cos",   1},
+    {"tan",   1},
+    {"atan",  1},
+    {"atan2", 2},
+    {"min",  -1},
+    {"max",  -1},
+    {"pow",   2},
+};
+static_assert(sizeof(intrinsics) / sizeof(intrinsics[0]) == INTRINSIC_COUNT,
+              "Every intrinsic needs an entry.");
+
+static void defineIntrinsics()
+{
+    for (int i = 0; i < INTRINSIC_COUNT; i++)
+    {
+        const char* name = intrinsics[i].name;
+        ObjString* string = copyString(name, (int)strlen(name));
+        string->intrinsic = i;
+        vm.intrinsicNames[i] = string;
+        vm.intrinsicRebound[i] = false;
+        
+        ObjNative* native = newNative(NULL);
+        native->intrinsic = i;
+        push(OBJ_VAL(native));
+        tableSet(&vm.globals, string, OBJ_VAL(native));
+        pop();
+    }
+}
+
+int findIntrinsic(const char* name, int length)
+{
+    for (int i = 0; i < INTRINSIC_COUNT; i++)
+    {
+        if ((int)strlen(intrinsics[i].name) == length &&
+            memcmp(intrinsics[i].name, name, length) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Moves the stack to a larger array with room for at least `slots` more
+// values above stackTop, rebasing every pointer into it.
+static void growStack(int slots)
+{
+    int count = (int)(vm.stackTop - vm.stack);
+    int oldCapacity = vm.stackCapacity;
+    int capacity = oldCapacity < STACK_MIN ? STACK_MIN : oldCapacity;
+    while (capacity < count + slots) capacity *= 2;
+    
+    Value* oldStack = vm.stack;
+    Value* stack = ALLOCATE(Value, capacity);
+    if (count > 0) memcpy(stack, oldStack, sizeof(Value) * count);
+    for (int i = 0; i < vm.frameCount; i++)
+    {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - oldStack);
+    }
+    for (int i = 0; i < vm.openUpvalueCount; i++)
+    {
+        ObjUpvalue* upvalue = vm.openUpvalues[i];
+        upvalue->location = stack + (upvalue->location - oldStack);
+    }
+    vm.stack = stack;
+    vm.stackTop = stack + count;
+    vm.stackCapacity = capacity;
+    FREE_ARRAY(Value, oldStack, oldCapacity);
+    
+    vm.openUpvalues = GROW_ARRAY(ObjUpvalue*, vm.openUpvalues,
+                                 oldCapacity, capacity);
+    vm.openUpvalueSlots = GROW_ARRAY(int, vm.openUpvalueSlots,
+                                     oldCapacity, capacity);
+    for (int i = oldCapacity; i < capacity; i++)
+    {
+        vm.openUpvalueSlots[i] = 0;
+    }
+}
+
+static inline void reserveStack(int slots)
+{
+    if (vm.stackTop + slots > vm.stack + vm.stackCapacity) growStack(slots);
+}
+
 void initVM()
 {
-    resetStack();
+    vm.stack = NULL;
+    vm.stackTop = NULL;
+    vm.stackCapacity = 0;
+    vm.frames = NULL;
+    vm.frameCapacity = 0;
+    vm.maxFrames = FRAMES_MAX;
+    vm.frameCount = 0;
+    vm.openUpvalues = NULL;
+    vm.openUpvalueSlots = NULL;
+    vm.openUpvalueCount = 0;
     initTable(&vm.strings);
     initTable(&vm.globals);
-    defineNative("clock", clockNative);
-    vm.objects = NULL;
-    vm.openUpvalues = NULL;
+    initTable(&vm.constants);
+    initTable(&vm.globalNames);
+    initArena(&vm.codeArena);
+    initCodeSpace(&vm.codeSpace);
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+    {
+        vm.pages[i] = NULL;
+        vm.freeSlots[i] = NULL;
+    }
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
     vm.initString = NULL;
+    vm.selectors = NULL;
+    vm.selectorMethods = NULL;
+    vm.selectorCount = 0;
+    vm.selectorCapacity = 0;
+    vm.compileError = false;
+    for (int i = 0; i < INTRINSIC_COUNT; i++) vm.intrinsicNames[i] = NULL;
+    reserveStack(STACK_MIN);
+    vm.frameCapacity = FRAMES_MIN < FRAMES_MAX ? FRAMES_MIN : FRAMES_MAX;
+    vm.frames = GROW_ARRAY(CallFrame, vm.frames, 0, vm.frameCapacity);
+    resetStack();
     vm.initString = copyString("init", 4);
+    defineNative("clock", clockNative);
+    defineIntrinsics();
 }
 
 void freeVM()
 {
     freeTable(&vm.strings);
     freeTable(&vm.globals);
+    freeTable(&vm.constants);
+    freeTable(&vm.globalNames);
+    freeArena(&vm.codeArena);
+    FREE_ARRAY(ObjString*, vm.selectors, vm.selectorCapacity);
+    FREE_ARRAY(Value, vm.selectorMethods, vm.selectorCapacity);
+    FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+    FREE_ARRAY(ObjUpvalue*, vm.openUpvalues, vm.stackCapacity);
+    FREE_ARRAY(int, vm.openUpvalueSlots, vm.stackCapacity);
+    FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
     freeObjects();
+    freeCodeSpace(&vm.codeSpace);
     vm.initString = NULL;
+    vm.selectors = NULL;
+    vm.selectorMethods = NULL;
+    vm.selectorCount = 0;
+    vm.selectorCapacity = 0;
+    vm.stack = NULL;
+    vm.stackTop = NULL;
+    vm.stackCapacity = 0;
+    vm.frames = NULL;
+    vm.frameCapacity = 0;
+    vm.openUpvalues = NULL;
+    vm.openUpvalueSlots = NULL;
 }
 
 void push(Value value)
@@ -101,14 +299,29 @@ Value pop()
     return *vm.stackTop;
 }
 
-static Value peek(int distance)
+int methodSelector(ObjString* name)
 {
-    return vm.stackTop[-1 - distance];
+    if (name->selector != -1) return name->selector;
+    
+    if (vm.selectorCapacity < vm.selectorCount + 1)
+    {
+        int oldCapacity = vm.selectorCapacity;
+        vm.selectorCapacity = GROW_CAPACITY(oldCapacity);
+        vm.selectors = GROW_ARRAY(ObjString*, vm.selectors,
+                                  oldCapacity, vm.selectorCapacity);
+        vm.selectorMethods = GROW_ARRAY(Value, vm.selectorMethods,
+                                        oldCapacity, vm.selectorCapacity);
+    }
+    
+    name->selector = vm.selectorCount;
+    vm.selectorMethods[vm.selectorCount] = NIL_VAL;
+    vm.selectors[vm.selectorCount++] = name;
+    return name->selector;
 }
 
-static bool isFalsey(Value value)
+static Value peek(int distance)
 {
-    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+    return vm.stackTop[-1 - distance];
 }
 
 static void concatenate()
@@ -128,28 +341,205 @@ static void concatenate()
     push(OBJ_VAL(result));
 }
 
-static bool call(ObjClosure* closure, int argCount)
+// The frame array only grows up to vm.maxFrames, so the depth limit is
+// checked here rather than on every call.
+static bool growFrames()
 {
-    if (argCount != closure->function->arity)
+    if (vm.frameCount >= vm.maxFrames)
     {
-        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+        runtimeError("Stack overflow.");
         return false;
     }
     
-    if (vm.frameCount == FRAMES_MAX)
+    int oldCapacity = vm.frameCapacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    if (capacity > vm.maxFrames) capacity = vm.maxFrames;
+    vm.frames = GROW_ARRAY(CallFrame, vm.frames, oldCapacity, capacity);
+    vm.frameCapacity = capacity;
+    return true;
+}
+
+static void profileCall(ObjFunction* function, Value* args)
+{
+    for (int i = 0; i < function->arity && i < 32; i++)
     {
-        runtimeError("Stack overflow.");
-        return false;
+        if (!IS_NUMBER(args[i])) function->numberParams &= ~(1u << i);
     }
+    if (++function->hotness == TIER_UP_CALLS) tierUp(function);
+}
+
+// Picks the code a call with these arguments runs. Optimized code is
+// only entered when the parameters it assumes are numbers are. If they
+// aren't, the function goes back to its baseline code for good.
+static inline uint8_t* entryCode(ObjFunction* function, Value* args)
+{
+    if (function->optimized != NULL)
+    {
+        uint32_t numbers = function->numberParams;
+        for (int i = 0; numbers != 0; i++, numbers >>= 1)
+        {
+            if ((numbers & 1) && !IS_NUMBER(args[i]))
+            {
+                function->retired = function->optimized;
+                function->optimized = NULL;
+                return function->chunk.code;
+            }
+        }
+        return function->optimized->code;
+    }
+    if (function->hotness < TIER_UP_CALLS) profileCall(function, args);
+    return function->chunk.code;
+}
+
+// Compiles the body of a function called for the first time. The errors
+// in it stop the script, once the compiler has reported them.
+static bool compileBody(ObjFunction* function)
+{
+    if (compileFunction(function)) return true;
+    resetStack();
+    vm.compileError = true;
+    return false;
+}
+
+// Pushes the frame of a call whose callee is compiled and takes
+// argCount arguments.
+static inline bool pushFrame(ObjClosure* closure, int argCount)
+{
+    // A frame never uses more than maxSlots slots, and its first slot
+    // is below stackTop. Growing the frame array invalidates the caller's
+    // frame pointer, so callers reload it after every call. The slots are
+    // reserved once the code is picked, since tiering up can make the
+    // frame larger.
+    if (vm.frameCount == vm.frameCapacity && !growFrames()) return false;
+    uint8_t* ip = entryCode(closure->function, vm.stackTop - argCount);
+    reserveStack(closure->function->maxSlots);
     
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    frame->ip = ip;
 
     frame->slots = vm.stackTop - argCount - 1;
     return true;
 }
 
+static inline bool call(ObjClosure* closure, int argCount)
+{
+    if (closure->function->lazy != NULL && !compileBody(closure->function))
+    {
+        return false;
+    }
+    if (argCount != closure->function->arity)
+    {
+        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+        return false;
+    }
+    return pushFrame(closure, argCount);
+}
+
+static bool callClass(ObjClass* klass, int argCount)
+{
+    vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+    if (klass->initializer != NULL)
+    {
+        return call(klass->initializer, argCount);
+    }
+    else if (argCount != 0)
+    {
+        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return false;
+    }
+    return true;
+}
+
+static bool callBoundMethod(ObjBoundMethod* bound, int argCount)
+{
+    vm.stackTop[-argCount - 1] = bound->receiver;
+    return call(bound->method, argCount);
+}
+
+// Does the math of an intrinsic. Integers stay integers where the
+// result is one of the arguments.
+static bool runIntrinsic(int intrinsic, int argCount, Value* args,
+                         Value* result)
+{
+    int arity = intrinsics[intrinsic].arity;
+    if (arity == -1 && argCount == 0)
+    {
+        runtimeError("Expected at least 1 argument but got 0.");
+        return false;
+    }
+    if (arity != -1 && argCount != arity)
+    {
+        runtimeError("Expected %d arguments but got %d.", arity, argCount);
+        return false;
+    }
+    for (int i = 0; i < argCount; i++)
+    {
+        if (!IS_NUMBER(args[i]))
+        {
+            runtimeError("Arguments must be numbers.");
+            return false;
+        }
+    }
+    
+    Value a = args[0];
+    Value b = argCount > 1 ? args[1] : a;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (intrinsic)
+    {
+        case INTRINSIC_ABS:   *result = x < 0 ? negateNumber(a) : a; break;
+        case INTRINSIC_CEIL:  *result = IS_INT(a) ? a : NUMBER_VAL(ceil(x)); break;
+        case INTRINSIC_FLOOR: *result = IS_INT(a) ? a : NUMBER_VAL(floor(x)); break;
+        case INTRINSIC_SQRT:  *result = NUMBER_VAL(sqrt(x)); break;
+        case INTRINSIC_EXP:   *result = NUMBER_VAL(exp(x)); break;
+        case INTRINSIC_LOG:   *result = NUMBER_VAL(log(x)); break;
+        case INTRINSIC_SIN:   *result = NUMBER_VAL(sin(x)); break;
+        case INTRINSIC_COS:   *result = NUMBER_VAL(cos(x)); break;
+        case INTRINSIC_TAN:   *result = NUMBER_VAL(tan(x)); break;
+        case INTRINSIC_ATAN:  *result = NUMBER_VAL(atan(x)); break;
+        case INTRINSIC_ATAN2: *result = NUMBER_VAL(atan2(x, y)); break;
+        case INTRINSIC_MIN:
+        case INTRINSIC_MAX:
+        {
+            // The first of the equal arguments wins, as with two.
+            *result = a;
+            for (int i = 1; i < argCount; i++)
+            {
+                double value = AS_NUMBER(args[i]);
+                if (intrinsic == INTRINSIC_MIN ? value < AS_NUMBER(*result)
+                                               : value > AS_NUMBER(*result))
+                {
+                    *result = args[i];
+                }
+            }
+            break;
+        }
+        case INTRINSIC_POW:   *result = NUMBER_VAL(pow(x, y)); break;
+    }
+    return true;
+}
+
+static bool callNative(ObjNative* native, int argCount)
+{
+    Value* args = vm.stackTop - argCount;
+    Value result;
+    if (native->intrinsic != -1)
+    {
+        if (!runIntrinsic(native->intrinsic, argCount, args, &result))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        result = native->function(argCount, args);
+    }
+    vm.stackTop -= argCount + 1;
+    push(result);
+    return true;
+}
+
 static bool callValue(Value callee, int argCount)
 {
     
@@ -160,35 +550,11 @@ static bool callValue(Value callee, int argCount)
             case OBJ_CLOSURE:
                 return call(AS_CLOSURE(callee), argCount);
             case OBJ_CLASS:
-            {
-                ObjClass* klass = AS_CLASS(callee);
-                vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
-                Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer))
-                {
-                    return call(AS_CLOSURE(initializer), argCount);
-                }
-                else if (argCount != 0)
-                {
-                    runtimeError("Expected 0 arguments but got %d.", argCount);
-                    return false;
-                }
-                return true;
-            }
+                return callClass(AS_CLASS(callee), argCount);
             case OBJ_BOUND_METHOD:
-            {
-                ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-                vm.stackTop[-argCount - 1] = bound->receiver;
-                return call(bound->method, argCount);
-            }
+                return callBoundMethod(AS_BOUND_METHOD(callee), argCount);
             case OBJ_NATIVE:
-            {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
-                return true;
-            }
+                return callNative(AS_NATIVE(callee), argCount);
             default:
                 // Non-callable object type.
                 break;
@@ -201,65 +567,260 @@ static bool callValue(Value callee, int argCount)
 
 static ObjUpvalue* captureUpvalue(Value* local)
 {
-    ObjUpvalue* prevUpvalue = NULL;
-    ObjUpvalue* upvalue = vm.openUpvalues;
+    int slot = (int)(local - vm.stack);
+    if (vm.openUpvalueSlots[slot] != 0)
+    {
+        return vm.openUpvalues[vm.openUpvalueSlots[slot] - 1];
+    }
+
+    ObjUpvalue* createdUpvalue = newUpvalue(local);
+    vm.openUpvalues[vm.openUpvalueCount++] = createdUpvalue;
+    vm.openUpvalueSlots[slot] = vm.openUpvalueCount;
+    return createdUpvalue;
+}
+
+static void closeUpvalue(int index)
+{
+    ObjUpvalue* upvalue = vm.openUpvalues[index];
+    vm.openUpvalueSlots[upvalue->location - vm.stack] = 0;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
 
-    while (upvalue != NULL && upvalue->location > local)
+    // Fill the hole with the last one, which belongs to the same frame.
+    ObjUpvalue* last = vm.openUpvalues[--vm.openUpvalueCount];
+    if (index != vm.openUpvalueCount)
     {
-        prevUpvalue = upvalue;
-        upvalue = upvalue->next;
+        vm.openUpvalues[index] = last;
+        vm.openUpvalueSlots[last->location - vm.stack] = index + 1;
     }
+}
+
+static void closeUpvalues(Value* last)
+{
+    while (vm.openUpvalueCount > 0 &&
+           vm.openUpvalues[vm.openUpvalueCount - 1]->location >= last)
+    {
+        closeUpvalue(vm.openUpvalueCount - 1);
+    }
+}
 
-    if (upvalue != NULL && upvalue->location == local)
+// Like pushFrame, for a call from tail position, which reuses the
+// running frame: the callee and its arguments slide down over the
+// caller's slots.
+static inline bool reuseFrame(ObjClosure* closure, int argCount)
+{
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    closeUpvalues(frame->slots);
+    memmove(frame->slots, vm.stackTop - argCount - 1,
+            sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+    uint8_t* ip = entryCode(closure->function, frame->slots + 1);
+    reserveStack(closure->function->maxSlots);
+    frame->closure = closure;
+    frame->ip = ip;
+    return true;
+}
+
+static bool tailCall(ObjClosure* closure, int argCount)
+{
+    if (closure->function->lazy != NULL && !compileBody(closure->function))
     {
-        return upvalue;
+        return false;
+    }
+    if (argCount != closure->function->arity)
+    {
+        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+        return false;
+    }
+    return reuseFrame(closure, argCount);
+}
+
+static bool tailCallValue(Value callee, int argCount)
+{
+    if (IS_CLOSURE(callee))
+    {
+        return tailCall(AS_CLOSURE(callee), argCount);
+    }
+    if (IS_BOUND_METHOD(callee))
+    {
+        ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+        vm.stackTop[-argCount - 1] = bound->receiver;
+        return tailCall(bound->method, argCount);
+    }
+    // Classes and natives are called normally and the OP_RETURN that
+    // follows returns their result.
+    return callValue(callee, argCount);
+}
+
+// Makes the call from site in chunk. The callee the site called last
+// goes straight to frame setup, since that call compiled it and checked
+// its arity. Any other callee is cached and called in full. The cache
+// keeps it from the collector while the call replaces it on the stack,
+// and is emptied again if the call fails. It is found again after the
+// call, which can grow chunk's caches by tiering up.
+static inline bool callSite(Chunk* chunk, int site, int argCount, bool tail)
+{
+    Value callee = peek(argCount);
+    CallCache* cache = &chunk->calls[site];
+    if (IS_OBJ(callee) && AS_OBJ(callee) == (Obj*)cache->target)
+    {
+        // The closure the callee runs.
+        ObjClosure* closure;
+        switch (cache->type)
+        {
+            case OBJ_CLOSURE:
+                closure = AS_CLOSURE(callee);
+                break;
+            case OBJ_BOUND_METHOD:
+            {
+                ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+                vm.stackTop[-argCount - 1] = bound->receiver;
+                closure = bound->method;
+                break;
+            }
+            case OBJ_CLASS:
+            {
+                ObjClass* klass = AS_CLASS(callee);
+                vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+                if (klass->initializer == NULL) return true;
+                // The initializer returns the instance, so it can take
+                // over the frame of a tail call as well.
+                closure = klass->initializer;
+                break;
+            }
+            default:
+                return callNative(AS_NATIVE(callee), argCount);
+        }
+        return tail ? reuseFrame(closure, argCount)
+                    : pushFrame(closure, argCount);
     }
     
-    ObjUpvalue* createdUpvalue = newUpvalue(local);
+    // Only objects are called without an error.
+    if (IS_OBJ(callee))
+    {
+        cache->type = OBJ_TYPE(callee);
+        cache->target = AS_OBJ(callee);
+    }
+    bool called = tail ? tailCallValue(callee, argCount)
+                       : callValue(callee, argCount);
+    if (!called)
+    {
+        cache = &chunk->calls[site];
+        cache->type = 0;
+        cache->target = NULL;
+    }
+    return called;
+}
+
+static inline ObjClosure* findMethod(ObjClass* klass, ObjString* name)
+{
+    // Names never declared as methods have selector -1, which the
+    // unsigned compare rejects along with selectors outside the vtable.
+    unsigned index = (unsigned)(name->selector - klass->vtableBase);
+    if (index < (unsigned)klass->vtableCount) return klass->vtable[index];
+    if (klass->methods.count == 0) return NULL;
     
-    createdUpvalue->next = upvalue;
+    Value method;
+    if (!tableGet(&klass->methods, name, &method)) return NULL;
+    return AS_CLOSURE(method);
+}
+
+// A vtable is kept while it has at most this many slots for each method
+// in it, or this many slots in all.
+#define VTABLE_SLOTS_PER_METHOD 4
+#define VTABLE_MIN_SLOTS 8
 
-    if (prevUpvalue == NULL)
+// Moves the class's vtable to span selectors base up to end.
+static void resizeVtable(ObjClass* klass, int base, int end)
+{
+    int count = end - base;
+    OBJ_REF(ObjClosure)* vtable = ALLOCATE(OBJ_REF(ObjClosure), count);
+    for (int i = 0; i < count; i++) vtable[i] = NULL;
+    for (int i = 0; i < klass->vtableCount; i++)
     {
-        vm.openUpvalues = createdUpvalue;
+        vtable[klass->vtableBase - base + i] = klass->vtable[i];
     }
-    else
+    FREE_ARRAY(OBJ_REF(ObjClosure), klass->vtable, klass->vtableCount);
+    klass->vtable = vtable;
+    klass->vtableBase = base;
+    klass->vtableCount = count;
+}
+
+// Puts every method of the vtable in the class's table and drops it.
+static void vtableToTable(ObjClass* klass)
+{
+    for (int i = 0; i < klass->vtableCount; i++)
     {
-        prevUpvalue->next = createdUpvalue;
+        ObjClosure* method = klass->vtable[i];
+        if (method == NULL) continue;
+        ObjString* name = vm.selectors[klass->vtableBase + i];
+        tableSet(&klass->methods, name, OBJ_VAL(method));
     }
-    
-    return createdUpvalue;
+    FREE_ARRAY(OBJ_REF(ObjClosure), klass->vtable, klass->vtableCount);
+    klass->vtable = NULL;
+    klass->vtableBase = 0;
+    klass->vtableCount = 0;
 }
 
-static void closeUpvalues(Value* last)
+// Stores method in the class, widening the vtable to its selector while
+// that keeps the vtable dense enough. The class and method must be
+// reachable, since this allocates.
+static void putMethod(ObjClass* klass, ObjString* name, ObjClosure* method)
 {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last)
+    if (klass->methods.count == 0)
     {
-        ObjUpvalue* upvalue = vm.openUpvalues;
-        upvalue->closed = *upvalue->location;
-        upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        int selector = name->selector;
+        int base = selector;
+        int end = selector + 1;
+        if (klass->vtableCount > 0)
+        {
+            int oldEnd = klass->vtableBase + klass->vtableCount;
+            if (klass->vtableBase < base) base = klass->vtableBase;
+            if (oldEnd > end) end = oldEnd;
+        }
+        int methods = klass->methodCount + (findMethod(klass, name) == NULL);
+        if (end - base <= VTABLE_MIN_SLOTS ||
+            end - base <= VTABLE_SLOTS_PER_METHOD * methods)
+        {
+            if (end - base != klass->vtableCount) resizeVtable(klass, base, end);
+            klass->vtable[selector - base] = method;
+            klass->methodCount = methods;
+            return;
+        }
+        vtableToTable(klass);
     }
+    tableSet(&klass->methods, name, OBJ_VAL(method));
 }
 
 static void defineMethod(ObjString* name)
 {
-    Value method = peek(0);
+    ObjClosure* method = AS_CLOSURE(peek(0));
     ObjClass* klass = AS_CLASS(peek(1));
-    tableSet(&klass->methods, name, method);
+    putMethod(klass, name, method);
+    if (name == vm.initString) klass->initializer = method;
+
+    Value* sole = &vm.selectorMethods[name->selector];
+    if (IS_NIL(*sole))
+    {
+        *sole = OBJ_VAL(method);
+    }
+    else if (!IS_OBJ(*sole) || AS_OBJ(*sole) != (Obj*)method)
+    {
+        *sole = BOOL_VAL(false);
+    }
     pop();
 }
 
 static bool bindMethod(ObjClass* klass, ObjString* name)
 {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method))
+    ObjClosure* method = findMethod(klass, name);
+    if (method == NULL)
     {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
 
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjBoundMethod* bound = newBoundMethod(peek(0), method);
     pop();
     push(OBJ_VAL(bound));
     return true;
@@ -267,14 +828,14 @@ static bool bindMethod(ObjClass* klass, ObjString* name)
 
 static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount)
 {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method))
+    ObjClosure* method = findMethod(klass, name);
+    if (method == NULL)
     {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
 
-    return call(AS_CLOSURE(method), argCount);
+    return call(method, argCount);
 }
 
 static bool invoke(ObjString* name, int argCount)
@@ -295,26 +856,95 @@ static bool invoke(ObjString* name, int argCount)
     return invokeFromClass(instance->klass, name, argCount);
 }
 
+#ifdef DEBUG_VERIFY_ENCLOSING
+// Whether function declares the local closure, whose OP_LOCAL_CLOSURE
+// loads it from function's constants.
+static bool declaresClosure(ObjFunction* function, ObjClosure* closure)
+{
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++)
+    {
+        Value constant = constants->values[i];
+        if (IS_OBJ(constant) && AS_OBJ(constant) == (Obj*)closure) return true;
+    }
+    return false;
+}
+#endif
+
 static InterpretResult run()
 {
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    // The running frame's ip is kept in a local and only written back
+    // before something that may push a frame or report an error.
+    uint8_t* ip = frame->ip;
+    // Operand of the current instruction, read by its case or by the
+    // OP_WIDE case, which then jumps to the label after the read. wide
+    // tells OP_CLOSURE that its upvalue indexes are two bytes as well.
+    int operand;
+    bool wide;
     
-#define READ_BYTE() (*frame->ip++)
+#define SAVE_IP() (frame->ip = ip)
+#define LOAD_FRAME() \
+    (frame = &vm.frames[vm.frameCount - 1], ip = frame->ip)
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op) \
+    (ip += 2, \
+    (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_WORD() \
+    (ip += 4, \
+    (uint32_t)((ip[-4] << 24) | (ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define CONSTANT(index) \
+    (frame->closure->function->chunk.constants.values[index])
+#define STRING(index) AS_STRING(CONSTANT(index))
+#define BINARY_OP(op) \
     do { \
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+      if (!(IS_NUMBER(peek(0)) & IS_NUMBER(peek(1)))) { \
+        SAVE_IP(); \
         runtimeError("Operands must be numbers."); \
         return INTERPRET_RUNTIME_ERROR; \
       } \
-      double b = AS_NUMBER(pop()); \
-      double a = AS_NUMBER(pop()); \
-      push(valueType(a op b)); \
+      Value b = pop(); \
+      Value a = pop(); \
+      push(op(a, b)); \
+    } while (false)
+// Unchecked arithmetic trusts the type analysis. DEBUG_VERIFY_TYPES
+// checks it anyway and aborts if the analysis was wrong.
+#ifdef DEBUG_VERIFY_TYPES
+#define VERIFY_NUMBERS(count) \
+    do { \
+      for (int i = 0; i < (count); i++) { \
+        if (!IS_NUMBER(peek(i))) { \
+          SAVE_IP(); \
+          runtimeError("Unchecked operand is not a number."); \
+          abort(); \
+        } \
+      } \
+    } while (false)
+#else
+#define VERIFY_NUMBERS(count) do { } while (false)
+#endif
+// A local function reads its captures from the frame below, which must
+// be the one running the function that declared it. DEBUG_VERIFY_ENCLOSING
+// checks that it is and aborts if not.
+#ifdef DEBUG_VERIFY_ENCLOSING
+#define VERIFY_ENCLOSING() \
+    do { \
+      if (frame == vm.frames || \
+          !declaresClosure(frame[-1].closure->function, frame->closure)) { \
+        SAVE_IP(); \
+        runtimeError("Local function is not called from its declaring frame."); \
+        abort(); \
+      } \
+    } while (false)
+#else
+#define VERIFY_ENCLOSING() do { } while (false)
+#endif
+#define NUMBER_OP(op) \
+    do { \
+      VERIFY_NUMBERS(2); \
+      Value b = pop(); \
+      Value a = pop(); \
+      push(op(a, b)); \
     } while (false)
     
     for (int iter = 0;;++iter)
@@ -328,14 +958,25 @@ static InterpretResult run()
             printf(" ]");
         }
         printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+        Chunk running = frame->closure->function->chunk;
+        OptimizedCode* optimized = optimizedFor(frame->closure->function, ip);
+        if (optimized != NULL)
+        {
+            running.code = optimized->code;
+            running.count = optimized->count;
+            running.lines = optimized->lines;
+            running.lineSize = optimized->lineSize;
+        }
+        disassembleInstruction(&running, (int)(ip - running.code));
 #endif
         uint8_t instruction;
         switch (instruction = READ_BYTE())
         {
             case OP_CONSTANT:
+                operand = READ_BYTE();
+            wideConstant:
             {
-                Value constant = READ_CONSTANT();
+                Value constant = CONSTANT(operand);
                 push(constant);
                 break;
             }
@@ -349,8 +990,8 @@ static InterpretResult run()
                 push(BOOL_VAL(valuesEqual(a, b)));
                 break;
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
+            case OP_GREATER:  BINARY_OP(greaterNumbers); break;
+            case OP_LESS:     BINARY_OP(lessNumbers); break;
             case OP_NOT:
             {
                 push(BOOL_VAL(isFalsey(pop())));
@@ -358,18 +999,19 @@ static InterpretResult run()
             }
             case OP_ADD:
             {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+                if (IS_NUMBER(peek(0)) & IS_NUMBER(peek(1)))
                 {
-                    concatenate();
+                    Value b = pop();
+                    Value a = pop();
+                    push(addNumbers(a, b));
                 }
-                else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+                else if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
                 {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+                    concatenate();
                 }
                 else
                 {
+                    SAVE_IP();
                     runtimeError("Operands must be two numbers or two strings.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
@@ -377,29 +1019,40 @@ static InterpretResult run()
             }
             case OP_SUBTRACT:
             {
-                BINARY_OP(NUMBER_VAL, -);
+                BINARY_OP(subtractNumbers);
                 break;
             }
             case OP_MULTIPLY:
             {
-                BINARY_OP(NUMBER_VAL, *);
+                BINARY_OP(multiplyNumbers);
                 break;
             }
             case OP_DIVIDE:
             {
-                BINARY_OP(NUMBER_VAL, /);
+                BINARY_OP(divideNumbers);
                 break;
             }
             case OP_NEGATE:
             {
                 if (!IS_NUMBER(peek(0)))
                 {
+                    SAVE_IP();
                     runtimeError("Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
+                push(negateNumber(pop()));
                 break;
             }
+            case OP_ADD_NUMBER:      NUMBER_OP(addNumbers); break;
+            case OP_SUBTRACT_NUMBER: NUMBER_OP(subtractNumbers); break;
+            case OP_MULTIPLY_NUMBER: NUMBER_OP(multiplyNumbers); break;
+            case OP_DIVIDE_NUMBER:   NUMBER_OP(divideNumbers); break;
+            case OP_GREATER_NUMBER:  NUMBER_OP(greaterNumbers); break;
+            case OP_LESS_NUMBER:     NUMBER_OP(lessNumbers); break;
+            case OP_NEGATE_NUMBER:
+                VERIFY_NUMBERS(1);
+                push(negateNumber(pop()));
+                break;
             case OP_PRINT:
             {
                 printValue(pop());
@@ -407,19 +1060,36 @@ static InterpretResult run()
                 break;
             }
             case OP_POP: pop(); break;
+            case OP_DUP: push(peek(0)); break;
+            case OP_SWAP:
+            {
+                Value top = peek(0);
+                vm.stackTop[-1] = peek(1);
+                vm.stackTop[-2] = top;
+                break;
+            }
             case OP_DEFINE_GLOBAL:
+                operand = READ_BYTE();
+            wideDefineGlobal:
             {
-                ObjString* name = READ_STRING();
+                ObjString* name = STRING(operand);
+                if (name->intrinsic != -1)
+                {
+                    vm.intrinsicRebound[name->intrinsic] = true;
+                }
                 tableSet(&vm.globals, name, peek(0));
                 pop();
                 break;
             }
             case OP_GET_GLOBAL:
+                operand = READ_BYTE();
+            wideGetGlobal:
             {
-                ObjString* name = READ_STRING();
+                ObjString* name = STRING(operand);
                 Value value;
                 if (!tableGet(&vm.globals, name, &value))
                 {
+                    SAVE_IP();
                     runtimeError("Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
@@ -427,65 +1097,272 @@ static InterpretResult run()
                 break;
             }
             case OP_SET_GLOBAL:
+                operand = READ_BYTE();
+            wideSetGlobal:
             {
-                ObjString* name = READ_STRING();
+                ObjString* name = STRING(operand);
                 if (tableSet(&vm.globals, name, peek(0)))
                 {
                     tableDelete(&vm.globals, name);
+                    SAVE_IP();
                     runtimeError("Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                if (name->intrinsic != -1)
+                {
+                    vm.intrinsicRebound[name->intrinsic] = true;
+                }
                 break;
             }
             case OP_GET_LOCAL:
+                operand = READ_BYTE();
+            wideGetLocal:
             {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
+                push(frame->slots[operand]);
                 break;
             }
             case OP_SET_LOCAL:
+                operand = READ_BYTE();
+            wideSetLocal:
+            {
+                frame->slots[operand] = peek(0);
+                break;
+            }
+            case OP_ADD_LOCAL:
             {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
+                Value* local = &frame->slots[READ_BYTE()];
+                Value step = CONSTANT(READ_BYTE());
+                if (!IS_NUMBER(*local))
+                {
+                    SAVE_IP();
+                    runtimeError("Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                *local = addNumbers(*local, step);
+                push(*local);
                 break;
             }
             case OP_JUMP_IF_FALSE:
             {
                 uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
+                if (isFalsey(peek(0))) ip += offset;
                 break;
             }
             case OP_JUMP:
             {
                 uint16_t offset = READ_SHORT();
-                frame->ip += offset;
+                ip += offset;
                 break;
             }
             case OP_LOOP:
             {
                 uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
+                ip -= offset;
+                break;
+            }
+            case OP_FOR_LOOP:
+            case OP_FOR_LOOP_CONSTANT:
+            {
+                Value* counter = &frame->slots[READ_BYTE()];
+                Value step = CONSTANT(READ_BYTE());
+                uint8_t limitOperand = READ_BYTE();
+                Value limit = instruction == OP_FOR_LOOP
+                    ? frame->slots[limitOperand] : CONSTANT(limitOperand);
+                // The same errors as the `+` and `<` it stands for.
+                if (!IS_NUMBER(*counter))
+                {
+                    SAVE_IP();
+                    runtimeError("Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                *counter = addNumbers(*counter, step);
+                if (!IS_NUMBER(limit))
+                {
+                    SAVE_IP();
+                    runtimeError("Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (AS_BOOL(lessNumbers(*counter, limit))) break;
+                
+                // Leave the false the loop condition would have left, and
+                // skip the OP_LOOP, which the optimizer may have widened
+                // or turned into a return.
+                push(BOOL_VAL(false));
+                ip += *ip == OP_WIDE ? 6 : *ip == OP_RETURN ? 1 : 3;
+                break;
+            }
+            case OP_JUMP_TABLE:
+            case OP_JUMP_TABLE_STRING:
+            {
+                int table = READ_SHORT();
+                int count = READ_SHORT();
+                Value value = pop();
+                int entry = count;
+                if (instruction == OP_JUMP_TABLE && IS_INT(value))
+                {
+                    int64_t index = AS_INT(value) - AS_INT(CONSTANT(table));
+                    if (index >= 0 && index < count) entry = (int)index;
+                }
+                else if (instruction == OP_JUMP_TABLE && IS_NUMBER(value))
+                {
+                    double index = AS_NUMBER(value) - AS_INT(CONSTANT(table));
+                    if (index >= 0 && index < count && index == (int)index)
+                    {
+                        entry = (int)index;
+                    }
+                }
+                else if (instruction == OP_JUMP_TABLE_STRING && IS_STRING(value))
+                {
+                    Value found;
+                    Chunk* chunk = &frame->closure->function->chunk;
+                    if (tableGet(&chunk->tables[table], AS_STRING(value), &found))
+                    {
+                        entry = (int)AS_INT(found);
+                    }
+                }
+                
+                // The entries are all wide, so the one to take is found
+                // by its number.
+                ip += 6 * entry + 1;
+                uint8_t jump = READ_BYTE();
+                uint32_t offset = READ_WORD();
+                if (jump == OP_LOOP) ip -= offset;
+                else ip += offset;
                 break;
             }
             case OP_CALL:
+                operand = READ_BYTE();
+            wideCall:
             {
                 int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount))
+                SAVE_IP();
+                if (!callSite(&frame->closure->function->chunk, operand,
+                              argCount, false))
                 {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
+                LOAD_FRAME();
+                break;
+            }
+            case OP_TAIL_CALL:
+                operand = READ_BYTE();
+            wideTailCall:
+            {
+                int argCount = READ_BYTE();
+                SAVE_IP();
+                if (!callSite(&frame->closure->function->chunk, operand,
+                              argCount, true))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                break;
+            }
+// A specialized call whose callee is of another kind is made as OP_CALL
+// would make it.
+#define SPECIALIZED_CALL(type, callKind, as) \
+    do { \
+        int argCount = READ_BYTE(); \
+        Value callee = peek(argCount); \
+        SAVE_IP(); \
+        bool called = isObjType(callee, type) \
+            ? callKind(as(callee), argCount) \
+            : callSite(&frame->closure->function->chunk, operand, \
+                       argCount, false); \
+        if (!called) return INTERPRET_RUNTIME_ERROR; \
+        LOAD_FRAME(); \
+    } while (false)
+            case OP_CALL_CLOSURE:
+                operand = READ_BYTE();
+            wideCallClosure:
+            {
+                // The closure the site cached goes straight to frame
+                // setup, as from OP_CALL.
+                int argCount = READ_BYTE();
+                Value callee = peek(argCount);
+                Chunk* chunk = &frame->closure->function->chunk;
+                CallCache* cache = &chunk->calls[operand];
+                SAVE_IP();
+                bool called;
+                if (IS_OBJ(callee) && AS_OBJ(callee) == (Obj*)cache->target &&
+                    cache->type == OBJ_CLOSURE)
+                {
+                    called = pushFrame(AS_CLOSURE(callee), argCount);
+                }
+                else if (IS_CLOSURE(callee))
+                {
+                    called = call(AS_CLOSURE(callee), argCount);
+                }
+                else
+                {
+                    called = callSite(chunk, operand, argCount, false);
+                }
+                if (!called) return INTERPRET_RUNTIME_ERROR;
+                LOAD_FRAME();
+                break;
+            }
+            case OP_CALL_NATIVE:
+                operand = READ_BYTE();
+            wideCallNative:
+                SPECIALIZED_CALL(OBJ_NATIVE, callNative, AS_NATIVE);
+                break;
+            case OP_CALL_CLASS:
+                operand = READ_BYTE();
+            wideCallClass:
+                SPECIALIZED_CALL(OBJ_CLASS, callClass, AS_CLASS);
+                break;
+            case OP_CALL_BOUND_METHOD:
+                operand = READ_BYTE();
+            wideCallBoundMethod:
+                SPECIALIZED_CALL(OBJ_BOUND_METHOD, callBoundMethod,
+                                 AS_BOUND_METHOD);
+                break;
+#undef SPECIALIZED_CALL
+            case OP_INTRINSIC:
+            {
+                int intrinsic = READ_BYTE();
+                int argCount = READ_BYTE();
+                Value* args = vm.stackTop - argCount;
+                if (vm.intrinsicRebound[intrinsic])
+                {
+                    // Call what the global holds now, put under the
+                    // arguments as OP_CALL would have it.
+                    Value callee;
+                    tableGet(&vm.globals, vm.intrinsicNames[intrinsic], &callee);
+                    memmove(args + 1, args, sizeof(Value) * argCount);
+                    *args = callee;
+                    vm.stackTop++;
+                    SAVE_IP();
+                    if (!callValue(callee, argCount))
+                    {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    LOAD_FRAME();
+                    break;
+                }
+                
+                Value result;
+                SAVE_IP();
+                if (!runIntrinsic(intrinsic, argCount, args, &result))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                vm.stackTop = args;
+                push(result);
                 break;
             }
             case OP_CLOSURE:
+                operand = READ_BYTE();
+                wide = false;
+            wideClosure:
             {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                ObjFunction* function = AS_FUNCTION(CONSTANT(operand));
                 ObjClosure* closure = newClosure(function);
                 push(OBJ_VAL(closure));
                 for (int i = 0; i < closure->upvalueCount; i++)
                 {
                     uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
+                    int index = wide ? READ_SHORT() : READ_BYTE();
                     if (isLocal)
                     {
                         closure->upvalues[i] =
@@ -498,39 +1375,73 @@ static InterpretResult run()
                 }
                 break;
             }
+            case OP_LOCAL_CLOSURE:
+            {
+                // The upvalue list after it is only read by the
+                // optimizing tier.
+                ObjClosure* closure = AS_CLOSURE(CONSTANT(READ_BYTE()));
+                push(OBJ_VAL(closure));
+                ip += 2 * closure->upvalueCount;
+                break;
+            }
             case OP_GET_UPVALUE:
+                operand = READ_BYTE();
+            wideGetUpvalue:
             {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
+                push(*frame->closure->upvalues[operand]->location);
                 break;
             }
             case OP_SET_UPVALUE:
+                operand = READ_BYTE();
+            wideSetUpvalue:
             {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                *frame->closure->upvalues[operand]->location = peek(0);
+                break;
+            }
+            case OP_GET_ENCLOSING:
+            {
+                // A local function is only called from the frame it was
+                // declared in, which is the one below.
+                VERIFY_ENCLOSING();
+                push(frame[-1].slots[READ_BYTE()]);
+                break;
+            }
+            case OP_SET_ENCLOSING:
+            {
+                VERIFY_ENCLOSING();
+                frame[-1].slots[READ_BYTE()] = peek(0);
                 break;
             }
             case OP_CLOSE_UPVALUE:
             {
-                closeUpvalues(vm.stackTop - 1);
+                int slot = (int)(vm.stackTop - 1 - vm.stack);
+                if (vm.openUpvalueSlots[slot] != 0)
+                {
+                    closeUpvalue(vm.openUpvalueSlots[slot] - 1);
+                }
                 pop();
                 break;
             }
             case OP_CLASS:
+                operand = READ_BYTE();
+            wideClass:
             {
-                push(OBJ_VAL(newClass(READ_STRING())));
+                push(OBJ_VAL(newClass(STRING(operand))));
                 break;
             }
             case OP_GET_PROPERTY:
+                operand = READ_BYTE();
+            wideGetProperty:
             {
                 if (!IS_INSTANCE(peek(0)))
                 {
+                    SAVE_IP();
                     runtimeError("Only instances have properties.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING();
+                ObjString* name = STRING(operand);
 
                 Value value;
                 if (tableGet(&instance->fields, name, &value))
@@ -539,6 +1450,7 @@ static InterpretResult run()
                     push(value);
                     break;
                 }
+                SAVE_IP();
                 if (!bindMethod(instance->klass, name))
                 {
                     return INTERPRET_RUNTIME_ERROR;
@@ -546,34 +1458,101 @@ static InterpretResult run()
                 break;
             }
             case OP_SET_PROPERTY:
+                operand = READ_BYTE();
+            wideSetProperty:
             {
                 if (!IS_INSTANCE(peek(1)))
                 {
+                    SAVE_IP();
                     runtimeError("Only instances have fields.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
+                tableSet(&instance->fields, STRING(operand), peek(0));
 
                 Value value = pop();
                 pop();
                 push(value);
                 break;
             }
+            case OP_ADD_PROPERTY:
+            {
+                ObjString* name = STRING(READ_BYTE());
+                Value step = CONSTANT(READ_BYTE());
+                if (!IS_INSTANCE(peek(0)))
+                {
+                    SAVE_IP();
+                    runtimeError("Only instances have properties.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                
+                ObjInstance* instance = AS_INSTANCE(peek(0));
+                Value* field = tableFind(&instance->fields, name);
+                if (field == NULL && findMethod(instance->klass, name) == NULL)
+                {
+                    SAVE_IP();
+                    runtimeError("Undefined property '%s'.", name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                // A method is no better an operand than a non-number.
+                if (field == NULL || !IS_NUMBER(*field))
+                {
+                    SAVE_IP();
+                    runtimeError("Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                *field = addNumbers(*field, step);
+                pop(); // Instance.
+                push(*field);
+                break;
+            }
             case OP_METHOD:
+                operand = READ_BYTE();
+            wideMethod:
             {
-                defineMethod(READ_STRING());
+                defineMethod(STRING(operand));
                 break;
             }
             case OP_INVOKE:
+                operand = READ_BYTE();
+            wideInvoke:
             {
-                ObjString* method = READ_STRING();
+                ObjString* method = STRING(operand);
                 int argCount = READ_BYTE();
+                SAVE_IP();
                 if (!invoke(method, argCount))
                 {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
+                LOAD_FRAME();
+                break;
+            }
+            case OP_TAIL_INVOKE:
+                operand = READ_BYTE();
+            wideTailInvoke:
+            {
+                ObjString* name = STRING(operand);
+                int argCount = READ_BYTE();
+                Value receiver = peek(argCount);
+                
+                // Only a method found on the class can reuse the frame.
+                // Fields holding callables and errors go through invoke().
+                ObjClosure* method = NULL;
+                Value value;
+                if (IS_INSTANCE(receiver) &&
+                    !tableGet(&AS_INSTANCE(receiver)->fields, name, &value))
+                {
+                    method = findMethod(AS_INSTANCE(receiver)->klass, name);
+                }
+                
+                SAVE_IP();
+                bool called = method != NULL ? tailCall(method, argCount)
+                                             : invoke(name, argCount);
+                if (!called)
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
                 break;
             }
             case OP_INHERIT:
@@ -581,18 +1560,34 @@ static InterpretResult run()
                 Value superclass = peek(1);
                 if (!IS_CLASS(superclass))
                 {
+                    SAVE_IP();
                     runtimeError("Superclass must be a class.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                // The subclass has no methods yet, so it starts out with
+                // the parent's.
                 ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+                ObjClass* parent = AS_CLASS(superclass);
+                if (parent->vtableCount > 0)
+                {
+                    resizeVtable(subclass, parent->vtableBase,
+                                 parent->vtableBase + parent->vtableCount);
+                    memcpy(subclass->vtable, parent->vtable,
+                           sizeof(subclass->vtable[0]) * parent->vtableCount);
+                }
+                subclass->methodCount = parent->methodCount;
+                tableAddAll(&parent->methods, &subclass->methods);
+                subclass->initializer = parent->initializer;
                 pop(); // Subclass.
                 break;
             }
             case OP_GET_SUPER:
+                operand = READ_BYTE();
+            wideGetSuper:
             {
-                ObjString* name = READ_STRING();
+                ObjString* name = STRING(operand);
                 ObjClass* superclass = AS_CLASS(pop());
+                SAVE_IP();
                 if (!bindMethod(superclass, name))
                 {
                     return INTERPRET_RUNTIME_ERROR;
@@ -600,17 +1595,80 @@ static InterpretResult run()
                 break;
             }
             case OP_SUPER_INVOKE:
+                operand = READ_BYTE();
+            wideSuperInvoke:
             {
-                ObjString* method = READ_STRING();
+                ObjString* method = STRING(operand);
                 int argCount = READ_BYTE();
                 ObjClass* superclass = AS_CLASS(pop());
+                SAVE_IP();
                 if (!invokeFromClass(superclass, method, argCount))
                 {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
+                LOAD_FRAME();
+                break;
+            }
+            case OP_INLINE_CALL:
+            {
+                int argCount = READ_BYTE();
+                Value expected = CONSTANT(READ_SHORT());
+                uint16_t skip = READ_SHORT();
+                Value callee = peek(argCount);
+                if (IS_OBJ(callee) && AS_OBJ(callee) == AS_OBJ(expected)) break;
+                
+                ip += skip;
+                SAVE_IP();
+                if (!callValue(callee, argCount))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
+                break;
+            }
+            case OP_INLINE_INVOKE:
+            {
+                ObjString* name = STRING(READ_SHORT());
+                int argCount = READ_BYTE();
+                Value expected = CONSTANT(READ_SHORT());
+                uint16_t skip = READ_SHORT();
+                Value receiver = peek(argCount);
+                Value value;
+                if (IS_INSTANCE(receiver) &&
+                    (Obj*)findMethod(AS_INSTANCE(receiver)->klass, name) ==
+                        AS_OBJ(expected) &&
+                    !tableGet(&AS_INSTANCE(receiver)->fields, name, &value))
+                {
+                    break;
+                }
+                
+                ip += skip;
+                SAVE_IP();
+                if (!invoke(name, argCount))
+                {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                LOAD_FRAME();
                 break;
             }
+            case OP_INLINE_RETURN:
+            {
+                Value result = pop();
+                vm.stackTop = frame->slots + READ_BYTE();
+                push(result);
+                break;
+            }
+            case OP_REUSE_PROPERTY:
+            {
+                Value value = frame->slots[READ_BYTE()];
+                operand = READ_SHORT();
+                if (!IS_BOUND_METHOD(value))
+                {
+                    vm.stackTop[-1] = value;
+                    break;
+                }
+                goto wideGetProperty;
+            }
             case OP_RETURN:
             {
                 Value result = pop();
@@ -627,23 +1685,94 @@ static InterpretResult run()
                 vm.stackTop = frame->slots;
                 push(result);
 
-                frame = &vm.frames[vm.frameCount - 1];
+                LOAD_FRAME();
+                break;
+            }
+            case OP_WIDE:
+            {
+                instruction = READ_BYTE();
+                switch (instruction)
+                {
+                    case OP_JUMP_IF_FALSE:
+                    {
+                        uint32_t offset = READ_WORD();
+                        if (isFalsey(peek(0))) ip += offset;
+                        break;
+                    }
+                    case OP_JUMP:
+                    {
+                        uint32_t offset = READ_WORD();
+                        ip += offset;
+                        break;
+                    }
+                    case OP_LOOP:
+                    {
+                        uint32_t offset = READ_WORD();
+                        ip -= offset;
+                        break;
+                    }
+                    default:
+                        operand = READ_SHORT();
+                        break;
+                }
+                
+                switch (instruction)
+                {
+                    case OP_CONSTANT:      goto wideConstant;
+                    case OP_DEFINE_GLOBAL: goto wideDefineGlobal;
+                    case OP_GET_GLOBAL:    goto wideGetGlobal;
+                    case OP_SET_GLOBAL:    goto wideSetGlobal;
+                    case OP_GET_LOCAL:     goto wideGetLocal;
+                    case OP_CALL:          goto wideCall;
+                    case OP_TAIL_CALL:     goto wideTailCall;
+                    case OP_CALL_CLOSURE:  goto wideCallClosure;
+                    case OP_CALL_NATIVE:   goto wideCallNative;
+                    case OP_CALL_CLASS:    goto wideCallClass;
+                    case OP_CALL_BOUND_METHOD: goto wideCallBoundMethod;
+                    case OP_SET_LOCAL:     goto wideSetLocal;
+                    case OP_CLOSURE:       wide = true; goto wideClosure;
+                    case OP_GET_UPVALUE:   goto wideGetUpvalue;
+                    case OP_SET_UPVALUE:   goto wideSetUpvalue;
+                    case OP_CLASS:         goto wideClass;
+                    case OP_GET_PROPERTY:  goto wideGetProperty;
+                    case OP_SET_PROPERTY:  goto wideSetProperty;
+                    case OP_METHOD:        goto wideMethod;
+                    case OP_INVOKE:        goto wideInvoke;
+                    case OP_TAIL_INVOKE:   goto wideTailInvoke;
+                    case OP_GET_SUPER:     goto wideGetSuper;
+                    case OP_SUPER_INVOKE:  goto wideSuperInvoke;
+                    default: break;
+                }
                 break;
             }
         }
     }
 
+#undef SAVE_IP
+#undef LOAD_FRAME
 #undef READ_BYTE
 #undef READ_SHORT
-#undef READ_CONSTANT
-#undef READ_STRING
+#undef READ_WORD
+#undef CONSTANT
+#undef STRING
 #undef BINARY_OP
+#undef VERIFY_NUMBERS
+#undef NUMBER_OP
 }
 
 InterpretResult interpret(const char* source)
 {
     ObjFunction* function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    
+    // The limit is only checked when the frame array is full, so a
+    // lowered limit takes effect by shrinking the array.
+    if (vm.frameCapacity > vm.maxFrames)
+    {
+        vm.frames = GROW_ARRAY(CallFrame, vm.frames,
+                               vm.frameCapacity, vm.maxFrames);
+        vm.frameCapacity = vm.maxFrames;
+    }
 
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
@@ -651,5 +1780,7 @@ InterpretResult interpret(const char* source)
     push(OBJ_VAL(closure));
     callValue(OBJ_VAL(closure), 0);
 
-    return run();
+    vm.compileError = false;
+    InterpretResult result = run();
+    return vm.compileError ? INTERPRET_COMPILE_ERROR : result;
 }
@@ -3,9 +3,35 @@
 #include "chunk.h"
 #include "table.h"
 #include "object.h"
+#include "memory.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Default limit on call depth. The stack and frame arrays start small and
+// grow on demand up to it. Set vm.maxFrames between calls to interpret()
+// to change it.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 16384
+#endif
+
+// The math natives. A call of one by its global name compiles to
+// OP_INTRINSIC, which does the math on the stack without a call.
+typedef enum
+{
+    INTRINSIC_ABS,
+    INTRINSIC_CEIL,
+    INTRINSIC_FLOOR,
+    INTRINSIC_SQRT,
+    INTRINSIC_EXP,
+    INTRINSIC_LOG,
+    INTRINSIC_SIN,
+    INTRINSIC_COS,
+    INTRINSIC_TAN,
+    INTRINSIC_ATAN,
+    INTRINSIC_ATAN2,
+    INTRINSIC_MIN,
+    INTRINSIC_MAX,
+    INTRINSIC_POW,
+    INTRINSIC_COUNT
+} Intrinsic;
 
 typedef struct
 {
@@ -16,13 +42,33 @@ typedef struct
 
 typedef struct
 {
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stackTop;
+    int stackCapacity;
     Table strings;
     Table globals;
-    Obj* objects;
-    CallFrame frames[FRAMES_MAX];
-    ObjUpvalue* openUpvalues;
+    // Values of the top-level constants, which the compiler puts in the
+    // code wherever they are used.
+    Table constants;
+    // Names the code compiled so far uses as globals, which a constant
+    // declared after can't take.
+    Table globalNames;
+    // Where the compiler builds code, until endCompiler() packs it.
+    Arena codeArena;
+    // Where it packs it.
+    CodeSpace codeSpace;
+    ObjPage* pages[OBJ_TYPE_COUNT];
+    Obj* freeSlots[OBJ_TYPE_COUNT];
+    CallFrame* frames;
+    int frameCapacity;
+    int maxFrames;
+    // Open upvalues in capture order. Those of the running frame are
+    // always at the end, since a frame only captures its own slots.
+    // Both arrays are stackCapacity long.
+    ObjUpvalue** openUpvalues;
+    int openUpvalueCount;
+    // For each stack slot, 1 + the index of its open upvalue, or 0.
+    int* openUpvalueSlots;
     int frameCount;
     int grayCount;
     int grayCapacity;
@@ -30,6 +76,21 @@ typedef struct
     size_t bytesAllocated;
     size_t nextGC;
     ObjString* initString;
+    // Method names by selector. Keeping them alive keeps their
+    // selectors stable.
+    ObjString** selectors;
+    // For each selector, the one method defined with it, nil before
+    // there is one and false once there are several.
+    Value* selectorMethods;
+    int selectorCount;
+    int selectorCapacity;
+    // Set when the body of a function compiled on its first call has
+    // errors, which end the script as a compile error.
+    bool compileError;
+    // The intrinsics' global names, and whether each global has been
+    // assigned since, which sends OP_INTRINSIC to whatever it holds.
+    ObjString* intrinsicNames[INTRINSIC_COUNT];
+    bool intrinsicRebound[INTRINSIC_COUNT];
 } VM;
 
 typedef enum
@@ -44,5 +105,8 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+// The intrinsic with the given name, or -1.
+int findIntrinsic(const char* name, int length);
 void push(Value value);
 Value pop();
+int methodSelector(ObjString* name);